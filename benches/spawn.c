@@ -0,0 +1,53 @@
+// Spawns per second depending on the size of the heap of the parent process.
+//
+//   $ cc -O2 -o build/spawn benches/spawn.c
+//   $ cc -O2 -DSTITCH_USE_FORK -o build/spawn_fork benches/spawn.c
+//   $ ./build/spawn && ./build/spawn_fork
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "../stitch.h"
+
+#include <time.h>
+
+#define SPAWNS_COUNT 500
+
+double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+int main(void)
+{
+    size_t heap_sizes_mb[] = {0, 64, 256, 1024};
+    Cmd cmd = {0};
+    cmd_append(&cmd, "true");
+
+#ifdef STITCH_USE_FORK
+    const char *backend = "fork";
+#else
+    const char *backend = "posix_spawn";
+#endif // STITCH_USE_FORK
+
+    // NOTE: the spawned commands are logged at INFO
+    minimal_log_level = WARNING;
+    for (size_t i = 0; i < ARRAY_LEN(heap_sizes_mb); ++i) {
+        size_t heap_size = heap_sizes_mb[i]*1024*1024;
+        char *heap = malloc(heap_size);
+        // Touch every page, otherwise there is nothing to copy
+        if (heap) memset(heap, 0xAA, heap_size);
+
+        double start = now_secs();
+        for (size_t j = 0; j < SPAWNS_COUNT; ++j) {
+            if (!proc_wait(cmd_run_async(cmd))) return 1;
+        }
+        double elapsed = now_secs() - start;
+
+        printf("%-12s heap %5zu MB: %8.0f spawns/sec\n", backend, heap_sizes_mb[i], SPAWNS_COUNT/elapsed);
+        free(heap);
+    }
+
+    cmd_free(cmd);
+    return 0;
+}
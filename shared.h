@@ -12,7 +12,7 @@ bool build_exec(Cmd *cmd, const char *bin_path, const char *src_path)
 #ifdef _MSC_VER
     cmd_append(cmd, "cl", "-I.", "-o", bin_path, src_path);
 #else
-    cmd_append(cmd, "cc", "-Wall", "-Wextra", "-Wswitch-enum", "-ggdb", "-I.", "-o", bin_path, src_path);
+    cmd_append(cmd, "cc", "-Wall", "-Wextra", "-Wswitch-enum", "-ggdb", "-pthread", "-I.", "-o", bin_path, src_path);
 #endif //  _MSC_VER
     return cmd_run_sync_and_reset(cmd);
 }
@@ -12,13 +12,38 @@ const char *test_names[] = {
     "cmd_redirect",
 #ifdef _WIN32
     "win32_error",
+#else
+    "needs_rebuild",
+    "rebuild_hash",
+    "cmd_signature",
+    "action_cache",
+    "cmd_run_alloc",
+    "cmd_capture",
+    "jobs_output",
+    "trace",
+    "proc_result",
+    "critical_path",
+    "sync_directory",
+    "map_file",
+    "write_if_changed",
+    "walk_dir",
+    "watch",
+    "threads",
 #endif //_WIN32
     "read_entire_dir",
+    "copy_file",
+    "glob",
+    "temp_arena",
+    "da_arena",
+    "small_cmd",
     "da_resize",
     "da_last",
     "da_remove_unordered",
     "da_append",
     "sb_appendf",
+    "jobs",
+    "graph",
+    "depfile",
 };
 #define test_names_count ARRAY_LEN(test_names)
 
@@ -1,3 +1,4 @@
+#ifndef STITCH_H_
 #define STITCH_H_
 
 #ifndef STITCH_ASSERT
@@ -23,6 +24,8 @@
 #include <errno.h>
 #include <ctype.h>
 #include <limits.h>
+#include <stdint.h>
+#include <time.h>
 
 #ifdef _WIN32
 #    define WIN32_LEAN_AND_MEAN
@@ -36,9 +39,23 @@
 #else
 #    include <sys/types.h>
 #    include <sys/wait.h>
+#    include <sys/resource.h>
 #    include <sys/stat.h>
 #    include <unistd.h>
 #    include <fcntl.h>
+#    include <sys/file.h>
+#    include <spawn.h>
+#    include <poll.h>
+#    include <signal.h>
+#    include <pthread.h>
+#    include <sys/mman.h>
+#    ifdef __linux__
+#        include <sys/ioctl.h>
+#        include <sys/syscall.h>
+#        include <sys/sendfile.h>
+#        include <linux/fs.h>
+#        include <sys/inotify.h>
+#    endif
 #endif
 
 #ifdef _WIN32
@@ -72,9 +89,30 @@ typedef enum {
 
 // Any messages with the level below stitch_minimal_log_level are going to be suppressed.
 extern Stitch_Log_Level stitch_minimal_log_level;
+// Atomic access to stitch_minimal_log_level for when other threads might be logging at the same time
+void stitch_set_minimal_log_level(Stitch_Log_Level level);
+Stitch_Log_Level stitch_get_minimal_log_level(void);
 
+// Writes the whole line with a single call, so the lines logged by different threads (and the output
+// of the commands running in parallel) never interleave.
 void stitch_log(Stitch_Log_Level level, const char *fmt, ...) STITCH_PRINTF_FORMAT(2, 3);
 
+// Thread safety. The functions that do not take a container, a graph or any other object of yours can be
+// called from several threads at once, with these exceptions:
+// - The temporary allocator (stitch_temp_*()) is per thread. The strings it returns must not outlive the thread.
+//   Call stitch_temp_free() before a thread that used it exits.
+// - The stat, hash and deps caches, the build log and the command trace and stats are guarded by locks. The files
+//   are stat()-ed, hashed and parsed outside of the locks. The deps from stitch_depfile_deps() stay valid until
+//   the deps cache is reloaded, so don't reload it while the other threads are using them.
+// - The configuration globals (stitch_stat_cache_enabled, stitch_rebuild_mode, stitch_proc_stats_enabled) are
+//   plain variables. Set them before starting the threads.
+// - stitch_set_current_dir() changes the directory of the whole process.
+// - The commands can be run and waited on from several threads. A Stitch_Proc must only be waited on once, and
+//   the job pools only reap their own children. stitch_cmd_run_capture*() makes the whole process ignore SIGPIPE
+//   for good (unless it already handles it), while the commands still get the default disposition.
+// - Your own objects (Stitch_Cmd, Stitch_String_Builder, Stitch_Arena, Stitch_Jobs, Stitch_Graph, ...) are not
+//   locked. Don't share them between the threads without a lock of your own.
+
 // It is an equivalent of shift command from bash. It basically pops an element from
 // the beginning of a sized array.
 #define stitch_shift(xs, xs_sz) (STITCH_ASSERT((xs_sz) > 0), (xs_sz)--, *(xs)++)
@@ -98,10 +136,34 @@ typedef enum {
 } Stitch_File_Type;
 
 bool stitch_mkdir_if_not_exists(const char *path);
+// Tries the cheapest way first: a reflink (FICLONE), copy_file_range(), sendfile() and only then copying
+// through a buffer in the user space.
 bool stitch_copy_file(const char *src_path, const char *dst_path);
+// Make dst_path a hardlink of src_path, so both of them share the inode. Falls back to stitch_copy_file()
+// if the hardlink could not be created (e.g. the paths are on different file systems). Only use it when
+// nothing is going to modify either of the files in place, like for installing the artifacts.
+bool stitch_link_or_copy_file(const char *src_path, const char *dst_path);
 bool stitch_copy_directory_recursively(const char *src_path, const char *dst_path);
+
+typedef struct {
+    size_t threads;          // How many threads copy the files. 0 means stitch_nprocs(). Needs STITCH_USE_THREADS
+    bool compare_contents;   // Files with the same size but different mtimes are compared by the hashes of their contents
+} Stitch_Sync_Opt;
+
+// Make dst_path the copy of src_path like stitch_copy_directory_recursively(), but only copy the files whose size
+// or mtime differ at dst_path. The copies get the mtimes of their sources, so the next sync skips them. The files
+// that only exist at dst_path are left alone. Define STITCH_USE_THREADS to copy the files in parallel on POSIX
+// (with glibc older than 2.34 that also means building with -pthread), otherwise they are copied one by one.
+bool stitch_sync_directory(const char *src_path, const char *dst_path, Stitch_Sync_Opt opt);
 bool stitch_read_entire_dir(const char *parent, Stitch_File_Paths *children);
 bool stitch_write_entire_file(const char *path, const void *data, size_t size);
+// Write into a temporary file next to path and rename it into place, so the readers never see a half-written file.
+// The new file keeps the mode of the old one and a symlink at path is followed, so the file it points to is replaced.
+bool stitch_write_entire_file_atomic(const char *path, const void *data, size_t size);
+// Same as stitch_write_entire_file_atomic(), but leaves the file (and its mtime) alone if it already has exactly
+// that content. Regenerating a header this way does not rebuild everything that includes it.
+// RETURNS 1 - written, 0 - unchanged, -1 - error.
+int stitch_write_entire_file_if_changed(const char *path, const void *data, size_t size);
 Stitch_File_Type stitch_get_file_type(const char *path);
 bool stitch_delete_file(const char *path);
 
@@ -111,43 +173,75 @@ bool stitch_delete_file(const char *path);
 #ifndef STITCH_DA_INIT_CAP
 #define STITCH_DA_INIT_CAP 256
 #endif
+// Initial capacities of the commands and the string builders. A graph of thousands of targets
+// keeps a command per target, so the commands start way smaller than the other arrays.
+#ifndef STITCH_CMD_INIT_CAP
+#define STITCH_CMD_INIT_CAP 32
+#endif
+// Same for the inputs, outputs, deps and dependents of the graph targets, most of which have just a few of each
+#ifndef STITCH_TARGET_INIT_CAP
+#define STITCH_TARGET_INIT_CAP 4
+#endif
+#ifndef STITCH_SB_INIT_CAP
+#define STITCH_SB_INIT_CAP 256
+#endif
 
-#define stitch_da_reserve(da, expected_capacity)                                              \
-    do {                                                                                   \
-        if ((expected_capacity) > (da)->capacity) {                                        \
-            if ((da)->capacity == 0) {                                                     \
-                (da)->capacity = STITCH_DA_INIT_CAP;                                          \
-            }                                                                              \
-            while ((expected_capacity) > (da)->capacity) {                                 \
-                (da)->capacity *= 2;                                                       \
-            }                                                                              \
-            (da)->items = STITCH_REALLOC((da)->items, (da)->capacity * sizeof(*(da)->items)); \
-            STITCH_ASSERT((da)->items != NULL && "Buy more RAM lol");                         \
-        }                                                                                  \
+// The core of the dynamic arrays. The memory comes from grow(ctx, items, old_size, new_size), so the regular
+// arrays (STITCH_REALLOC) and the arena-backed ones (stitch_arena_realloc()) share everything but the allocator.
+#define stitch__da_reserve_with(grow, ctx, da, expected_capacity, init_capacity) \
+    do {                                                                         \
+        if ((expected_capacity) > (da)->capacity) {                              \
+            size_t old_capacity = (da)->capacity;                                \
+            if ((da)->capacity == 0) {                                           \
+                (da)->capacity = (init_capacity);                                \
+            }                                                                    \
+            while ((expected_capacity) > (da)->capacity) {                       \
+                (da)->capacity *= 2;                                             \
+            }                                                                    \
+            (da)->items = grow((ctx), (da)->items,                               \
+                               old_capacity*sizeof(*(da)->items),                \
+                               (da)->capacity*sizeof(*(da)->items));             \
+            STITCH_ASSERT((da)->items != NULL && "Buy more RAM lol");            \
+        }                                                                        \
     } while (0)
 
-// Append an item to a dynamic array
-#define stitch_da_append(da, item)                \
-    do {                                       \
-        stitch_da_reserve((da), (da)->count + 1); \
-        (da)->items[(da)->count++] = (item);   \
+#define stitch__da_append_with(grow, ctx, da, item, init_capacity)                    \
+    do {                                                                              \
+        stitch__da_reserve_with(grow, (ctx), (da), (da)->count + 1, (init_capacity)); \
+        (da)->items[(da)->count++] = (item);                                          \
     } while (0)
 
+#define stitch__da_append_many_with(grow, ctx, da, new_items, new_items_count, init_capacity)         \
+    do {                                                                                              \
+        stitch__da_reserve_with(grow, (ctx), (da), (da)->count + (new_items_count), (init_capacity)); \
+        memcpy((da)->items + (da)->count, (new_items), (new_items_count)*sizeof(*(da)->items));       \
+        (da)->count += (new_items_count);                                                             \
+    } while (0)
+
+#define stitch__da_resize_with(grow, ctx, da, new_size, init_capacity)           \
+    do {                                                                         \
+        stitch__da_reserve_with(grow, (ctx), (da), (new_size), (init_capacity)); \
+        (da)->count = (new_size);                                                \
+    } while (0)
+
+#define stitch__da_heap_grow(ctx, items, old_size, new_size) ((void) (ctx), (void) (old_size), STITCH_REALLOC((items), (new_size)))
+
+#define stitch_da_reserve(da, expected_capacity) stitch__da_reserve_init_cap(da, expected_capacity, STITCH_DA_INIT_CAP)
+#define stitch__da_reserve_init_cap(da, expected_capacity, init_capacity) \
+    stitch__da_reserve_with(stitch__da_heap_grow, NULL, da, expected_capacity, init_capacity)
+
+// Append an item to a dynamic array
+#define stitch_da_append(da, item) stitch__da_append_with(stitch__da_heap_grow, NULL, da, item, STITCH_DA_INIT_CAP)
+
 #define stitch_da_free(da) STITCH_FREE((da).items)
 
 // Append several items to a dynamic array
-#define stitch_da_append_many(da, new_items, new_items_count)                                      \
-    do {                                                                                        \
-        stitch_da_reserve((da), (da)->count + (new_items_count));                                  \
-        memcpy((da)->items + (da)->count, (new_items), (new_items_count)*sizeof(*(da)->items)); \
-        (da)->count += (new_items_count);                                                       \
-    } while (0)
+#define stitch_da_append_many(da, new_items, new_items_count) \
+    stitch__da_append_many_init_cap(da, new_items, new_items_count, STITCH_DA_INIT_CAP)
+#define stitch__da_append_many_init_cap(da, new_items, new_items_count, init_capacity) \
+    stitch__da_append_many_with(stitch__da_heap_grow, NULL, da, new_items, new_items_count, init_capacity)
 
-#define stitch_da_resize(da, new_size)     \
-    do {                                \
-        stitch_da_reserve((da), new_size); \
-        (da)->count = (new_size);       \
-    } while (0)
+#define stitch_da_resize(da, new_size) stitch__da_resize_with(stitch__da_heap_grow, NULL, da, new_size, STITCH_DA_INIT_CAP)
 
 #define stitch_da_last(da) (da)->items[(STITCH_ASSERT((da)->count > 0), (da)->count-1)]
 #define stitch_da_remove_unordered(da, i)               \
@@ -167,19 +261,19 @@ bool stitch_read_entire_file(const char *path, Stitch_String_Builder *sb);
 int stitch_sb_appendf(Stitch_String_Builder *sb, const char *fmt, ...) STITCH_PRINTF_FORMAT(2, 3);
 
 // Append a sized buffer to a string builder
-#define stitch_sb_append_buf(sb, buf, size) stitch_da_append_many(sb, buf, size)
+#define stitch_sb_append_buf(sb, buf, size) stitch__da_append_many_init_cap(sb, buf, size, STITCH_SB_INIT_CAP)
 
 // Append a NULL-terminated string to a string builder
-#define stitch_sb_append_cstr(sb, cstr)  \
-    do {                              \
-        const char *s = (cstr);       \
-        size_t n = strlen(s);         \
-        stitch_da_append_many(sb, s, n); \
+#define stitch_sb_append_cstr(sb, cstr)                               \
+    do {                                                           \
+        const char *s = (cstr);                                    \
+        size_t n = strlen(s);                                      \
+        stitch__da_append_many_init_cap(sb, s, n, STITCH_SB_INIT_CAP); \
     } while (0)
 
 // Append a single NULL character at the end of a string builder. So then you can
 // use it a NULL-terminated C string
-#define stitch_sb_append_null(sb) stitch_da_append_many(sb, "", 1)
+#define stitch_sb_append_null(sb) stitch__da_append_many_init_cap(sb, "", 1, STITCH_SB_INIT_CAP)
 
 // Free the memory allocated by a string builder
 #define stitch_sb_free(sb) STITCH_FREE((sb).items)
@@ -213,6 +307,27 @@ bool stitch_procs_wait_and_reset(Stitch_Procs *procs);
 // Wait until the process has finished
 bool stitch_proc_wait(Stitch_Proc proc);
 
+// What a finished command has done and how much it has cost
+typedef struct {
+    bool ok;             // Whether the command exited with 0
+    int exit_code;       // -1 if the command was terminated by a signal
+    int signal;          // The signal that terminated the command, 0 if it exited normally
+    uint64_t wall_ns;    // From the launch of the command until it was reaped
+    uint64_t user_ns;    // CPU time spent in the user mode
+    uint64_t sys_ns;     // CPU time spent in the kernel
+    uint64_t max_rss;    // Peak resident set size in bytes. Not available on Windows
+} Stitch_Proc_Result;
+
+// Same as stitch_proc_wait(), but also reports the exit status and the resource usage of the command (via wait4()
+// on POSIX). Returns true if the command exited with 0. The result is all zeros if the waiting itself failed.
+bool stitch_proc_wait_result(Stitch_Proc proc, Stitch_Proc_Result *result);
+// Collect the Stitch_Proc_Result of every command that is reaped with stitch_proc_wait*() or stitch_jobs_*()
+// for stitch_proc_stats_report(). It costs rendering every launched command, so it's disabled by default.
+extern bool stitch_proc_stats_enabled;
+// Log the totals and the tables of the top_n slowest and the most memory-hungry commands collected so far
+void stitch_proc_stats_report(size_t top_n);
+void stitch_proc_stats_reset(void);
+
 // A command - the main workhorse of Stitch. Stitch is all about building commands an running them
 typedef struct {
     const char **items;
@@ -245,22 +360,59 @@ typedef struct {
 void stitch_cmd_render(Stitch_Cmd cmd, Stitch_String_Builder *render);
 
 #define stitch_cmd_append(cmd, ...) \
-    stitch_da_append_many(cmd, \
-                       ((const char*[]){__VA_ARGS__}), \
-                       (sizeof((const char*[]){__VA_ARGS__})/sizeof(const char*)))
+    stitch__da_append_many_init_cap(cmd, \
+                                 ((const char*[]){__VA_ARGS__}), \
+                                 (sizeof((const char*[]){__VA_ARGS__})/sizeof(const char*)), \
+                                 STITCH_CMD_INIT_CAP)
 
 #define stitch_cmd_extend(cmd, other_cmd) \
-    stitch_da_append_many(cmd, (other_cmd)->items, (other_cmd)->count)
+    stitch__da_append_many_init_cap(cmd, (other_cmd)->items, (other_cmd)->count, STITCH_CMD_INIT_CAP)
 
 // Free all the memory allocated by command arguments
 #define stitch_cmd_free(cmd) STITCH_FREE(cmd.items)
 
+// How many arguments Stitch_Small_Cmd keeps inline
+#ifndef STITCH_SMALL_CMD_CAP
+#define STITCH_SMALL_CMD_CAP 16
+#endif
+
+// A command that keeps the first STITCH_SMALL_CMD_CAP arguments inside of itself and only goes to the heap
+// when it outgrows them, so the typical short commands don't allocate at all. It can be copied and moved around
+// like any other struct because the inline arguments are never pointed to: always get the arguments with
+// stitch_small_cmd_items() and run the command through stitch_small_cmd_view().
+typedef struct {
+    const char **heap;   // NULL while the arguments fit into inline_items
+    size_t count;
+    size_t capacity;     // Of the heap
+    const char *inline_items[STITCH_SMALL_CMD_CAP];
+} Stitch_Small_Cmd;
+
+#define stitch_small_cmd_items(cmd) ((cmd)->heap ? (cmd)->heap : (cmd)->inline_items)
+void stitch_small_cmd_append_many(Stitch_Small_Cmd *cmd, const char **args, size_t args_count);
+#define stitch_small_cmd_append(cmd, ...) \
+    stitch_small_cmd_append_many(cmd, \
+                              ((const char*[]){__VA_ARGS__}), \
+                              (sizeof((const char*[]){__VA_ARGS__})/sizeof(const char*)))
+// Borrow the small command as a Stitch_Cmd to run or render it. Do not append to the view. It is valid
+// until the small command is modified, moved or freed.
+//
+// Example:
+// ```c
+// Stitch_Small_Cmd cmd = {0};
+// stitch_small_cmd_append(&cmd, "cc", "-o", "main", "main.c");
+// if (!stitch_cmd_run_sync(stitch_small_cmd_view(&cmd))) fail();
+// stitch_small_cmd_free(&cmd);
+// ```
+Stitch_Cmd stitch_small_cmd_view(Stitch_Small_Cmd *cmd);
+void stitch_small_cmd_free(Stitch_Small_Cmd *cmd);
+
 // Run command asynchronously
 #define stitch_cmd_run_async(cmd) stitch_cmd_run_async_redirect(cmd, (Stitch_Cmd_Redirect) {0})
 // NOTE: stitch_cmd_run_async_and_reset() is just like stitch_cmd_run_async() except it also resets cmd.count to 0
 // so the Stitch_Cmd instance can be seamlessly used several times in a row
 Stitch_Proc stitch_cmd_run_async_and_reset(Stitch_Cmd *cmd);
-// Run redirected command asynchronously
+// Run redirected command asynchronously. On POSIX the process is spawned with posix_spawnp(). Define
+// STITCH_USE_FORK to go back to fork()+execvp() if your libc's posix_spawnp() misbehaves.
 Stitch_Proc stitch_cmd_run_async_redirect(Stitch_Cmd cmd, Stitch_Cmd_Redirect redirect);
 // Run redirected command asynchronously and set cmd.count to 0 and close all the opened files
 Stitch_Proc stitch_cmd_run_async_redirect_and_reset(Stitch_Cmd *cmd, Stitch_Cmd_Redirect redirect);
@@ -275,15 +427,377 @@ bool stitch_cmd_run_sync_redirect(Stitch_Cmd cmd, Stitch_Cmd_Redirect redirect);
 // Run redirected command synchronously and set cmd.count to 0 and close all the opened files
 bool stitch_cmd_run_sync_redirect_and_reset(Stitch_Cmd *cmd, Stitch_Cmd_Redirect redirect);
 
-#ifndef STITCH_TEMP_CAPACITY
-#define STITCH_TEMP_CAPACITY (8*1024*1024)
-#endif // STITCH_TEMP_CAPACITY
+// Nanoseconds since some fixed point in the past. Only good for measuring durations.
+uint64_t stitch_nanos_since_unspecified_epoch(void);
+
+// Record every command launched with stitch_cmd_run_*() and stitch_jobs_*() into a trace file in the Chrome
+// trace-event format that can be opened in chrome://tracing or https://ui.perfetto.dev. Each command becomes
+// a slice on the first lane that was free when it started, annotated with its pid, the rendered command and
+// the exit status. A command is written once it's waited on. When tracing is disabled it costs one check per command.
+bool stitch_trace_begin(const char *path);
+void stitch_trace_end(void);
+
+// Number of processors that are currently online. Returns 1 if it could not be determined.
+size_t stitch_nprocs(void);
+
+// A bounded pool of concurrently running commands. Commands are started as soon as a slot of the
+// pool frees up and finished jobs are reaped in whatever order they actually finish, so a single
+// slow command does not stall the rest of the pool like it does with stitch_procs_wait().
+//
+// Example:
+// ```c
+// Stitch_Jobs jobs = {0}; // .max_jobs = 0 means stitch_nprocs()
+// for (size_t i = 0; i < sources.count; ++i) {
+//     stitch_cmd_append(&cmd, "cc", "-c", "-o", objects.items[i], sources.items[i]);
+//     if (!stitch_jobs_start_and_reset(&jobs, &cmd, i)) fail();
+// }
+// if (!stitch_jobs_wait_all(&jobs)) fail();
+// ```
+//
+// NOTE: on POSIX the pool only ever reaps its own children, so the processes started outside of the pool
+// with stitch_cmd_run_async() (even by other threads) can be waited on at the same time. While such a process
+// has finished but nobody waited on it yet, the pool polls for its own children instead of sleeping.
+typedef struct {
+    Stitch_Proc proc;
+    size_t tag;  // Arbitrary value provided by the user to identify the job
+    bool ok;     // Whether the job succeeded. Only valid for the jobs returned by stitch_jobs_wait_any()
+    Stitch_Proc_Result result; // Same
+    uint64_t start_ns;         // When the job was started, see stitch_nanos_since_unspecified_epoch()
+
+    // Used by the pool to collect the output of the job, see Stitch_Output_Policy
+    Stitch_Fd output_fd;
+    Stitch_String_Builder output;
+    Stitch_Fd exit_fd;  // Becomes readable when the job exits (a pidfd on Linux), so the pool can wait for it
+                        // along with the output of the other jobs
+} Stitch_Job;
+
+// What happens to stdout and stderr of the jobs that are running in parallel
+typedef enum {
+    STITCH_OUTPUT_INHERIT = 0,  // The jobs write straight into the stdout/stderr of the parent and may interleave
+    STITCH_OUTPUT_BUFFER,       // The output of each job is collected and written to stderr at once when it finishes
+    STITCH_OUTPUT_FAILED_ONLY,  // Same as STITCH_OUTPUT_BUFFER, but the output of the successful jobs is dropped
+} Stitch_Output_Policy;
+
+typedef struct {
+    Stitch_Job *items; // Slots of the pool. Free slots have proc == STITCH_INVALID_PROC
+    size_t count;
+    size_t capacity;
+    size_t max_jobs;   // How many jobs may run at the same time. 0 means stitch_nprocs()
+    size_t running;    // How many slots are currently occupied
+    size_t failed;     // How many jobs failed since the last stitch_jobs_wait_all()
+    Stitch_Output_Policy output; // Only the streams that are not redirected are collected. Ignored on Windows
+} Stitch_Jobs;
+
+// Start the command in a free slot of the pool. If all the slots are occupied it first waits for any
+// of the running jobs to finish. Jobs reaped that way are only accounted in jobs->failed. If you need the
+// result of every individual job call stitch_jobs_wait_any() yourself while stitch_jobs_full() is true.
+bool stitch_jobs_start(Stitch_Jobs *jobs, Stitch_Cmd cmd, Stitch_Cmd_Redirect redirect, size_t tag);
+// Same as stitch_jobs_start() without redirect, but also resets cmd->count to 0
+bool stitch_jobs_start_and_reset(Stitch_Jobs *jobs, Stitch_Cmd *cmd, size_t tag);
+// Whether all the slots of the pool are currently occupied
+bool stitch_jobs_full(const Stitch_Jobs *jobs);
+// Wait until any of the running jobs finishes and put it into finished. Returns false if there
+// was nothing to wait for or the waiting itself failed. A failed job is reported via finished->ok.
+bool stitch_jobs_wait_any(Stitch_Jobs *jobs, Stitch_Job *finished);
+// Wait until all the running jobs have finished. Returns true if no jobs failed since the last call.
+bool stitch_jobs_wait_all(Stitch_Jobs *jobs);
+// Free the memory allocated by the slots of the pool
+void stitch_jobs_free(Stitch_Jobs jobs);
+
+typedef struct {
+    size_t *items;
+    size_t count;
+    size_t capacity;
+} Stitch_Indices;
+
+// Content-addressed cache of the outputs of the commands shared by all the builds that point to the same
+// directory (several checkouts, CI workers on one host, etc). Instead of running the command again
+// its outputs are restored from the cache with a reflink (if the file system supports it), a hardlink (if
+// enabled) or a plain copy. Concurrent builds synchronize through a lock file in the cache directory.
+// Not implemented on Windows yet: nothing is ever restored or stored there.
+typedef struct {
+    const char *dir;                  // The directory of the cache. Created if it does not exist
+    unsigned long long max_size;      // The cache is trimmed to this size in bytes. 0 means unlimited
+    const char **env_vars;            // Names of the environment variables that affect the outputs
+    size_t env_vars_count;
+    bool hardlink;                    // Allow hardlinking the outputs. Only safe if nothing modifies the outputs in place
+} Stitch_Action_Cache;
+
+// The key of the action. Made out of the command, the contents of the inputs, the values of
+// cache->env_vars and the identity (path, size and mtime) of the executable that runs the command.
+bool stitch_action_key(const Stitch_Action_Cache *cache, Stitch_Cmd cmd, const char **input_paths, size_t input_paths_count, uint64_t *key);
+// Restore the outputs of the action. The entry is only used if the deps the action was stored with (for example
+// the headers from its depfile) still have the same contents. RETURNS 1 - restored, 0 - not in the cache, -1 - error.
+int stitch_action_cache_restore(const Stitch_Action_Cache *cache, uint64_t key, const char **output_paths, size_t output_paths_count);
+// Store the outputs of the action along with the hashes of its deps that are not a part of the key
+bool stitch_action_cache_store(const Stitch_Action_Cache *cache, uint64_t key,
+                               const char **output_paths, size_t output_paths_count,
+                               const char **dep_paths, size_t dep_paths_count);
+// Evict the least recently used entries until the cache fits into cache->max_size
+bool stitch_action_cache_trim(const Stitch_Action_Cache *cache);
+
+// A single step of the build: a command that produces the outputs from the inputs.
+typedef struct {
+    Stitch_Cmd cmd;              // Empty command makes a phony target that only groups its inputs
+    Stitch_File_Paths inputs;
+    Stitch_File_Paths outputs;
+    const char *depfile;         // Optional depfile produced by the command (e.g. via -MMD -MF)
+
+    // Filled in by stitch_graph_build()
+    Stitch_Indices deps;         // Targets that produce the inputs of this target
+    Stitch_Indices dependents;   // Targets that consume the outputs of this target
+    size_t pending;              // How many dirty deps have not finished yet
+    bool dirty;                  // Whether the target was (or was supposed to be) rebuilt
+    bool restored;               // Whether the outputs were restored from the action cache instead
+    uint64_t cache_key;          // See stitch_action_key(). 0 if unknown
+    uint64_t start_ns;           // When the command was started and finished, see stitch_nanos_since_unspecified_epoch().
+    uint64_t end_ns;             // Both are 0 if the target was not rebuilt
+} Stitch_Target;
+
+// Build graph. The edges between the targets are not declared explicitly. Target B depends on
+// target A if any of the inputs of B is an output of A.
+//
+// Example:
+// ```c
+// Stitch_Graph graph = {0};
+// for (size_t i = 0; i < sources.count; ++i) {
+//     Stitch_Target obj = {0};
+//     stitch_cmd_append(&obj.cmd, "cc", "-c", "-o", objects.items[i], sources.items[i]);
+//     stitch_target_inputs(&obj, sources.items[i]);
+//     stitch_target_outputs(&obj, objects.items[i]);
+//     stitch_graph_add(&graph, obj);
+// }
+// Stitch_Target exe = {0};
+// stitch_cmd_append(&exe.cmd, "cc", "-o", "main");
+// stitch_cmd_extend(&exe.cmd, &objects);
+// stitch_target_inputs_many(&exe, objects.items, objects.count);
+// stitch_target_outputs(&exe, "main");
+// stitch_graph_add(&graph, exe);
+// if (!stitch_graph_build(&graph, 0)) fail();
+// ```
+typedef struct {
+    Stitch_Target *items;
+    size_t count;
+    size_t capacity;
+    Stitch_Action_Cache *action_cache;  // Optional. Dirty targets are restored from it when possible
+    Stitch_Output_Policy output;        // What to do with the output of the commands, see Stitch_Jobs
+    size_t report_top;                  // If not 0, stitch_proc_stats_report() this many commands after the build
+    bool report_critical_path;          // stitch_graph_report_critical_path() after the build
+    bool arena_targets;                 // The cmds, inputs and outputs of the targets are built with the *_arena()
+                                        // macros, so stitch_graph_free() leaves them to their arena
+} Stitch_Graph;
+
+#define stitch_target_inputs(target, ...) \
+    stitch__da_append_many_init_cap(&(target)->inputs, \
+                                 ((const char*[]){__VA_ARGS__}), \
+                                 (sizeof((const char*[]){__VA_ARGS__})/sizeof(const char*)), \
+                                 STITCH_TARGET_INIT_CAP)
+#define stitch_target_inputs_many(target, paths, paths_count) \
+    stitch__da_append_many_init_cap(&(target)->inputs, (paths), (paths_count), STITCH_TARGET_INIT_CAP)
+#define stitch_target_outputs(target, ...) \
+    stitch__da_append_many_init_cap(&(target)->outputs, \
+                                 ((const char*[]){__VA_ARGS__}), \
+                                 (sizeof((const char*[]){__VA_ARGS__})/sizeof(const char*)), \
+                                 STITCH_TARGET_INIT_CAP)
+#define stitch_target_outputs_many(target, paths, paths_count) \
+    stitch__da_append_many_init_cap(&(target)->outputs, (paths), (paths_count), STITCH_TARGET_INIT_CAP)
+
+// Add the target to the graph. The graph takes the ownership of the memory allocated by the
+// target. Returns the index of the target in the graph.
+size_t stitch_graph_add(Stitch_Graph *graph, Stitch_Target target);
+// Find out which targets are dirty and rebuild them in a topological order running up to max_jobs
+// independent commands in parallel (0 means stitch_nprocs()). A target is dirty if any of its outputs
+// is older than any of its inputs (including the ones listed in its depfile) or if any of its deps is dirty. Stops starting new commands
+// after the first failure, but lets the already running ones finish.
+// With graph->action_cache set the dirty targets are restored from the cache if possible
+// and the outputs of the commands that did run are stored there.
+bool stitch_graph_build(Stitch_Graph *graph, size_t max_jobs);
+// Append the critical path of the last stitch_graph_build() to path, from the first target to the last one. That is
+// the chain of the rebuilt targets along the deps with the longest total duration of their commands, the lower
+// bound of the wall time no matter how many job slots there are.
+void stitch_graph_critical_path(const Stitch_Graph *graph, Stitch_Indices *path);
+// Log the critical path of the last stitch_graph_build() along with how long each step waited after the previous one,
+// how many commands were running at the same time and how much of the max_jobs slots stayed idle. Tells whether
+// splitting the slow steps or more cores would help.
+void stitch_graph_report_critical_path(const Stitch_Graph *graph, size_t max_jobs);
+// Free all the memory allocated by the graph and its targets
+void stitch_graph_free(Stitch_Graph *graph);
+
+typedef struct {
+    size_t max_jobs;     // Passed to stitch_graph_build()
+    size_t debounce_ms;  // How long the files must stay quiet before the next build. 0 means 50
+    size_t max_builds;   // Stop after this many builds. 0 means never
+    // Called after every build. Returning false stops watching
+    bool (*after_build)(Stitch_Graph *graph, bool ok, void *data);
+    void *data;
+} Stitch_Watch_Opt;
+
+// Build the graph and then rebuild it every time any of its sources (the inputs that are not produced by
+// other targets, including the deps from the depfiles) changes. Bursts of changes, like an editor saving a file,
+// are coalesced into a single build. The stat cache stays enabled the whole time and only the changed sources
+// are invalidated, so every rebuild only stats what it has to. The outputs are not watched: their cached stats
+// are only refreshed by the builds that rebuild them, so an output deleted or changed by hand is not rebuilt until
+// one of its sources changes (or the watch is restarted). The deps cache drops the deps of the old versions of the
+// depfiles between the builds, so the deps from stitch_depfile_deps() don't outlive a build of the watch.
+// Only implemented on Linux (inotify) yet.
+// Returns whether the last build succeeded.
+bool stitch_graph_watch(Stitch_Graph *graph, Stitch_Watch_Opt opt);
+
+// Growable arena made out of a chain of blocks. The allocations never move and are freed all at once.
+typedef struct Stitch_Arena_Block {
+    struct Stitch_Arena_Block *next;
+    size_t offset;      // Sum of the capacities of the blocks before this one
+    size_t count;
+    size_t capacity;
+    char data[];
+} Stitch_Arena_Block;
+
+typedef struct {
+    Stitch_Arena_Block *first;
+    Stitch_Arena_Block *last;
+} Stitch_Arena;
+
+#ifndef STITCH_ARENA_BLOCK_CAPACITY
+#define STITCH_ARENA_BLOCK_CAPACITY (64*1024)
+#endif // STITCH_ARENA_BLOCK_CAPACITY
+void *stitch_arena_alloc(Stitch_Arena *arena, size_t size);
+char *stitch_arena_strdup(Stitch_Arena *arena, const char *cstr);
+char *stitch_arena_sprintf(Stitch_Arena *arena, const char *format, ...) STITCH_PRINTF_FORMAT(2, 3);
+// Forget all the allocations, but keep the blocks for the future ones
+void stitch_arena_reset(Stitch_Arena *arena);
+// The position of the next allocation. stitch_arena_rewind() to it forgets everything allocated after it,
+// keeping the blocks. Handy for the scratch arenas of the long running loops.
+size_t stitch_arena_save(const Stitch_Arena *arena);
+void stitch_arena_rewind(Stitch_Arena *arena, size_t checkpoint);
+void stitch_arena_free(Stitch_Arena *arena);
+// Move old_size bytes at old into a new allocation of new_size bytes. Grows in place if old is the last
+// allocation of the arena and there is enough room after it. The old allocation is not reused otherwise.
+void *stitch_arena_realloc(Stitch_Arena *arena, void *old, size_t old_size, size_t new_size);
+
+// Variants of the dynamic array macros that take the memory from an arena instead of STITCH_REALLOC. All the
+// arrays of a phase can share one arena and go away with a single stitch_arena_reset() or stitch_arena_free().
+// Never stitch_da_free() such arrays and never mix them with the regular macros.
+//
+// Example:
+// ```c
+// Stitch_Arena arena = {0};
+// for (size_t i = 0; i < sources.count; ++i) {
+//     Stitch_Cmd cmd = {0};
+//     stitch_cmd_append_arena(&arena, &cmd, "cc", "-c", sources.items[i]);
+//     ...
+// }
+// stitch_arena_free(&arena);
+// ```
+#define stitch_da_reserve_arena(arena, da, expected_capacity) \
+    stitch__da_reserve_arena_init_cap(arena, da, expected_capacity, STITCH_DA_INIT_CAP)
+#define stitch__da_reserve_arena_init_cap(arena, da, expected_capacity, init_capacity) \
+    stitch__da_reserve_with(stitch_arena_realloc, arena, da, expected_capacity, init_capacity)
+
+#define stitch_da_append_arena(arena, da, item) \
+    stitch__da_append_with(stitch_arena_realloc, arena, da, item, STITCH_DA_INIT_CAP)
+
+#define stitch_da_append_many_arena(arena, da, new_items, new_items_count) \
+    stitch__da_append_many_arena_init_cap(arena, da, new_items, new_items_count, STITCH_DA_INIT_CAP)
+#define stitch__da_append_many_arena_init_cap(arena, da, new_items, new_items_count, init_capacity) \
+    stitch__da_append_many_with(stitch_arena_realloc, arena, da, new_items, new_items_count, init_capacity)
+
+#define stitch_da_resize_arena(arena, da, new_size) \
+    stitch__da_resize_with(stitch_arena_realloc, arena, da, new_size, STITCH_DA_INIT_CAP)
+
+#define stitch_sb_append_buf_arena(arena, sb, buf, size) \
+    stitch__da_append_many_arena_init_cap(arena, sb, buf, size, STITCH_SB_INIT_CAP)
+
+#define stitch_sb_append_cstr_arena(arena, sb, cstr)                                \
+    do {                                                                            \
+        const char *s = (cstr);                                                     \
+        size_t n = strlen(s);                                                       \
+        stitch__da_append_many_arena_init_cap(arena, sb, s, n, STITCH_SB_INIT_CAP); \
+    } while (0)
+
+#define stitch_sb_append_null_arena(arena, sb) \
+    stitch__da_append_many_arena_init_cap(arena, sb, "", 1, STITCH_SB_INIT_CAP)
+
+#define stitch_cmd_append_arena(arena, cmd, ...)                                                      \
+    stitch__da_append_many_arena_init_cap(arena, cmd,                                                 \
+                                          ((const char*[]){__VA_ARGS__}),                             \
+                                          (sizeof((const char*[]){__VA_ARGS__})/sizeof(const char*)), \
+                                          STITCH_CMD_INIT_CAP)
+
+typedef struct {
+    const char *path;        // The root joined with the path of the entry relative to it
+    const char *name;        // The last part of the path
+    Stitch_File_Type type;   // Symlinks are reported as STITCH_FILE_SYMLINK and never followed
+    size_t level;            // 0 for the direct children of the root
+} Stitch_Walk_Entry;
+
+typedef struct {
+    Stitch_Walk_Entry *items;
+    size_t count;
+    size_t capacity;
+    Stitch_Arena arena;      // Owns the paths of the entries
+} Stitch_Walk_Entries;
+
+typedef struct {
+    const char **prune;      // The names of the directories that are not entered (e.g. ".git", "build")
+    size_t prune_count;
+    const char **include;    // Only the files ending with one of these suffixes are reported (e.g. ".c"). All if empty
+    size_t include_count;
+    const char **exclude;    // The files ending with one of these suffixes are not reported
+    size_t exclude_count;
+    bool dirs;               // Report the directories too
+    bool hidden;             // Enter and report the entries starting with '.'
+    size_t max_depth;        // How many levels to descend. 0 means no limit
+    // Called for every entry that survived the options above (the entry->path is only valid during the call).
+    // Returning false drops the entry and prunes it if it's a directory.
+    bool (*filter)(const Stitch_Walk_Entry *entry, void *data);
+    void *filter_data;
+} Stitch_Walk_Opt;
+
+// Recursively collect the entries under root in the order the file system lists them. The type of each entry
+// comes from readdir() (d_type), so unlike stitch_read_entire_dir() + stitch_get_file_type() it does not stat()
+// anything on the file systems that support it. Appends to entries, free them with stitch_walk_entries_free().
+bool stitch_walk_dir(const char *root, Stitch_Walk_Opt opt, Stitch_Walk_Entries *entries);
+void stitch_walk_entries_free(Stitch_Walk_Entries *entries);
+
+typedef struct {
+    const char **items;
+    size_t count;
+    size_t capacity;
+    Stitch_Arena arena;      // Owns the paths
+} Stitch_Glob_Paths;
+
+// Whether the path matches the pattern. The pattern is made out of the segments separated by '/':
+//   *        any sequence of characters within a segment
+//   ?        any single character within a segment
+//   [a-z]    any character of the set. [!a-z] or [^a-z] - any character that is not in the set
+//   {a,b}    either of the alternatives. The alternatives may contain '/' and nested braces
+//   **       a whole segment that matches zero or more segments
+// The wildcards don't match the names starting with '.' unless the segment of the pattern starts with '.' too.
+bool stitch_glob_match(const char *pattern, const char *path);
+// Append the paths that match the pattern (see stitch_glob_match()) to paths, then sort all the paths and remove
+// the duplicates. Walks from the longest literal prefix of the pattern (e.g. "src" for "src/**/*.c") and never
+// enters the directories that can't match. The paths can be passed straight into stitch_needs_rebuild() and co.
+//
+// Example:
+// ```c
+// Stitch_Glob_Paths sources = {0};
+// if (!stitch_glob("src/**/*.{c,h}", &sources)) fail();
+// int rebuild = stitch_needs_rebuild("build/main", sources.items, sources.count);
+// stitch_glob_paths_free(&sources);
+// ```
+bool stitch_glob(const char *pattern, Stitch_Glob_Paths *paths);
+void stitch_glob_paths_free(Stitch_Glob_Paths *paths);
+
+// The temporary allocator is a Stitch_Arena per thread, so it grows on demand and never runs out before the memory
+// does. stitch_temp_reset() and stitch_temp_rewind() keep the blocks around for the future allocations.
 char *stitch_temp_strdup(const char *cstr);
 void *stitch_temp_alloc(size_t size);
 char *stitch_temp_sprintf(const char *format, ...) STITCH_PRINTF_FORMAT(1, 2);
 void stitch_temp_reset(void);
 size_t stitch_temp_save(void);
 void stitch_temp_rewind(size_t checkpoint);
+// Give the blocks of the temporary allocator of the calling thread back to the system
+void stitch_temp_free(void);
 
 // Given any path returns the last part of that path.
 // "/path/to/a/file.c" -> "file.c"; "/path/to/a/directory" -> "directory"
@@ -291,6 +805,46 @@ const char *stitch_path_name(const char *path);
 bool stitch_rename(const char *old_path, const char *new_path);
 int stitch_needs_rebuild(const char *output_path, const char **input_paths, size_t input_paths_count);
 int stitch_needs_rebuild1(const char *output_path, const char *input_path);
+typedef enum {
+    STITCH_REBUILD_MTIME = 0, // The output is rebuilt if any of its inputs is newer than the output
+    STITCH_REBUILD_HASH,      // The output is rebuilt if the contents of its inputs have changed since it was built
+} Stitch_Rebuild_Mode;
+
+// How stitch_needs_rebuild() decides whether the output is stale. The hash mode is immune to the tools that touch
+// the files without changing them (git checkout, restoring CI caches, etc), but it needs to remember what each
+// output was built from. For that it keeps the build log (see stitch_build_log_open()) where you have to
+// stitch_build_log_record() every output after you successfully rebuilt it. stitch_graph_build() does that for you.
+extern Stitch_Rebuild_Mode stitch_rebuild_mode;
+// Fast non-cryptographic 64-bit hash (XXH64)
+uint64_t stitch_hash(const void *data, size_t size, uint64_t seed);
+// Hash of the contents of the file. The hashes are cached by the inode, the size and the mtime of the files,
+// so unchanged files are never read twice. The cache can be persisted between the runs with
+// stitch_hash_cache_load()/stitch_hash_cache_save(). RETURNS the same as stitch_file_exists().
+int stitch_file_hash(const char *path, uint64_t *hash);
+bool stitch_hash_cache_load(const char *cache_path);
+bool stitch_hash_cache_save(const char *cache_path);
+// The build log is an append-only text file that remembers what the outputs were built from and with what
+// commands. stitch_build_log_open() loads the log and keeps it open for appending until stitch_build_log_close().
+// The log is compacted on open once it's mostly made of the outdated records.
+bool stitch_build_log_open(const char *log_path);
+void stitch_build_log_close(void);
+// Records the command the output was built with and, in STITCH_REBUILD_HASH mode, the hash of its inputs.
+bool stitch_build_log_record(const char *output_path, Stitch_Cmd cmd, const char **input_paths, size_t input_paths_count);
+// Hash of the command line. Only the arguments and their order matter.
+uint64_t stitch_cmd_hash(Stitch_Cmd cmd);
+// Like stitch_needs_rebuild(), but the output is also stale if the build log says it was built with a different
+// command (changed flags, defines, etc). If the log doesn't know the output yet the current command is adopted,
+// so opening the log for the first time doesn't rebuild everything.
+int stitch_needs_rebuild_cmd(Stitch_Cmd cmd, const char *output_path, const char **input_paths, size_t input_paths_count);
+
+// The rebuild checks may memoize the stats of the files for the rest of the run, so a header shared by
+// thousands of objects is stat()-ed only once. It is disabled by default because the cache can't know
+// which files are modified by the commands you run. Once you enable it, invalidate every file you modify
+// with stitch_stat_cache_invalidate() or drop all of it with stitch_stat_cache_reset().
+// stitch_graph_build() always uses the cache for its duration and invalidates the outputs of its targets itself.
+extern bool stitch_stat_cache_enabled;
+void stitch_stat_cache_invalidate(const char *path);
+void stitch_stat_cache_reset(void);
 int stitch_file_exists(const char *file_path);
 const char *stitch_get_current_dir_temp(void);
 bool stitch_set_current_dir(const char *path);
@@ -382,6 +936,70 @@ Stitch_String_View stitch_sv_from_parts(const char *data, size_t count);
 //   String_View name = ...;
 //   printf("Name: "SV_Fmt"\n", SV_Arg(name));
 
+// Read-only view of the contents of a file. Regular files are mmap()-ed, so nothing is copied and the pages are
+// only loaded when touched. Anything that can't be mapped (pipes, the files in /proc, empty files) is read into
+// the memory instead. Touching a mapped file that someone has truncated raises SIGBUS, so only map the files
+// that nobody else writes to. Stitch maps its own caches and logs, but reads the sources.
+typedef struct {
+    Stitch_String_View content;
+    bool mapped;
+} Stitch_Mapped_File;
+
+bool stitch_map_file(const char *path, Stitch_Mapped_File *file);
+void stitch_unmap_file(Stitch_Mapped_File *file);
+
+// What to capture from a command. The captured streams go through pipes straight into the memory,
+// so probing the tools (pkg-config, cc -dumpversion, etc) does not touch the disk.
+typedef struct {
+    Stitch_String_View in;           // Fed into stdin of the command. stdin is inherited if in.data is NULL
+    Stitch_String_Builder *out;      // stdout of the command is appended here. Inherited if NULL
+    Stitch_String_Builder *err;      // stderr of the command is appended here. Inherited if NULL
+} Stitch_Cmd_Capture;
+
+// Run the command synchronously capturing its output. Returns true if the command exited with 0.
+//
+// Example:
+// ```c
+// Stitch_String_Builder version = {0};
+// stitch_cmd_append(&cmd, "cc", "-dumpversion");
+// if (!stitch_cmd_run_capture(cmd, (Stitch_Cmd_Capture) {.out = &version})) fail();
+// ```
+bool stitch_cmd_run_capture(Stitch_Cmd cmd, Stitch_Cmd_Capture capture);
+// Run all the commands concurrently capturing their outputs. The pipes of all the commands are serviced by a
+// single poll() loop, so neither of them can deadlock on a full pipe. oks[i] (if oks is not NULL) tells whether
+// the i-th command exited with 0. Returns true if all of them did. Not implemented on Windows yet.
+bool stitch_cmd_run_capture_many(const Stitch_Cmd *cmds, const Stitch_Cmd_Capture *captures, size_t count, bool *oks);
+
+// Dependencies of a Makefile-style depfile like the ones produced by `cc -MMD -MF foo.d`.
+// All the paths are unescaped and point into the strings of the depfile.
+typedef struct {
+    Stitch_File_Paths targets;
+    Stitch_File_Paths deps;
+    Stitch_String_Builder strings;
+} Stitch_Depfile;
+
+// Parse the content of a depfile. Supports escaped spaces, line continuations, several targets
+// and the phony rules generated by -MP (those are dropped). Resets the depfile before parsing.
+bool stitch_parse_depfile(Stitch_String_View content, Stitch_Depfile *depfile);
+bool stitch_read_depfile(const char *path, Stitch_Depfile *depfile);
+void stitch_depfile_free(Stitch_Depfile *depfile);
+
+// Get the deps of the depfile through the global deps cache, so each depfile is parsed at most
+// once per run (and not at all between the runs if the cache is persisted, see below) unless it
+// has changed on the disk. The paths are valid until the next call that modifies the deps cache.
+// RETURNS:
+//  1 - deps are appended to the deps
+//  0 - the depfile does not exist
+// -1 - error. The error is logged
+int stitch_depfile_deps(const char *depfile_path, Stitch_File_Paths *deps);
+// Load/save the deps cache in a compact binary form. Loading a missing or corrupted cache is not
+// an error, you just start with an empty one.
+bool stitch_deps_cache_load(const char *cache_path);
+bool stitch_deps_cache_save(const char *cache_path);
+// Like stitch_needs_rebuild(), but also checks the deps listed in the depfile that was generated along
+// with the output. Missing depfile or a missing dep (a removed header) mean that the output must be rebuilt.
+int stitch_needs_rebuild_with_depfile(const char *output_path, const char **input_paths, size_t input_paths_count, const char *depfile_path);
+
 
 
 #ifndef _WIN32
@@ -414,9 +1032,71 @@ char *stitch_win32_error_message(DWORD err);
 
 #ifdef STITCH_IMPLEMENTATION
 
+#ifndef STITCH_THREAD_LOCAL
+#  if defined(_MSC_VER)
+#    define STITCH_THREAD_LOCAL __declspec(thread)
+#  elif defined(__GNUC__) || defined(__clang__)
+#    define STITCH_THREAD_LOCAL __thread
+#  else
+#    define STITCH_THREAD_LOCAL _Thread_local
+#  endif
+#endif // STITCH_THREAD_LOCAL
+
+// Guards the global caches. Both kinds of locks can be initialized statically.
+#ifdef _WIN32
+typedef SRWLOCK Stitch__Mutex;
+#define STITCH__MUTEX_INIT SRWLOCK_INIT
+
+static void stitch__mutex_lock(Stitch__Mutex *mutex)
+{
+    AcquireSRWLockExclusive(mutex);
+}
+
+static void stitch__mutex_unlock(Stitch__Mutex *mutex)
+{
+    ReleaseSRWLockExclusive(mutex);
+}
+#else
+// glibc has always provided the mutex functions in libc itself, so the locks don't need -pthread
+typedef pthread_mutex_t Stitch__Mutex;
+#define STITCH__MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+
+static void stitch__mutex_lock(Stitch__Mutex *mutex)
+{
+    pthread_mutex_lock(mutex);
+}
+
+static void stitch__mutex_unlock(Stitch__Mutex *mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
+#endif // _WIN32
+
 // Any messages with the level below stitch_minimal_log_level are going to be suppressed.
 Stitch_Log_Level stitch_minimal_log_level = STITCH_INFO;
 
+void stitch_set_minimal_log_level(Stitch_Log_Level level)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(&stitch_minimal_log_level, level, __ATOMIC_RELAXED);
+#elif defined(_WIN32)
+    InterlockedExchange((volatile LONG*) &stitch_minimal_log_level, (LONG) level);
+#else
+    stitch_minimal_log_level = level;
+#endif
+}
+
+Stitch_Log_Level stitch_get_minimal_log_level(void)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(&stitch_minimal_log_level, __ATOMIC_RELAXED);
+#elif defined(_WIN32)
+    return (Stitch_Log_Level) InterlockedCompareExchange((volatile LONG*) &stitch_minimal_log_level, 0, 0);
+#else
+    return stitch_minimal_log_level;
+#endif
+}
+
 #ifdef _WIN32
 
 // Base on https://stackoverflow.com/a/75644008
@@ -428,7 +1108,7 @@ Stitch_Log_Level stitch_minimal_log_level = STITCH_INFO;
 #endif // STITCH_WIN32_ERR_MSG_SIZE
 
 char *stitch_win32_error_message(DWORD err) {
-    static char win32ErrMsg[STITCH_WIN32_ERR_MSG_SIZE] = {0};
+    static STITCH_THREAD_LOCAL char win32ErrMsg[STITCH_WIN32_ERR_MSG_SIZE] = {0};
     DWORD errMsgSize = FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, err, LANG_USER_DEFAULT, win32ErrMsg,
                                       STITCH_WIN32_ERR_MSG_SIZE, NULL);
 
@@ -510,8 +1190,22 @@ void stitch__go_rebuild_urself(int argc, char **argv, const char *source_path, .
     exit(0);
 }
 
-static size_t stitch_temp_size = 0;
-static char stitch_temp[STITCH_TEMP_CAPACITY] = {0};
+static STITCH_THREAD_LOCAL Stitch_Arena stitch__temp = {0};
+
+// Same as stitch_mkdir_if_not_exists(), but does not log the directories that are created or already exist
+static bool stitch__mkdir_silent(const char *path)
+{
+#ifdef _WIN32
+    int result = mkdir(path);
+#else
+    int result = mkdir(path, 0755);
+#endif
+    if (result < 0 && errno != EEXIST) {
+        stitch_log(STITCH_ERROR, "could not create directory `%s`: %s", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
 
 bool stitch_mkdir_if_not_exists(const char *path)
 {
@@ -533,9 +1227,76 @@ bool stitch_mkdir_if_not_exists(const char *path)
     return true;
 }
 
+static bool stitch__copy_file(const char *src_path, const char *dst_path);
+
+#ifndef _WIN32
+// Moves the rest of src_fd into dst_fd inside of the kernel. RETURNS 1 - copied, 0 - not supported
+// for these files (nothing was copied, so the caller may fall back to something else), -1 - error
+static int stitch__copy_fd_in_kernel(int src_fd, int dst_fd, const char *src_path, const char *dst_path)
+{
+#ifdef FICLONE
+    // A reflink shares the extents of the files until either of them is modified. Takes no time
+    // regardless of the size, but only works within the same copy-on-write file system (Btrfs, XFS, ...).
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) return 1;
+#endif // FICLONE
+
+    size_t chunk = 1024*1024*1024;
+    // NOTE: the files in /proc and /sys report the size 0, and the kernel copies just as much of them. If the
+    // very first call copies nothing, the file is left to the next method and finally to read()/write()
+    bool copied_any = false;
+#ifdef SYS_copy_file_range
+    // Within the same file system (or between any two since Linux 5.3) without copying through the user space
+    for (;;) {
+        ssize_t n = syscall(SYS_copy_file_range, src_fd, NULL, dst_fd, NULL, chunk, 0);
+        if (n == 0 && !copied_any) break;
+        if (n == 0) return 1;
+        if (n > 0) {
+            copied_any = true;
+            continue;
+        }
+        if (errno == EINTR) continue;
+        if (copied_any || (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP && errno != EPERM)) {
+            stitch_log(STITCH_ERROR, "Could not copy %s to %s: %s", src_path, dst_path, strerror(errno));
+            return -1;
+        }
+        break;
+    }
+#endif // SYS_copy_file_range
+
+#ifdef __linux__
+    for (;;) {
+        ssize_t n = sendfile(dst_fd, src_fd, NULL, chunk);
+        if (n == 0 && !copied_any) break;
+        if (n == 0) return 1;
+        if (n > 0) {
+            copied_any = true;
+            continue;
+        }
+        if (errno == EINTR) continue;
+        if (copied_any || (errno != ENOSYS && errno != EINVAL)) {
+            stitch_log(STITCH_ERROR, "Could not copy %s to %s: %s", src_path, dst_path, strerror(errno));
+            return -1;
+        }
+        break;
+    }
+#endif // __linux__
+
+    STITCH_UNUSED(chunk);
+    STITCH_UNUSED(copied_any);
+    STITCH_UNUSED(src_path);
+    STITCH_UNUSED(dst_path);
+    return 0;
+}
+#endif // _WIN32
+
 bool stitch_copy_file(const char *src_path, const char *dst_path)
 {
     stitch_log(STITCH_INFO, "copying %s -> %s", src_path, dst_path);
+    return stitch__copy_file(src_path, dst_path);
+}
+
+static bool stitch__copy_file(const char *src_path, const char *dst_path)
+{
 #ifdef _WIN32
     if (!CopyFile(src_path, dst_path, FALSE)) {
         stitch_log(STITCH_ERROR, "Could not copy file: %s", stitch_win32_error_message(GetLastError()));
@@ -546,8 +1307,7 @@ bool stitch_copy_file(const char *src_path, const char *dst_path)
     int src_fd = -1;
     int dst_fd = -1;
     size_t buf_size = 32*1024;
-    char *buf = STITCH_REALLOC(NULL, buf_size);
-    STITCH_ASSERT(buf != NULL && "Buy more RAM lol!!");
+    char *buf = NULL;
     bool result = true;
 
     src_fd = open(src_path, O_RDONLY);
@@ -562,12 +1322,23 @@ bool stitch_copy_file(const char *src_path, const char *dst_path)
         stitch_return_defer(false);
     }
 
+    // Truncating a file that shares its inode with another one (see stitch_link_or_copy_file()) would
+    // overwrite that one too. Possibly the very src_path.
+    struct stat dst_stat;
+    if (stat(dst_path, &dst_stat) == 0 && dst_stat.st_nlink > 1) unlink(dst_path);
+
     dst_fd = open(dst_path, O_CREAT | O_TRUNC | O_WRONLY, src_stat.st_mode);
     if (dst_fd < 0) {
         stitch_log(STITCH_ERROR, "Could not create file %s: %s", dst_path, strerror(errno));
         stitch_return_defer(false);
     }
 
+    int copied = stitch__copy_fd_in_kernel(src_fd, dst_fd, src_path, dst_path);
+    if (copied < 0) stitch_return_defer(false);
+    if (copied > 0) stitch_return_defer(true);
+
+    buf = STITCH_REALLOC(NULL, buf_size);
+    STITCH_ASSERT(buf != NULL && "Buy more RAM lol!!");
     for (;;) {
         ssize_t n = read(src_fd, buf, buf_size);
         if (n == 0) break;
@@ -589,12 +1360,26 @@ bool stitch_copy_file(const char *src_path, const char *dst_path)
 
 defer:
     STITCH_FREE(buf);
-    close(src_fd);
-    close(dst_fd);
+    if (src_fd >= 0) close(src_fd);
+    if (dst_fd >= 0) close(dst_fd);
     return result;
 #endif
 }
 
+bool stitch_link_or_copy_file(const char *src_path, const char *dst_path)
+{
+    stitch_log(STITCH_INFO, "linking %s -> %s", src_path, dst_path);
+#ifdef _WIN32
+    DeleteFileA(dst_path);
+    if (CreateHardLinkA(dst_path, src_path, NULL)) return true;
+#else
+    unlink(dst_path);
+    if (link(src_path, dst_path) == 0) return true;
+#endif // _WIN32
+    // Different file systems, a file system without hardlinks, too many links, etc.
+    return stitch_copy_file(src_path, dst_path);
+}
+
 void stitch_cmd_render(Stitch_Cmd cmd, Stitch_String_Builder *render)
 {
     for (size_t i = 0; i < cmd.count; ++i) {
@@ -611,98 +1396,578 @@ void stitch_cmd_render(Stitch_Cmd cmd, Stitch_String_Builder *render)
     }
 }
 
-Stitch_Proc stitch_cmd_run_async_redirect(Stitch_Cmd cmd, Stitch_Cmd_Redirect redirect)
+void stitch_small_cmd_append_many(Stitch_Small_Cmd *cmd, const char **args, size_t args_count)
 {
-    if (cmd.count < 1) {
-        stitch_log(STITCH_ERROR, "Could not run empty command");
-        return STITCH_INVALID_PROC;
+    size_t count = cmd->count + args_count;
+    if (cmd->heap == NULL && count > STITCH_SMALL_CMD_CAP) {
+        // Spill the inline arguments to the heap
+        cmd->capacity = 2*STITCH_SMALL_CMD_CAP;
+        while (count > cmd->capacity) cmd->capacity *= 2;
+        cmd->heap = STITCH_REALLOC(NULL, cmd->capacity*sizeof(*cmd->heap));
+        STITCH_ASSERT(cmd->heap != NULL && "Buy more RAM lol");
+        memcpy(cmd->heap, cmd->inline_items, cmd->count*sizeof(*cmd->heap));
+    } else if (cmd->heap != NULL && count > cmd->capacity) {
+        while (count > cmd->capacity) cmd->capacity *= 2;
+        cmd->heap = STITCH_REALLOC(cmd->heap, cmd->capacity*sizeof(*cmd->heap));
+        STITCH_ASSERT(cmd->heap != NULL && "Buy more RAM lol");
     }
+    memcpy(stitch_small_cmd_items(cmd) + cmd->count, args, args_count*sizeof(*args));
+    cmd->count = count;
+}
 
-    Stitch_String_Builder sb = {0};
-    stitch_cmd_render(cmd, &sb);
-    stitch_sb_append_null(&sb);
-    stitch_log(STITCH_INFO, "CMD: %s", sb.items);
-    stitch_sb_free(sb);
-    memset(&sb, 0, sizeof(sb));
+Stitch_Cmd stitch_small_cmd_view(Stitch_Small_Cmd *cmd)
+{
+    return (Stitch_Cmd) {.items = stitch_small_cmd_items(cmd), .count = cmd->count, .capacity = cmd->count};
+}
 
+void stitch_small_cmd_free(Stitch_Small_Cmd *cmd)
+{
+    STITCH_FREE(cmd->heap);
+    memset(cmd, 0, sizeof(*cmd));
+}
+
+uint64_t stitch_nanos_since_unspecified_epoch(void)
+{
 #ifdef _WIN32
-    // https://docs.microsoft.com/en-us/windows/win32/procthread/creating-a-child-process-with-redirected-input-and-output
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t) (counter.QuadPart / freq.QuadPart)*1000000000ULL
+         + (uint64_t) (counter.QuadPart % freq.QuadPart)*1000000000ULL / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+#endif // _WIN32
+}
 
-    STARTUPINFO siStartInfo;
-    ZeroMemory(&siStartInfo, sizeof(siStartInfo));
-    siStartInfo.cb = sizeof(STARTUPINFO);
-    // NOTE: theoretically setting NULL to std handles should not be a problem
-    // https://docs.microsoft.com/en-us/windows/console/getstdhandle?redirectedfrom=MSDN#attachdetach-behavior
-    // TODO: check for errors in GetStdHandle
-    siStartInfo.hStdError = redirect.fderr ? *redirect.fderr : GetStdHandle(STD_ERROR_HANDLE);
-    siStartInfo.hStdOutput = redirect.fdout ? *redirect.fdout : GetStdHandle(STD_OUTPUT_HANDLE);
-    siStartInfo.hStdInput = redirect.fdin ? *redirect.fdin : GetStdHandle(STD_INPUT_HANDLE);
-    siStartInfo.dwFlags |= STARTF_USESTDHANDLES;
+// A command that was launched, but not reaped yet
+typedef struct {
+    Stitch_Proc proc;
+    uint64_t start;
+    size_t lane;                  // The lane of the command in the trace
+    size_t name_len;              // The text starts with the name of the executable followed by the rendered
+    Stitch_String_Builder text;   // command. Only rendered when the trace or the stats need it
+} Stitch__Running_Proc;
 
-    PROCESS_INFORMATION piProcInfo;
-    ZeroMemory(&piProcInfo, sizeof(PROCESS_INFORMATION));
+typedef struct {
+    Stitch__Running_Proc *items;
+    size_t count;
+    size_t capacity;
+} Stitch__Running_Procs;
 
-    // TODO: use a more reliable rendering of the command instead of cmd_render
-    // cmd_render is for logging primarily
-    stitch_cmd_render(cmd, &sb);
-    stitch_sb_append_null(&sb);
-    BOOL bSuccess = CreateProcessA(NULL, sb.items, NULL, NULL, TRUE, 0, NULL, NULL, &siStartInfo, &piProcInfo);
-    stitch_sb_free(sb);
+static Stitch__Running_Procs stitch__running_procs = {0};
 
-    if (!bSuccess) {
-        stitch_log(STITCH_ERROR, "Could not create child process: %s", stitch_win32_error_message(GetLastError()));
-        return STITCH_INVALID_PROC;
-    }
+typedef struct {
+    FILE *file;
+    uint64_t epoch;
+} Stitch__Trace;
 
-    CloseHandle(piProcInfo.hThread);
+static Stitch__Trace stitch__trace = {0};
 
-    return piProcInfo.hProcess;
-#else
-    pid_t cpid = fork();
-    if (cpid < 0) {
-        stitch_log(STITCH_ERROR, "Could not fork child process: %s", strerror(errno));
-        return STITCH_INVALID_PROC;
-    }
+typedef struct {
+    char *cmd;
+    Stitch_Proc_Result result;
+} Stitch__Proc_Stat;
 
-    if (cpid == 0) {
-        if (redirect.fdin) {
-            if (dup2(*redirect.fdin, STDIN_FILENO) < 0) {
-                stitch_log(STITCH_ERROR, "Could not setup stdin for child process: %s", strerror(errno));
-                exit(1);
-            }
-        }
+typedef struct {
+    Stitch__Proc_Stat *items;
+    size_t count;
+    size_t capacity;
+} Stitch__Proc_Stats;
 
-        if (redirect.fdout) {
-            if (dup2(*redirect.fdout, STDOUT_FILENO) < 0) {
-                stitch_log(STITCH_ERROR, "Could not setup stdout for child process: %s", strerror(errno));
-                exit(1);
-            }
-        }
+static Stitch__Proc_Stats stitch__proc_stats = {0};
+bool stitch_proc_stats_enabled = false;
+// Guards the running procs, the trace and the stats
+static Stitch__Mutex stitch__procs_mutex = STITCH__MUTEX_INIT;
 
-        if (redirect.fderr) {
-            if (dup2(*redirect.fderr, STDERR_FILENO) < 0) {
-                stitch_log(STITCH_ERROR, "Could not setup stderr for child process: %s", strerror(errno));
-                exit(1);
+static long stitch__trace_pid(Stitch_Proc proc)
+{
+#ifdef _WIN32
+    return (long) GetProcessId(proc);
+#else
+    return (long) proc;
+#endif // _WIN32
+}
+
+static long stitch__self_pid(void)
+{
+#ifdef _WIN32
+    return (long) GetCurrentProcessId();
+#else
+    return (long) getpid();
+#endif // _WIN32
+}
+
+// Numbers the temporary files and directories (of stitch_write_entire_file_atomic(), the action cache, ...)
+// within the process
+static long stitch__next_temp_file_id(void)
+{
+    static long counter = 0;
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+#elif defined(_WIN32)
+    return (long) InterlockedIncrement((volatile LONG*) &counter) - 1;
+#else
+    static Stitch__Mutex mutex = STITCH__MUTEX_INIT;
+    stitch__mutex_lock(&mutex);
+    long id = counter++;
+    stitch__mutex_unlock(&mutex);
+    return id;
+#endif
+}
+
+bool stitch_trace_begin(const char *path)
+{
+    stitch_trace_end();
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        stitch_log(STITCH_ERROR, "Could not open trace file %s: %s", path, strerror(errno));
+        return false;
+    }
+    stitch__mutex_lock(&stitch__procs_mutex);
+    stitch__trace.file = file;
+    setvbuf(stitch__trace.file, NULL, _IOFBF, 64*1024);
+    stitch__trace.epoch = stitch_nanos_since_unspecified_epoch();
+    // NOTE: the JSON Array Format is used because its closing bracket is optional. The trace of a build
+    // that crashed before stitch_trace_end() still loads.
+    fprintf(stitch__trace.file, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":0,\"args\":{\"name\":\"stitch\"}}", stitch__self_pid());
+    stitch__mutex_unlock(&stitch__procs_mutex);
+    return true;
+}
+
+void stitch_trace_end(void)
+{
+    stitch__mutex_lock(&stitch__procs_mutex);
+    if (stitch__trace.file != NULL) {
+        fprintf(stitch__trace.file, "\n]\n");
+        fclose(stitch__trace.file);
+        memset(&stitch__trace, 0, sizeof(stitch__trace));
+    }
+    stitch__mutex_unlock(&stitch__procs_mutex);
+}
+
+// Drops the command without reporting it. Expects stitch__procs_mutex to be locked
+static void stitch__proc_forget_locked(Stitch_Proc proc)
+{
+    for (size_t i = 0; i < stitch__running_procs.count; ++i) {
+        if (stitch__running_procs.items[i].proc != proc) continue;
+        stitch_sb_free(stitch__running_procs.items[i].text);
+        stitch_da_remove_unordered(&stitch__running_procs, i);
+        return;
+    }
+}
+
+static void stitch__proc_forget(Stitch_Proc proc)
+{
+    stitch__mutex_lock(&stitch__procs_mutex);
+    stitch__proc_forget_locked(proc);
+    stitch__mutex_unlock(&stitch__procs_mutex);
+}
+
+// Every command remembers its start for the wall time of its result. The command itself is only rendered
+// while the trace or the stats are enabled. The jobs of a pool keep their start in their slot, so they are
+// only tracked for the trace and the stats.
+static void stitch__proc_started(Stitch_Proc proc, Stitch_Cmd cmd, bool pooled)
+{
+    Stitch__Running_Proc running = {.proc = proc, .start = stitch_nanos_since_unspecified_epoch()};
+    stitch__mutex_lock(&stitch__procs_mutex);
+    bool render = stitch__trace.file != NULL || stitch_proc_stats_enabled;
+    if (render || !pooled) {
+        // A command that was never waited on leaves its entry behind until its pid is reused
+        stitch__proc_forget_locked(proc);
+    }
+    if (render) {
+        // The first lane that is not occupied by any of the traced commands
+        for (size_t i = 0; i < stitch__running_procs.count; ++i) {
+            if (stitch__running_procs.items[i].text.count > 0 && stitch__running_procs.items[i].lane == running.lane) {
+                running.lane += 1;
+                i = (size_t) -1;
+            }
+        }
+        stitch_sb_append_cstr(&running.text, stitch_path_name(cmd.items[0]));
+        running.name_len = running.text.count;
+        stitch_cmd_render(cmd, &running.text);
+    }
+    if (render || !pooled) stitch_da_append(&stitch__running_procs, running);
+    stitch__mutex_unlock(&stitch__procs_mutex);
+}
+
+static void stitch__trace_write_string(FILE *file, const char *s, size_t n)
+{
+    fputc('"', file);
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') fprintf(file, "\\%c", c);
+        else if (c < 0x20) fprintf(file, "\\u%04x", c);
+        else fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+// Fills in the wall time of the result and hands the command over to the trace and the stats
+static void stitch__proc_reaped(Stitch_Proc proc, Stitch_Proc_Result *result)
+{
+    stitch__mutex_lock(&stitch__procs_mutex);
+    for (size_t i = 0; i < stitch__running_procs.count; ++i) {
+        Stitch__Running_Proc *running = &stitch__running_procs.items[i];
+        if (running->proc != proc) continue;
+
+        uint64_t end = stitch_nanos_since_unspecified_epoch();
+        result->wall_ns = end - running->start;
+
+        FILE *file = stitch__trace.file;
+        if (file != NULL && running->text.count > 0) {
+            int status = result->signal ? 128 + result->signal : result->exit_code;
+            fprintf(file, ",\n{\"name\":");
+            stitch__trace_write_string(file, running->text.items, running->name_len);
+            fprintf(file, ",\"cat\":\"cmd\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%zu,\"args\":{\"pid\":%ld,\"status\":%d,\"cmd\":",
+                    (running->start - stitch__trace.epoch)/1000.0, result->wall_ns/1000.0, stitch__self_pid(), running->lane,
+                    stitch__trace_pid(proc), status);
+            stitch__trace_write_string(file, running->text.items + running->name_len, running->text.count - running->name_len);
+            fprintf(file, ",\"user_ms\":%.3f,\"sys_ms\":%.3f,\"max_rss\":%llu}}",
+                    result->user_ns/1e6, result->sys_ns/1e6, (unsigned long long) result->max_rss);
+        }
+
+        if (stitch_proc_stats_enabled && running->text.count > 0) {
+            // The stat takes the ownership of the text with the name of the executable cut off
+            stitch_sb_append_null(&running->text);
+            memmove(running->text.items, running->text.items + running->name_len, running->text.count - running->name_len);
+            Stitch__Proc_Stat stat = {.cmd = running->text.items, .result = *result};
+            stitch_da_append(&stitch__proc_stats, stat);
+        } else {
+            stitch_sb_free(running->text);
+        }
+
+        stitch_da_remove_unordered(&stitch__running_procs, i);
+        break;
+    }
+    stitch__mutex_unlock(&stitch__procs_mutex);
+}
+
+static void stitch__proc_result_log(const Stitch_Proc_Result *result)
+{
+    if (result->signal != 0) {
+        stitch_log(STITCH_ERROR, "command process was terminated by signal %d", result->signal);
+    } else if (result->exit_code != 0) {
+        stitch_log(STITCH_ERROR, "command exited with exit code %d", result->exit_code);
+    }
+}
+
+#ifdef _WIN32
+static void stitch__proc_result_win32(HANDLE proc, DWORD exit_status, Stitch_Proc_Result *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->exit_code = (int) exit_status;
+    result->ok = exit_status == 0;
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+    if (GetProcessTimes(proc, &creation_time, &exit_time, &kernel_time, &user_time)) {
+        // FILETIME is the amount of 100-nanosecond intervals
+        result->user_ns = (((uint64_t) user_time.dwHighDateTime << 32) | user_time.dwLowDateTime)*100;
+        result->sys_ns = (((uint64_t) kernel_time.dwHighDateTime << 32) | kernel_time.dwLowDateTime)*100;
+    }
+}
+#else
+static void stitch__proc_result_posix(int wstatus, const struct rusage *usage, Stitch_Proc_Result *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->exit_code = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+    result->signal = WIFSIGNALED(wstatus) ? WTERMSIG(wstatus) : 0;
+    result->ok = result->exit_code == 0;
+    result->user_ns = (uint64_t) usage->ru_utime.tv_sec*1000000000ULL + (uint64_t) usage->ru_utime.tv_usec*1000;
+    result->sys_ns = (uint64_t) usage->ru_stime.tv_sec*1000000000ULL + (uint64_t) usage->ru_stime.tv_usec*1000;
+#ifdef __APPLE__
+    result->max_rss = usage->ru_maxrss;
+#else
+    result->max_rss = (uint64_t) usage->ru_maxrss*1024;
+#endif // __APPLE__
+}
+#endif // _WIN32
+
+static int stitch__proc_stat_compare_wall(const void *a, const void *b)
+{
+    const Stitch__Proc_Stat *x = a, *y = b;
+    return (x->result.wall_ns < y->result.wall_ns) - (x->result.wall_ns > y->result.wall_ns);
+}
+
+static int stitch__proc_stat_compare_rss(const void *a, const void *b)
+{
+    const Stitch__Proc_Stat *x = a, *y = b;
+    return (x->result.max_rss < y->result.max_rss) - (x->result.max_rss > y->result.max_rss);
+}
+
+void stitch_proc_stats_report(size_t top_n)
+{
+    Stitch__Proc_Stats *stats = &stitch__proc_stats;
+    stitch__mutex_lock(&stitch__procs_mutex);
+    if (stats->count == 0) {
+        stitch__mutex_unlock(&stitch__procs_mutex);
+        return;
+    }
+    if (top_n > stats->count) top_n = stats->count;
+
+    uint64_t total_wall = 0, total_cpu = 0;
+    for (size_t i = 0; i < stats->count; ++i) {
+        total_wall += stats->items[i].result.wall_ns;
+        total_cpu += stats->items[i].result.user_ns + stats->items[i].result.sys_ns;
+    }
+    stitch_log(STITCH_INFO, "%zu commands, %.2fs of wall time, %.2fs of CPU time in total", stats->count, total_wall/1e9, total_cpu/1e9);
+
+    for (int by_rss = 0; by_rss <= 1; ++by_rss) {
+        qsort(stats->items, stats->count, sizeof(*stats->items), by_rss ? stitch__proc_stat_compare_rss : stitch__proc_stat_compare_wall);
+        stitch_log(STITCH_INFO, "Top %zu %s commands:", top_n, by_rss ? "most memory-hungry" : "slowest");
+        stitch_log(STITCH_INFO, "  %9s %9s %9s %10s  %s", "wall", "user", "sys", "max rss", "command");
+        for (size_t i = 0; i < top_n; ++i) {
+            const Stitch_Proc_Result *r = &stats->items[i].result;
+            stitch_log(STITCH_INFO, "  %8.2fs %8.2fs %8.2fs %8.1fMB  %s", r->wall_ns/1e9, r->user_ns/1e9, r->sys_ns/1e9,
+                       r->max_rss/(1024.0*1024.0), stats->items[i].cmd);
+        }
+    }
+    stitch__mutex_unlock(&stitch__procs_mutex);
+}
+
+void stitch_proc_stats_reset(void)
+{
+    stitch__mutex_lock(&stitch__procs_mutex);
+    for (size_t i = 0; i < stitch__proc_stats.count; ++i) STITCH_FREE(stitch__proc_stats.items[i].cmd);
+    stitch_da_free(stitch__proc_stats);
+    memset(&stitch__proc_stats, 0, sizeof(stitch__proc_stats));
+    stitch__mutex_unlock(&stitch__procs_mutex);
+}
+
+#ifndef _WIN32
+#define STITCH__ARGV_STACK_CAPACITY 256
+
+// Create a pipe whose ends are not inherited by the children, except through an explicit redirect
+#ifdef SYS_pipe2
+static bool stitch__pipe(int fds[2])
+{
+    if (syscall(SYS_pipe2, fds, O_CLOEXEC) < 0) {
+        stitch_log(STITCH_ERROR, "Could not create pipe: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+#define stitch__spawn_lock()
+#define stitch__spawn_unlock()
+#else
+// A child spawned by another thread between pipe() and fcntl() would inherit the pipe and hold its write end
+// open, so the reader would not see EOF until that child exits. Without pipe2() the pipes and the spawns
+// exclude each other.
+static Stitch__Mutex stitch__spawn_mutex = STITCH__MUTEX_INIT;
+#define stitch__spawn_lock()   stitch__mutex_lock(&stitch__spawn_mutex)
+#define stitch__spawn_unlock() stitch__mutex_unlock(&stitch__spawn_mutex)
+
+static bool stitch__pipe(int fds[2])
+{
+    stitch__spawn_lock();
+    int ret = pipe(fds);
+    int saved_errno = errno;
+    if (ret == 0) {
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    }
+    stitch__spawn_unlock();
+    if (ret < 0) {
+        stitch_log(STITCH_ERROR, "Could not create pipe: %s", strerror(saved_errno));
+        return false;
+    }
+    return true;
+}
+#endif // SYS_pipe2
+
+static Stitch__Mutex stitch__sigpipe_mutex = STITCH__MUTEX_INIT;
+static bool stitch__sigpipe_ignored = false;
+
+// Makes the whole process ignore SIGPIPE for good, unless it already has a disposition of its own. Restoring
+// the old disposition afterwards would kill the other threads that are still writing into their pipes.
+static void stitch__ignore_sigpipe(void)
+{
+    stitch__mutex_lock(&stitch__sigpipe_mutex);
+    struct sigaction old;
+    if (!stitch__sigpipe_ignored && sigaction(SIGPIPE, NULL, &old) == 0 && old.sa_handler == SIG_DFL) {
+        struct sigaction ignore = {.sa_handler = SIG_IGN};
+        stitch__sigpipe_ignored = sigaction(SIGPIPE, &ignore, NULL) == 0;
+    }
+    stitch__mutex_unlock(&stitch__sigpipe_mutex);
+}
+
+// Whether the commands need the default SIGPIPE back, since the ignored signals are inherited through exec
+static bool stitch__sigpipe_reset_needed(void)
+{
+    stitch__mutex_lock(&stitch__sigpipe_mutex);
+    bool ignored = stitch__sigpipe_ignored;
+    stitch__mutex_unlock(&stitch__sigpipe_mutex);
+    return ignored;
+}
+
+#ifdef STITCH_USE_FORK
+// Plain fork() copies the page tables of the parent, which gets slow when the build script has a big heap
+static pid_t stitch__spawn(Stitch_Cmd argv, Stitch_Cmd_Redirect redirect)
+{
+    bool reset_sigpipe = stitch__sigpipe_reset_needed();
+    pid_t cpid = fork();
+    if (cpid < 0) {
+        stitch_log(STITCH_ERROR, "Could not fork child process: %s", strerror(errno));
+        return STITCH_INVALID_PROC;
+    }
+
+    if (cpid == 0) {
+        if (reset_sigpipe) signal(SIGPIPE, SIG_DFL);
+
+        if (redirect.fdin) {
+            if (dup2(*redirect.fdin, STDIN_FILENO) < 0) {
+                stitch_log(STITCH_ERROR, "Could not setup stdin for child process: %s", strerror(errno));
+                exit(1);
+            }
+        }
+
+        if (redirect.fdout) {
+            if (dup2(*redirect.fdout, STDOUT_FILENO) < 0) {
+                stitch_log(STITCH_ERROR, "Could not setup stdout for child process: %s", strerror(errno));
+                exit(1);
             }
         }
 
-        // NOTE: This leaks a bit of memory in the child process.
-        // But do we actually care? It's a one off leak anyway...
-        Stitch_Cmd cmd_null = {0};
-        stitch_da_append_many(&cmd_null, cmd.items, cmd.count);
-        stitch_cmd_append(&cmd_null, NULL);
+        if (redirect.fderr) {
+            if (dup2(*redirect.fderr, STDERR_FILENO) < 0) {
+                stitch_log(STITCH_ERROR, "Could not setup stderr for child process: %s", strerror(errno));
+                exit(1);
+            }
+        }
 
-        if (execvp(cmd.items[0], (char * const*) cmd_null.items) < 0) {
+        if (execvp(argv.items[0], (char * const*) argv.items) < 0) {
             stitch_log(STITCH_ERROR, "Could not exec child process: %s", strerror(errno));
             exit(1);
         }
-        STITCH_UNREACHABLE("stitch_cmd_run_async_redirect");
+        STITCH_UNREACHABLE("stitch__spawn");
+    }
+
+    return cpid;
+}
+#else
+// posix_spawnp() is implemented with vfork()/clone(CLONE_VM|CLONE_VFORK) by the modern libcs, so the cost
+// of spawning a process does not grow with the heap of the build script. It also reports the failures to
+// exec synchronously, unlike fork() where they are only visible as the exit code of the child.
+extern char **environ;
+
+static pid_t stitch__spawn(Stitch_Cmd argv, Stitch_Cmd_Redirect redirect)
+{
+    pid_t cpid = STITCH_INVALID_PROC;
+    posix_spawn_file_actions_t actions;
+    int err = posix_spawn_file_actions_init(&actions);
+    if (err != 0) {
+        stitch_log(STITCH_ERROR, "Could not spawn child process: %s", strerror(err));
+        return STITCH_INVALID_PROC;
+    }
+
+    if (err == 0 && redirect.fdin)  err = posix_spawn_file_actions_adddup2(&actions, *redirect.fdin,  STDIN_FILENO);
+    if (err == 0 && redirect.fdout) err = posix_spawn_file_actions_adddup2(&actions, *redirect.fdout, STDOUT_FILENO);
+    if (err == 0 && redirect.fderr) err = posix_spawn_file_actions_adddup2(&actions, *redirect.fderr, STDERR_FILENO);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_t *attrp = NULL;
+    if (err == 0 && stitch__sigpipe_reset_needed()) {
+        sigset_t sigdefault;
+        sigemptyset(&sigdefault);
+        sigaddset(&sigdefault, SIGPIPE);
+        err = posix_spawnattr_init(&attr);
+        if (err == 0) {
+            attrp = &attr;
+            err = posix_spawnattr_setsigdefault(&attr, &sigdefault);
+        }
+        if (err == 0) err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+    }
+
+    if (err == 0) err = posix_spawnp(&cpid, argv.items[0], &actions, attrp, (char * const*) argv.items, environ);
+    if (err != 0) {
+        stitch_log(STITCH_ERROR, "Could not spawn child process %s: %s", argv.items[0], strerror(err));
+        cpid = STITCH_INVALID_PROC;
+    }
+
+    if (attrp) posix_spawnattr_destroy(attrp);
+    posix_spawn_file_actions_destroy(&actions);
+    return cpid;
+}
+#endif // STITCH_USE_FORK
+#endif // _WIN32
+
+static Stitch_Proc stitch__cmd_run_async_redirect(Stitch_Cmd cmd, Stitch_Cmd_Redirect redirect, bool pooled)
+{
+    if (cmd.count < 1) {
+        stitch_log(STITCH_ERROR, "Could not run empty command");
+        return STITCH_INVALID_PROC;
+    }
+
+    Stitch_String_Builder sb = {0};
+    // NOTE: don't render the command just to throw it away
+    if (stitch_get_minimal_log_level() <= STITCH_INFO) {
+        stitch_cmd_render(cmd, &sb);
+        stitch_sb_append_null(&sb);
+        stitch_log(STITCH_INFO, "CMD: %s", sb.items);
+        stitch_sb_free(sb);
+        memset(&sb, 0, sizeof(sb));
+    }
+
+#ifdef _WIN32
+    // https://docs.microsoft.com/en-us/windows/win32/procthread/creating-a-child-process-with-redirected-input-and-output
+
+    STARTUPINFO siStartInfo;
+    ZeroMemory(&siStartInfo, sizeof(siStartInfo));
+    siStartInfo.cb = sizeof(STARTUPINFO);
+    // NOTE: theoretically setting NULL to std handles should not be a problem
+    // https://docs.microsoft.com/en-us/windows/console/getstdhandle?redirectedfrom=MSDN#attachdetach-behavior
+    // TODO: check for errors in GetStdHandle
+    siStartInfo.hStdError = redirect.fderr ? *redirect.fderr : GetStdHandle(STD_ERROR_HANDLE);
+    siStartInfo.hStdOutput = redirect.fdout ? *redirect.fdout : GetStdHandle(STD_OUTPUT_HANDLE);
+    siStartInfo.hStdInput = redirect.fdin ? *redirect.fdin : GetStdHandle(STD_INPUT_HANDLE);
+    siStartInfo.dwFlags |= STARTF_USESTDHANDLES;
+
+    PROCESS_INFORMATION piProcInfo;
+    ZeroMemory(&piProcInfo, sizeof(PROCESS_INFORMATION));
+
+    // TODO: use a more reliable rendering of the command instead of cmd_render
+    // cmd_render is for logging primarily
+    stitch_cmd_render(cmd, &sb);
+    stitch_sb_append_null(&sb);
+    BOOL bSuccess = CreateProcessA(NULL, sb.items, NULL, NULL, TRUE, 0, NULL, NULL, &siStartInfo, &piProcInfo);
+    stitch_sb_free(sb);
+
+    if (!bSuccess) {
+        stitch_log(STITCH_ERROR, "Could not create child process: %s", stitch_win32_error_message(GetLastError()));
+        return STITCH_INVALID_PROC;
     }
 
+    CloseHandle(piProcInfo.hThread);
+
+    stitch__proc_started(piProcInfo.hProcess, cmd, pooled);
+    return piProcInfo.hProcess;
+#else
+    // NOTE: execvp() and posix_spawnp() need the NULL-terminated argv. The slot after cmd.count may belong to
+    // a longer cmd this one is a view of, or be read-only, so the argv is copied onto the stack and only the huge
+    // ones go to the heap.
+    const char *stack_argv[STITCH__ARGV_STACK_CAPACITY];
+    Stitch_Cmd argv = cmd;
+    argv.capacity = cmd.count + 1;
+    argv.items = argv.capacity <= STITCH_ARRAY_LEN(stack_argv) ? stack_argv : STITCH_REALLOC(NULL, argv.capacity*sizeof(*argv.items));
+    STITCH_ASSERT(argv.items != NULL && "Buy more RAM lol");
+    memcpy(argv.items, cmd.items, cmd.count*sizeof(*cmd.items));
+    argv.items[argv.count] = NULL;
+    stitch__spawn_lock();
+    pid_t cpid = stitch__spawn(argv, redirect);
+    stitch__spawn_unlock();
+    if (argv.items != stack_argv) STITCH_FREE(argv.items);
+    if (cpid != STITCH_INVALID_PROC) stitch__proc_started(cpid, cmd, pooled);
     return cpid;
 #endif
 }
 
+Stitch_Proc stitch_cmd_run_async_redirect(Stitch_Cmd cmd, Stitch_Cmd_Redirect redirect)
+{
+    return stitch__cmd_run_async_redirect(cmd, redirect, false);
+}
+
 Stitch_Proc stitch_cmd_run_async_and_reset(Stitch_Cmd *cmd)
 {
     Stitch_Proc proc = stitch_cmd_run_async(*cmd);
@@ -824,16 +2089,24 @@ bool stitch_procs_wait_and_reset(Stitch_Procs *procs)
 
 bool stitch_proc_wait(Stitch_Proc proc)
 {
+    Stitch_Proc_Result result;
+    return stitch_proc_wait_result(proc, &result);
+}
+
+bool stitch_proc_wait_result(Stitch_Proc proc, Stitch_Proc_Result *result)
+{
+    memset(result, 0, sizeof(*result));
     if (proc == STITCH_INVALID_PROC) return false;
 
 #ifdef _WIN32
-    DWORD result = WaitForSingleObject(
-                       proc,    // HANDLE hHandle,
-                       INFINITE // DWORD  dwMilliseconds
-                   );
+    DWORD wait_result = WaitForSingleObject(
+                            proc,    // HANDLE hHandle,
+                            INFINITE // DWORD  dwMilliseconds
+                        );
 
-    if (result == WAIT_FAILED) {
+    if (wait_result == WAIT_FAILED) {
         stitch_log(STITCH_ERROR, "could not wait on child process: %s", stitch_win32_error_message(GetLastError()));
+        stitch__proc_forget(proc);
         return false;
     }
 
@@ -843,415 +2116,3796 @@ bool stitch_proc_wait(Stitch_Proc proc)
         return false;
     }
 
-    if (exit_status != 0) {
-        stitch_log(STITCH_ERROR, "command exited with exit code %lu", exit_status);
-        return false;
-    }
-
+    stitch__proc_result_win32(proc, exit_status, result);
+    stitch__proc_reaped(proc, result);
     CloseHandle(proc);
-
-    return true;
 #else
+    int wstatus = 0;
+    struct rusage usage;
     for (;;) {
-        int wstatus = 0;
-        if (waitpid(proc, &wstatus, 0) < 0) {
+        if (wait4(proc, &wstatus, 0, &usage) < 0) {
+            if (errno == EINTR) continue;
             stitch_log(STITCH_ERROR, "could not wait on command (pid %d): %s", proc, strerror(errno));
+            stitch__proc_forget(proc);
             return false;
         }
-
-        if (WIFEXITED(wstatus)) {
-            int exit_status = WEXITSTATUS(wstatus);
-            if (exit_status != 0) {
-                stitch_log(STITCH_ERROR, "command exited with exit code %d", exit_status);
-                return false;
-            }
-
-            break;
-        }
-
-        if (WIFSIGNALED(wstatus)) {
-            stitch_log(STITCH_ERROR, "command process was terminated by signal %d", WTERMSIG(wstatus));
-            return false;
-        }
+        if (WIFEXITED(wstatus) || WIFSIGNALED(wstatus)) break;
     }
 
-    return true;
-#endif
+    stitch__proc_result_posix(wstatus, &usage, result);
+    stitch__proc_reaped(proc, result);
+#endif // _WIN32
+
+    stitch__proc_result_log(result);
+    return result->ok;
 }
 
-bool stitch_cmd_run_sync_redirect(Stitch_Cmd cmd, Stitch_Cmd_Redirect redirect)
+size_t stitch_nprocs(void)
 {
-    Stitch_Proc p = stitch_cmd_run_async_redirect(cmd, redirect);
-    if (p == STITCH_INVALID_PROC) return false;
-    return stitch_proc_wait(p);
+#ifdef _WIN32
+    SYSTEM_INFO siSysInfo;
+    GetSystemInfo(&siSysInfo);
+    if (siSysInfo.dwNumberOfProcessors < 1) return 1;
+    return siSysInfo.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) return 1;
+    return (size_t) n;
+#endif // _WIN32
 }
 
-bool stitch_cmd_run_sync(Stitch_Cmd cmd)
+static void stitch__jobs_init_slots(Stitch_Jobs *jobs)
 {
-    Stitch_Proc p = stitch_cmd_run_async(cmd);
-    if (p == STITCH_INVALID_PROC) return false;
-    return stitch_proc_wait(p);
+    if (jobs->max_jobs == 0) jobs->max_jobs = stitch_nprocs();
+#ifdef _WIN32
+    // NOTE: WaitForMultipleObjects() can't wait on more than MAXIMUM_WAIT_OBJECTS handles at once
+    if (jobs->max_jobs > MAXIMUM_WAIT_OBJECTS) jobs->max_jobs = MAXIMUM_WAIT_OBJECTS;
+#endif // _WIN32
+    while (jobs->count < jobs->max_jobs) {
+        stitch_da_append(jobs, ((Stitch_Job) {.proc = STITCH_INVALID_PROC, .output_fd = STITCH_INVALID_FD, .exit_fd = STITCH_INVALID_FD}));
+    }
 }
 
-bool stitch_cmd_run_sync_and_reset(Stitch_Cmd *cmd)
+bool stitch_jobs_full(const Stitch_Jobs *jobs)
 {
-    bool p = stitch_cmd_run_sync(*cmd);
-    cmd->count = 0;
-    return p;
+    size_t max_jobs = jobs->max_jobs;
+    if (max_jobs == 0) max_jobs = stitch_nprocs();
+    return jobs->running >= max_jobs;
 }
 
-bool stitch_cmd_run_sync_redirect_and_reset(Stitch_Cmd *cmd, Stitch_Cmd_Redirect redirect)
+bool stitch_jobs_start(Stitch_Jobs *jobs, Stitch_Cmd cmd, Stitch_Cmd_Redirect redirect, size_t tag)
 {
-    bool p = stitch_cmd_run_sync_redirect(*cmd, redirect);
-    cmd->count = 0;
-    if (redirect.fdin) {
-        stitch_fd_close(*redirect.fdin);
-        *redirect.fdin = STITCH_INVALID_FD;
+    stitch__jobs_init_slots(jobs);
+
+    while (jobs->running >= jobs->max_jobs) {
+        Stitch_Job finished;
+        if (!stitch_jobs_wait_any(jobs, &finished)) return false;
     }
-    if (redirect.fdout) {
-        stitch_fd_close(*redirect.fdout);
-        *redirect.fdout = STITCH_INVALID_FD;
+
+    Stitch_Fd output_fd = STITCH_INVALID_FD;
+#ifndef _WIN32
+    // NOTE: stdout and stderr share the pipe to keep their relative order
+    int output_pipe[2] = {-1, -1};
+    if (jobs->output != STITCH_OUTPUT_INHERIT && (redirect.fdout == NULL || redirect.fderr == NULL)) {
+        if (!stitch__pipe(output_pipe)) {
+            jobs->failed += 1;
+            return false;
+        }
+        if (redirect.fdout == NULL) redirect.fdout = &output_pipe[1];
+        if (redirect.fderr == NULL) redirect.fderr = &output_pipe[1];
+        output_fd = output_pipe[0];
     }
-    if (redirect.fderr) {
-        stitch_fd_close(*redirect.fderr);
-        *redirect.fderr = STITCH_INVALID_FD;
+#endif // _WIN32
+
+    uint64_t start_ns = stitch_nanos_since_unspecified_epoch();
+    Stitch_Proc proc = stitch__cmd_run_async_redirect(cmd, redirect, true);
+#ifndef _WIN32
+    if (output_pipe[1] >= 0) close(output_pipe[1]);
+#endif // _WIN32
+    if (proc == STITCH_INVALID_PROC) {
+        if (output_fd != STITCH_INVALID_FD) stitch_fd_close(output_fd);
+        jobs->failed += 1;
+        return false;
     }
-    return p;
+
+    Stitch_Fd exit_fd = STITCH_INVALID_FD;
+#ifdef SYS_pidfd_open
+    // NOTE: only needed while the output is collected. Without the pidfd (Linux older than 5.3) the pool checks
+    // the jobs that are done with their output periodically instead.
+    if (output_fd != STITCH_INVALID_FD) {
+        // NOTE: the pidfds are always close-on-exec
+        exit_fd = syscall(SYS_pidfd_open, proc, 0);
+        if (exit_fd < 0) exit_fd = STITCH_INVALID_FD;
+    }
+#endif // SYS_pidfd_open
+
+    for (size_t i = 0; i < jobs->count; ++i) {
+        if (jobs->items[i].proc == STITCH_INVALID_PROC) {
+            jobs->items[i].proc = proc;
+            jobs->items[i].tag  = tag;
+            jobs->items[i].ok   = false;
+            jobs->items[i].start_ns = start_ns;
+            jobs->items[i].output_fd = output_fd;
+            jobs->items[i].exit_fd = exit_fd;
+            jobs->items[i].output.count = 0;
+            jobs->running += 1;
+            return true;
+        }
+    }
+
+    STITCH_UNREACHABLE("stitch_jobs_start");
 }
 
-void stitch_log(Stitch_Log_Level level, const char *fmt, ...)
+bool stitch_jobs_start_and_reset(Stitch_Jobs *jobs, Stitch_Cmd *cmd, size_t tag)
 {
-    if (level < stitch_minimal_log_level) return;
+    bool ok = stitch_jobs_start(jobs, *cmd, (Stitch_Cmd_Redirect) {0}, tag);
+    cmd->count = 0;
+    return ok;
+}
 
-    switch (level) {
-    case STITCH_INFO:
-        fprintf(stderr, "[INFO] ");
-        break;
-    case STITCH_WARNING:
-        fprintf(stderr, "[WARNING] ");
-        break;
-    case STITCH_ERROR:
-        fprintf(stderr, "[ERROR] ");
-        break;
-    case STITCH_NO_LOGS: return;
-    default:
-        STITCH_UNREACHABLE("stitch_log");
+#ifndef _WIN32
+// Read whatever the running jobs have written so far into their output buffers. Blocks until there is
+// something to read or any of the jobs without the output pipe has finished. A job can't finish
+// while nobody reads its output, so this is how stitch_jobs_wait_any() waits when the output is collected.
+// RETURNS false if there are no output pipes to wait on.
+static bool stitch__jobs_collect_output(Stitch_Jobs *jobs)
+{
+    struct pollfd stack_pollfds[64];
+    struct pollfd *pollfds = stack_pollfds;
+    size_t pipes_count = 0;
+    size_t fds_count = 0;
+    bool has_unwaitable = false;
+    for (size_t i = 0; i < jobs->count; ++i) {
+        if (jobs->items[i].proc == STITCH_INVALID_PROC) continue;
+        if (jobs->items[i].output_fd != STITCH_INVALID_FD) pipes_count += 1;
+        else if (jobs->items[i].exit_fd != STITCH_INVALID_FD) fds_count += 1;
+        else has_unwaitable = true;
     }
+    if (pipes_count == 0) return false;
+    fds_count += pipes_count;
 
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
+    if (fds_count > STITCH_ARRAY_LEN(stack_pollfds)) {
+        pollfds = STITCH_REALLOC(NULL, fds_count*sizeof(*pollfds));
+        STITCH_ASSERT(pollfds != NULL && "Buy more RAM lol");
+    }
+    // The output pipes go first, followed by the exits of the jobs that are done with their output
+    for (size_t i = 0, j = 0, k = pipes_count; i < jobs->count; ++i) {
+        const Stitch_Job *job = &jobs->items[i];
+        if (job->proc == STITCH_INVALID_PROC) continue;
+        if (job->output_fd != STITCH_INVALID_FD) pollfds[j++] = (struct pollfd) {.fd = job->output_fd, .events = POLLIN};
+        else if (job->exit_fd != STITCH_INVALID_FD) pollfds[k++] = (struct pollfd) {.fd = job->exit_fd, .events = POLLIN};
+    }
+
+    // NOTE: the jobs without the pidfd can only be checked periodically
+    if (poll(pollfds, fds_count, has_unwaitable ? 10 : -1) >= 0) {
+        for (size_t i = 0, j = 0; i < jobs->count; ++i) {
+            Stitch_Job *job = &jobs->items[i];
+            if (job->proc == STITCH_INVALID_PROC || job->output_fd == STITCH_INVALID_FD) continue;
+            if (pollfds[j++].revents == 0) continue;
+            stitch_da_reserve(&job->output, job->output.count + 4096);
+            ssize_t n = read(job->output_fd, job->output.items + job->output.count, job->output.capacity - job->output.count);
+            if (n > 0) job->output.count += n;
+            if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+                close(job->output_fd);
+                job->output_fd = STITCH_INVALID_FD;
+            }
+        }
+    }
+
+    if (pollfds != stack_pollfds) STITCH_FREE(pollfds);
+    return true;
 }
+#endif // _WIN32
 
-bool stitch_read_entire_dir(const char *parent, Stitch_File_Paths *children)
+bool stitch_jobs_wait_any(Stitch_Jobs *jobs, Stitch_Job *finished)
 {
-    bool result = true;
-    DIR *dir = NULL;
+    if (jobs->running == 0) return false;
 
-    dir = opendir(parent);
-    if (dir == NULL) {
-        #ifdef _WIN32
-        stitch_log(STITCH_ERROR, "Could not open directory %s: %s", parent, stitch_win32_error_message(GetLastError()));
-        #else
-        stitch_log(STITCH_ERROR, "Could not open directory %s: %s", parent, strerror(errno));
-        #endif // _WIN32
-        stitch_return_defer(false);
+#ifdef _WIN32
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+    size_t slots[MAXIMUM_WAIT_OBJECTS];
+    DWORD handles_count = 0;
+    for (size_t i = 0; i < jobs->count; ++i) {
+        if (jobs->items[i].proc == STITCH_INVALID_PROC) continue;
+        handles[handles_count] = jobs->items[i].proc;
+        slots[handles_count] = i;
+        handles_count += 1;
     }
 
-    errno = 0;
-    struct dirent *ent = readdir(dir);
-    while (ent != NULL) {
-        stitch_da_append(children, stitch_temp_strdup(ent->d_name));
-        ent = readdir(dir);
+    DWORD result = WaitForMultipleObjects(handles_count, handles, FALSE, INFINITE);
+    if (result == WAIT_FAILED || result >= WAIT_OBJECT_0 + handles_count) {
+        stitch_log(STITCH_ERROR, "could not wait on child processes: %s", stitch_win32_error_message(GetLastError()));
+        return false;
     }
 
-    if (errno != 0) {
-        #ifdef _WIN32
-        stitch_log(STITCH_ERROR, "Could not read directory %s: %s", parent, stitch_win32_error_message(GetLastError()));
-        #else
-        stitch_log(STITCH_ERROR, "Could not read directory %s: %s", parent, strerror(errno));
-        #endif // _WIN32
-        stitch_return_defer(false);
+    Stitch_Job *job = &jobs->items[slots[result - WAIT_OBJECT_0]];
+    DWORD exit_status;
+    if (!GetExitCodeProcess(job->proc, &exit_status)) {
+        stitch_log(STITCH_ERROR, "could not get process exit code: %s", stitch_win32_error_message(GetLastError()));
+        exit_status = (DWORD) -1;
+    }
+    stitch__proc_result_win32(job->proc, exit_status, &job->result);
+    job->result.wall_ns = stitch_nanos_since_unspecified_epoch() - job->start_ns;
+    stitch__proc_reaped(job->proc, &job->result);
+    stitch__proc_result_log(&job->result);
+    job->ok = job->result.ok;
+    CloseHandle(job->proc);
+#else
+    Stitch_Job *job = NULL;
+    int wstatus = 0;
+    struct rusage usage;
+    while (job == NULL) {
+        // Some jobs may still be writing, so only the ones that are done with the output are reaped
+        bool collecting = stitch__jobs_collect_output(jobs);
+        for (size_t i = 0; i < jobs->count && job == NULL; ++i) {
+            Stitch_Job *it = &jobs->items[i];
+            if (it->proc == STITCH_INVALID_PROC || it->output_fd != STITCH_INVALID_FD) continue;
+            pid_t pid = wait4(it->proc, &wstatus, WNOHANG, &usage);
+            if (pid < 0 && errno != EINTR) {
+                stitch_log(STITCH_ERROR, "could not wait on child process %d: %s", it->proc, strerror(errno));
+                return false;
+            }
+            if (pid == it->proc) job = it;
+        }
+        if (job != NULL || collecting) continue;
+
+        // NOTE: WNOWAIT leaves the child for whoever owns it, so the processes started outside of the pool
+        // (possibly by other threads) keep their exit statuses
+        siginfo_t info = {0};
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) < 0) {
+            if (errno == EINTR) continue;
+            stitch_log(STITCH_ERROR, "could not wait on child processes: %s", strerror(errno));
+            return false;
+        }
+        bool ours = false;
+        for (size_t i = 0; i < jobs->count && !ours; ++i) {
+            ours = jobs->items[i].proc == info.si_pid;
+        }
+        // Somebody else's child stays waitable until its owner reaps it, so poll our own children until then
+        if (!ours) poll(NULL, 0, 10);
     }
 
-defer:
-    if (dir) closedir(dir);
-    return result;
+    stitch__proc_result_posix(wstatus, &usage, &job->result);
+    job->result.wall_ns = stitch_nanos_since_unspecified_epoch() - job->start_ns;
+    stitch__proc_reaped(job->proc, &job->result);
+    if (job->exit_fd != STITCH_INVALID_FD) {
+        close(job->exit_fd);
+        job->exit_fd = STITCH_INVALID_FD;
+    }
+    job->ok = job->result.ok;
+    if (jobs->output == STITCH_OUTPUT_BUFFER || (jobs->output == STITCH_OUTPUT_FAILED_ONLY && !job->ok)) {
+        fwrite(job->output.items, 1, job->output.count, stderr);
+        fflush(stderr);
+    }
+    job->output.count = 0;
+    stitch__proc_result_log(&job->result);
+#endif // _WIN32
+
+    if (!job->ok) jobs->failed += 1;
+    *finished = *job;
+    job->proc = STITCH_INVALID_PROC;
+    jobs->running -= 1;
+    return true;
 }
 
-bool stitch_write_entire_file(const char *path, const void *data, size_t size)
+bool stitch_jobs_wait_all(Stitch_Jobs *jobs)
 {
     bool result = true;
+    while (jobs->running > 0) {
+        Stitch_Job finished;
+        if (!stitch_jobs_wait_any(jobs, &finished)) {
+            result = false;
+            break;
+        }
+    }
+    if (jobs->failed > 0) result = false;
+    jobs->failed = 0;
+    return result;
+}
 
-    FILE *f = fopen(path, "wb");
-    if (f == NULL) {
-        stitch_log(STITCH_ERROR, "Could not open file %s for writing: %s\n", path, strerror(errno));
-        stitch_return_defer(false);
+void stitch_jobs_free(Stitch_Jobs jobs)
+{
+    for (size_t i = 0; i < jobs.count; ++i) {
+        if (jobs.items[i].output_fd != STITCH_INVALID_FD) stitch_fd_close(jobs.items[i].output_fd);
+        if (jobs.items[i].exit_fd != STITCH_INVALID_FD) stitch_fd_close(jobs.items[i].exit_fd);
+        stitch_sb_free(jobs.items[i].output);
+    }
+    STITCH_FREE(jobs.items);
+}
+
+// Open addressing hash table that maps NULL-terminated strings to indices. Used internally to
+// look up things by file path. The keys are not copied, so they must outlive the table.
+typedef struct {
+    const char *key;
+    size_t hash;
+    size_t value;
+} Stitch__Index_Slot;
+
+typedef struct {
+    Stitch__Index_Slot *slots;
+    size_t count;
+    size_t capacity;
+} Stitch__Index;
+
+static size_t stitch__hash_cstr(const char *cstr)
+{
+    // FNV-1a
+    size_t hash = 2166136261u;
+    for (; *cstr; ++cstr) {
+        hash ^= (unsigned char) *cstr;
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    //           len
-    //           v
-    // aaaaaaaaaa
-    //     ^
-    //     data
+static Stitch__Index_Slot *stitch__index_find(Stitch__Index *index, const char *key, size_t hash)
+{
+    size_t i = hash & (index->capacity - 1);
+    while (index->slots[i].key != NULL) {
+        if (index->slots[i].hash == hash && strcmp(index->slots[i].key, key) == 0) break;
+        i = (i + 1) & (index->capacity - 1);
+    }
+    return &index->slots[i];
+}
 
-    const char *buf = data;
-    while (size > 0) {
-        size_t n = fwrite(buf, 1, size, f);
-        if (ferror(f)) {
-            stitch_log(STITCH_ERROR, "Could not write into file %s: %s\n", path, strerror(errno));
-            stitch_return_defer(false);
+static bool stitch__index_get(Stitch__Index *index, const char *key, size_t *value)
+{
+    if (index->capacity == 0) return false;
+    Stitch__Index_Slot *slot = stitch__index_find(index, key, stitch__hash_cstr(key));
+    if (slot->key == NULL) return false;
+    *value = slot->value;
+    return true;
+}
+
+static void stitch__index_put(Stitch__Index *index, const char *key, size_t value)
+{
+    // NOTE: keep the load factor below 1/2 so the probing sequences stay short
+    if ((index->count + 1)*2 > index->capacity) {
+        Stitch__Index old = *index;
+        index->capacity = old.capacity ? old.capacity*2 : 64;
+        index->count = 0;
+        index->slots = STITCH_REALLOC(NULL, index->capacity*sizeof(*index->slots));
+        STITCH_ASSERT(index->slots != NULL && "Buy more RAM lol");
+        memset(index->slots, 0, index->capacity*sizeof(*index->slots));
+        for (size_t i = 0; i < old.capacity; ++i) {
+            if (old.slots[i].key == NULL) continue;
+            *stitch__index_find(index, old.slots[i].key, old.slots[i].hash) = old.slots[i];
+            index->count += 1;
+        }
+        STITCH_FREE(old.slots);
+    }
+
+    size_t hash = stitch__hash_cstr(key);
+    Stitch__Index_Slot *slot = stitch__index_find(index, key, hash);
+    if (slot->key == NULL) index->count += 1;
+    slot->key   = key;
+    slot->hash  = hash;
+    slot->value = value;
+}
+
+static void stitch__index_free(Stitch__Index *index)
+{
+    STITCH_FREE(index->slots);
+    memset(index, 0, sizeof(*index));
+}
+
+static const char *stitch__target_name(const Stitch_Target *target)
+{
+    if (target->outputs.count > 0) return target->outputs.items[0];
+    if (target->cmd.count > 0) return target->cmd.items[0];
+    return "<empty target>";
+}
+
+size_t stitch_graph_add(Stitch_Graph *graph, Stitch_Target target)
+{
+    stitch_da_append(graph, target);
+    return graph->count - 1;
+}
+
+void stitch_graph_free(Stitch_Graph *graph)
+{
+    for (size_t i = 0; i < graph->count; ++i) {
+        Stitch_Target *target = &graph->items[i];
+        if (!graph->arena_targets) {
+            stitch_cmd_free(target->cmd);
+            stitch_da_free(target->inputs);
+            stitch_da_free(target->outputs);
+        }
+        stitch_da_free(target->deps);
+        stitch_da_free(target->dependents);
+    }
+    stitch_da_free(*graph);
+    memset(graph, 0, sizeof(*graph));
+}
+
+// Connects the targets with the edges and puts them into a topological order. Returns false on
+// duplicate outputs and dependency cycles.
+// Appends the targets to order so every target comes after all of its deps (Kahn's algorithm over the edges
+// that stitch__graph_link() has filled in). Returns false if there is a cycle and puts one of its targets into cyclic.
+static bool stitch__graph_toposort(const Stitch_Graph *graph, Stitch_Indices *order, size_t *cyclic)
+{
+    size_t first = order->count;
+    Stitch_Indices indegrees = {0};
+    stitch_da_resize(&indegrees, graph->count);
+    for (size_t i = 0; i < graph->count; ++i) {
+        indegrees.items[i] = graph->items[i].deps.count;
+        if (indegrees.items[i] == 0) stitch_da_append(order, i);
+    }
+    for (size_t head = first; head < order->count; ++head) {
+        const Stitch_Target *target = &graph->items[order->items[head]];
+        for (size_t j = 0; j < target->dependents.count; ++j) {
+            size_t dependent = target->dependents.items[j];
+            if (--indegrees.items[dependent] == 0) stitch_da_append(order, dependent);
+        }
+    }
+    bool result = order->count - first == graph->count;
+    for (size_t i = 0; i < graph->count && !result; ++i) {
+        if (indegrees.items[i] > 0) {
+            *cyclic = i;
+            break;
+        }
+    }
+    stitch_da_free(indegrees);
+    return result;
+}
+
+static bool stitch__graph_link(Stitch_Graph *graph, Stitch_Indices *order)
+{
+    bool result = true;
+    Stitch__Index producers = {0};
+
+    for (size_t i = 0; i < graph->count; ++i) {
+        Stitch_Target *target = &graph->items[i];
+        target->deps.count = 0;
+        target->dependents.count = 0;
+        target->pending = 0;
+        target->dirty = false;
+        target->restored = false;
+        target->cache_key = 0;
+        for (size_t j = 0; j < target->outputs.count; ++j) {
+            size_t producer;
+            if (stitch__index_get(&producers, target->outputs.items[j], &producer)) {
+                stitch_log(STITCH_ERROR, "%s is produced by more than one target", target->outputs.items[j]);
+                stitch_return_defer(false);
+            }
+            stitch__index_put(&producers, target->outputs.items[j], i);
         }
-        size -= n;
-        buf  += n;
+    }
+
+    for (size_t i = 0; i < graph->count; ++i) {
+        Stitch_Target *target = &graph->items[i];
+        for (size_t j = 0; j < target->inputs.count; ++j) {
+            size_t dep;
+            if (!stitch__index_get(&producers, target->inputs.items[j], &dep)) continue;
+            bool known = false;
+            for (size_t k = 0; k < target->deps.count && !known; ++k) {
+                known = target->deps.items[k] == dep;
+            }
+            if (known) continue;
+            stitch__da_append_many_init_cap(&target->deps, &dep, 1, STITCH_TARGET_INIT_CAP);
+            stitch__da_append_many_init_cap(&graph->items[dep].dependents, &i, 1, STITCH_TARGET_INIT_CAP);
+        }
+    }
+
+    size_t cyclic;
+    if (!stitch__graph_toposort(graph, order, &cyclic)) {
+        stitch_log(STITCH_ERROR, "dependency cycle detected involving %s", stitch__target_name(&graph->items[cyclic]));
+        stitch_return_defer(false);
     }
 
 defer:
-    if (f) fclose(f);
+    stitch__index_free(&producers);
     return result;
 }
 
-Stitch_File_Type stitch_get_file_type(const char *path)
+// The command of the target has modified its outputs, so their cached stats are stale now
+static void stitch__target_invalidate_outputs(const Stitch_Target *target)
 {
-#ifdef _WIN32
-    DWORD attr = GetFileAttributesA(path);
-    if (attr == INVALID_FILE_ATTRIBUTES) {
-        stitch_log(STITCH_ERROR, "Could not get file attributes of %s: %s", path, stitch_win32_error_message(GetLastError()));
-        return -1;
+    for (size_t i = 0; i < target->outputs.count; ++i) {
+        stitch_stat_cache_invalidate(target->outputs.items[i]);
     }
+    if (target->depfile) stitch_stat_cache_invalidate(target->depfile);
+}
 
-    if (attr & FILE_ATTRIBUTE_DIRECTORY) return STITCH_FILE_DIRECTORY;
-    // TODO: detect symlinks on Windows (whatever that means on Windows anyway)
-    return STITCH_FILE_REGULAR;
-#else // _WIN32
-    struct stat statbuf;
-    if (stat(path, &statbuf) < 0) {
-        stitch_log(STITCH_ERROR, "Could not get stat of %s: %s", path, strerror(errno));
-        return -1;
+static int stitch__cmd_changed(const char *output_path, uint64_t cmd_hash);
+
+// Remember what the outputs of the target were built from and with, see stitch_build_log_record()
+static bool stitch__target_record(const Stitch_Target *target)
+{
+    bool result = true;
+    Stitch_File_Paths inputs = {0};
+
+    // NOTE: the depfile deps are only needed for the hash of the inputs
+    if (stitch_rebuild_mode == STITCH_REBUILD_HASH) {
+        stitch_da_append_many(&inputs, target->inputs.items, target->inputs.count);
+        if (target->depfile && stitch_depfile_deps(target->depfile, &inputs) < 0) stitch_return_defer(false);
+    }
+    for (size_t i = 0; i < target->outputs.count; ++i) {
+        if (!stitch_build_log_record(target->outputs.items[i], target->cmd, inputs.items, inputs.count)) stitch_return_defer(false);
     }
 
-    if (S_ISREG(statbuf.st_mode)) return STITCH_FILE_REGULAR;
-    if (S_ISDIR(statbuf.st_mode)) return STITCH_FILE_DIRECTORY;
-    if (S_ISLNK(statbuf.st_mode)) return STITCH_FILE_SYMLINK;
-    return STITCH_FILE_OTHER;
-#endif // _WIN32
+defer:
+    stitch_da_free(inputs);
+    return result;
 }
 
-bool stitch_delete_file(const char *path)
+// The outputs of the target as far as the action cache is concerned: the depfile is restored along with them
+static void stitch__target_cached_outputs(const Stitch_Target *target, Stitch_File_Paths *outputs)
 {
-    stitch_log(STITCH_INFO, "deleting %s", path);
-#ifdef _WIN32
-    if (!DeleteFileA(path)) {
-        stitch_log(STITCH_ERROR, "Could not delete file %s: %s", path, stitch_win32_error_message(GetLastError()));
+    stitch_da_append_many(outputs, target->outputs.items, target->outputs.count);
+    if (target->depfile) stitch_da_append(outputs, target->depfile);
+}
+
+// Try to restore the outputs of the target from the action cache. Problems with the cache
+// are never fatal, the command just runs as usual.
+static bool stitch__target_restore(const Stitch_Action_Cache *cache, Stitch_Target *target)
+{
+    Stitch_File_Paths outputs = {0};
+    if (!stitch_action_key(cache, target->cmd, target->inputs.items, target->inputs.count, &target->cache_key)) {
+        target->cache_key = 0;
         return false;
     }
-    return true;
-#else
-    if (remove(path) < 0) {
-        stitch_log(STITCH_ERROR, "Could not delete file %s: %s", path, strerror(errno));
-        return false;
+    stitch__target_cached_outputs(target, &outputs);
+    target->restored = stitch_action_cache_restore(cache, target->cache_key, outputs.items, outputs.count) == 1;
+    stitch_da_free(outputs);
+    return target->restored;
+}
+
+static void stitch__target_store(const Stitch_Action_Cache *cache, const Stitch_Target *target)
+{
+    Stitch_File_Paths outputs = {0};
+    Stitch_File_Paths deps = {0};
+    stitch__target_cached_outputs(target, &outputs);
+    // NOTE: the inputs are already a part of the key, only the deps discovered by the command are needed
+    bool ok = target->depfile == NULL || stitch_depfile_deps(target->depfile, &deps) == 1;
+    if (ok) ok = stitch_action_cache_store(cache, target->cache_key, outputs.items, outputs.count, deps.items, deps.count);
+    if (!ok) stitch_log(STITCH_WARNING, "could not store %s in the action cache", stitch__target_name(target));
+    stitch_da_free(outputs);
+    stitch_da_free(deps);
+}
+
+// Called when the target has finished. Puts the dependents that are not waiting for anything else into ready.
+static void stitch__graph_release_dependents(Stitch_Graph *graph, size_t index, Stitch_Indices *ready)
+{
+    Stitch_Target *target = &graph->items[index];
+    for (size_t j = 0; j < target->dependents.count; ++j) {
+        Stitch_Target *dependent = &graph->items[target->dependents.items[j]];
+        if (--dependent->pending == 0) stitch_da_append(ready, target->dependents.items[j]);
     }
-    return true;
-#endif // _WIN32
 }
 
-bool stitch_copy_directory_recursively(const char *src_path, const char *dst_path)
+bool stitch_graph_build(Stitch_Graph *graph, size_t max_jobs)
 {
     bool result = true;
-    Stitch_File_Paths children = {0};
-    Stitch_String_Builder src_sb = {0};
-    Stitch_String_Builder dst_sb = {0};
-    size_t temp_checkpoint = stitch_temp_save();
+    Stitch_Indices order = {0};
+    Stitch_Indices ready = {0};
+    Stitch_Jobs jobs = {.max_jobs = max_jobs, .output = graph->output};
+    size_t dirty_count = 0;
+    size_t restored_count = 0;
+    size_t stored_count = 0;
+    bool stat_cache_was_enabled = stitch_stat_cache_enabled;
+    stitch_stat_cache_enabled = true;
+    bool proc_stats_were_enabled = stitch_proc_stats_enabled;
+    if (graph->report_top > 0) stitch_proc_stats_enabled = true;
+
+    if (!stitch__graph_link(graph, &order)) stitch_return_defer(false);
+
+    // Dirtiness only propagates along the edges. Since the targets are visited in the
+    // topological order all the deps of a target are already resolved by the time we get to it.
+    for (size_t i = 0; i < order.count; ++i) {
+        Stitch_Target *target = &graph->items[order.items[i]];
+        target->start_ns = target->end_ns = 0;
+        for (size_t j = 0; j < target->deps.count && !target->dirty; ++j) {
+            target->dirty = graph->items[target->deps.items[j]].dirty;
+        }
+        // NOTE: a target without outputs has nothing to compare the timestamps against
+        if (target->outputs.count == 0) target->dirty = true;
+        for (size_t j = 0; j < target->outputs.count && !target->dirty; ++j) {
+            int rebuild = target->depfile
+                ? stitch_needs_rebuild_with_depfile(target->outputs.items[j], target->inputs.items, target->inputs.count, target->depfile)
+                : stitch_needs_rebuild(target->outputs.items[j], target->inputs.items, target->inputs.count);
+            if (rebuild < 0) stitch_return_defer(false);
+            target->dirty = rebuild > 0;
+        }
+        if (!target->dirty && target->cmd.count > 0) {
+            // The files are up to date, but the flags might have changed
+            uint64_t cmd_hash = stitch_cmd_hash(target->cmd);
+            for (size_t j = 0; j < target->outputs.count && !target->dirty; ++j) {
+                target->dirty = stitch__cmd_changed(target->outputs.items[j], cmd_hash);
+            }
+        }
+        if (!target->dirty) continue;
 
-    Stitch_File_Type type = stitch_get_file_type(src_path);
-    if (type < 0) return false;
+        dirty_count += 1;
+        for (size_t j = 0; j < target->deps.count; ++j) {
+            if (graph->items[target->deps.items[j]].dirty) target->pending += 1;
+        }
+        if (target->pending == 0) stitch_da_append(&ready, order.items[i]);
+    }
 
-    switch (type) {
-        case STITCH_FILE_DIRECTORY: {
-            if (!stitch_mkdir_if_not_exists(dst_path)) stitch_return_defer(false);
-            if (!stitch_read_entire_dir(src_path, &children)) stitch_return_defer(false);
+    if (dirty_count == 0) {
+        stitch_log(STITCH_INFO, "all %zu targets are up to date", graph->count);
+        stitch_return_defer(true);
+    }
+    stitch_log(STITCH_INFO, "rebuilding %zu out of %zu targets", dirty_count, graph->count);
 
-            for (size_t i = 0; i < children.count; ++i) {
-                if (strcmp(children.items[i], ".") == 0) continue;
-                if (strcmp(children.items[i], "..") == 0) continue;
+    size_t head = 0;
+    for (;;) {
+        while (result && head < ready.count && !stitch_jobs_full(&jobs)) {
+            size_t index = ready.items[head++];
+            Stitch_Target *target = &graph->items[index];
+            target->start_ns = stitch_nanos_since_unspecified_epoch();
+            if (target->cmd.count == 0) {
+                // Phony targets finish immediately
+                target->end_ns = target->start_ns;
+                stitch__graph_release_dependents(graph, index, &ready);
+                continue;
+            }
+            if (graph->action_cache && target->outputs.count > 0 && stitch__target_restore(graph->action_cache, target)) {
+                restored_count += 1;
+                target->end_ns = stitch_nanos_since_unspecified_epoch();
+                stitch__target_invalidate_outputs(target);
+                if (!stitch__target_record(target)) {
+                    result = false;
+                    continue;
+                }
+                stitch__graph_release_dependents(graph, index, &ready);
+                continue;
+            }
+            if (!stitch_jobs_start(&jobs, target->cmd, (Stitch_Cmd_Redirect) {0}, index)) result = false;
+        }
 
-                src_sb.count = 0;
-                stitch_sb_append_cstr(&src_sb, src_path);
-                stitch_sb_append_cstr(&src_sb, "/");
-                stitch_sb_append_cstr(&src_sb, children.items[i]);
-                stitch_sb_append_null(&src_sb);
+        Stitch_Job finished;
+        if (!stitch_jobs_wait_any(&jobs, &finished)) break;
+        graph->items[finished.tag].end_ns = stitch_nanos_since_unspecified_epoch();
+        stitch__target_invalidate_outputs(&graph->items[finished.tag]);
+        if (!finished.ok || !stitch__target_record(&graph->items[finished.tag])) {
+            result = false;
+            continue;
+        }
+        if (graph->action_cache && graph->items[finished.tag].cache_key != 0) {
+            stitch__target_store(graph->action_cache, &graph->items[finished.tag]);
+            stored_count += 1;
+        }
+        stitch__graph_release_dependents(graph, finished.tag, &ready);
+    }
 
-                dst_sb.count = 0;
-                stitch_sb_append_cstr(&dst_sb, dst_path);
-                stitch_sb_append_cstr(&dst_sb, "/");
-                stitch_sb_append_cstr(&dst_sb, children.items[i]);
-                stitch_sb_append_null(&dst_sb);
+    if (restored_count > 0) stitch_log(STITCH_INFO, "restored %zu targets from the action cache", restored_count);
+    if (stored_count > 0 && graph->action_cache->max_size > 0 && !stitch_action_cache_trim(graph->action_cache)) {
+        stitch_log(STITCH_WARNING, "could not trim the action cache %s", graph->action_cache->dir);
+    }
+    if (graph->report_top > 0) stitch_proc_stats_report(graph->report_top);
+    if (graph->report_critical_path) stitch_graph_report_critical_path(graph, jobs.max_jobs);
+
+defer:
+    if (jobs.running > 0) {
+        Stitch_Job finished;
+        while (stitch_jobs_wait_any(&jobs, &finished)) {
+            stitch__target_invalidate_outputs(&graph->items[finished.tag]);
+        }
+    }
+    stitch_jobs_free(jobs);
+    if (!stat_cache_was_enabled) {
+        stitch_stat_cache_enabled = false;
+        stitch_stat_cache_reset();
+    }
+    if (!proc_stats_were_enabled && graph->report_top > 0) {
+        stitch_proc_stats_enabled = false;
+        stitch_proc_stats_reset();
+    }
+    stitch_da_free(order);
+    stitch_da_free(ready);
+    return result;
+}
+
+void stitch_graph_critical_path(const Stitch_Graph *graph, Stitch_Indices *path)
+{
+    if (graph->count == 0) return;
+    size_t first = path->count;
+    Stitch_Indices order = {0};
+    // The length of the longest chain of commands that ends with the target and the dep it comes through
+    uint64_t *lengths = STITCH_REALLOC(NULL, graph->count*sizeof(*lengths));
+    size_t *prevs = STITCH_REALLOC(NULL, graph->count*sizeof(*prevs));
+    STITCH_ASSERT(lengths != NULL && prevs != NULL && "Buy more RAM lol");
+
+    // NOTE: the targets on a cycle never ran, so they are not on the path anyway
+    size_t cyclic;
+    stitch__graph_toposort(graph, &order, &cyclic);
+
+    // The targets are weighted with how long their commands ran, so the time they spent waiting for a free
+    // job slot does not count. That is what the build would take with unlimited job slots.
+    size_t last = SIZE_MAX;
+    for (size_t i = 0; i < order.count; ++i) {
+        size_t index = order.items[i];
+        const Stitch_Target *target = &graph->items[index];
+        lengths[index] = 0;
+        prevs[index] = SIZE_MAX;
+        if (target->end_ns == 0) continue;
+        for (size_t j = 0; j < target->deps.count; ++j) {
+            size_t dep = target->deps.items[j];
+            if (graph->items[dep].end_ns == 0) continue;
+            if (prevs[index] == SIZE_MAX || lengths[dep] > lengths[prevs[index]]) prevs[index] = dep;
+        }
+        if (prevs[index] != SIZE_MAX) lengths[index] = lengths[prevs[index]];
+        lengths[index] += target->end_ns - target->start_ns;
+        if (last == SIZE_MAX || lengths[index] > lengths[last]) last = index;
+    }
+
+    for (size_t current = last; current != SIZE_MAX; current = prevs[current]) {
+        stitch_da_append(path, current);
+    }
+    for (size_t i = first, j = path->count; i + 1 < j; ++i, --j) {
+        size_t tmp = path->items[i];
+        path->items[i] = path->items[j - 1];
+        path->items[j - 1] = tmp;
+    }
+
+    STITCH_FREE(lengths);
+    STITCH_FREE(prevs);
+    stitch_da_free(order);
+}
+
+typedef struct {
+    uint64_t time;
+    int delta;        // +1 when a command starts, -1 when it finishes
+} Stitch__Graph_Event;
+
+typedef struct {
+    Stitch__Graph_Event *items;
+    size_t count;
+    size_t capacity;
+} Stitch__Graph_Events;
+
+static int stitch__graph_event_compare(const void *a, const void *b)
+{
+    const Stitch__Graph_Event *x = a, *y = b;
+    if (x->time != y->time) return x->time < y->time ? -1 : 1;
+    // The finishes go first so the commands that are started right after another one finished don't overlap
+    return x->delta - y->delta;
+}
+
+void stitch_graph_report_critical_path(const Stitch_Graph *graph, size_t max_jobs)
+{
+    if (max_jobs == 0) max_jobs = stitch_nprocs();
+
+    Stitch_Indices path = {0};
+    Stitch__Graph_Events events = {0};
+    uint64_t *levels = NULL;
+
+    uint64_t build_start = UINT64_MAX, build_end = 0, busy = 0;
+    for (size_t i = 0; i < graph->count; ++i) {
+        const Stitch_Target *target = &graph->items[i];
+        if (target->end_ns == 0) continue;
+        if (target->start_ns < build_start) build_start = target->start_ns;
+        if (target->end_ns > build_end) build_end = target->end_ns;
+        if (target->end_ns == target->start_ns) continue;
+        busy += target->end_ns - target->start_ns;
+        stitch_da_append(&events, ((Stitch__Graph_Event) {target->start_ns, +1}));
+        stitch_da_append(&events, ((Stitch__Graph_Event) {target->end_ns, -1}));
+    }
+    if (build_end == 0 || build_end == build_start) goto defer;
+    uint64_t wall = build_end - build_start;
+
+    stitch_graph_critical_path(graph, &path);
+    uint64_t path_busy = 0, path_wait = 0, prev_end = build_start;
+    stitch_log(STITCH_INFO, "Critical path:");
+    stitch_log(STITCH_INFO, "  %9s %9s  %s", "command", "waited", "target");
+    for (size_t i = 0; i < path.count; ++i) {
+        const Stitch_Target *target = &graph->items[path.items[i]];
+        uint64_t waited = target->start_ns > prev_end ? target->start_ns - prev_end : 0;
+        path_busy += target->end_ns - target->start_ns;
+        path_wait += waited;
+        prev_end = target->end_ns;
+        stitch_log(STITCH_INFO, "  %8.2fs %8.2fs  %s", (target->end_ns - target->start_ns)/1e9, waited/1e9, stitch__target_name(target));
+    }
+    stitch_log(STITCH_INFO, "%zu steps: %.2fs of commands and %.2fs of waiting out of %.2fs of wall time",
+               path.count, path_busy/1e9, path_wait/1e9, wall/1e9);
+
+    // How long the build spent running exactly N commands at the same time
+    qsort(events.items, events.count, sizeof(*events.items), stitch__graph_event_compare);
+    size_t levels_count = events.count/2 + 1;
+    levels = STITCH_REALLOC(NULL, levels_count*sizeof(*levels));
+    STITCH_ASSERT(levels != NULL && "Buy more RAM lol");
+    memset(levels, 0, levels_count*sizeof(*levels));
+    size_t level = 0;
+    uint64_t time = build_start;
+    for (size_t i = 0; i < events.count; ++i) {
+        levels[level] += events.items[i].time - time;
+        time = events.items[i].time;
+        level += events.items[i].delta;
+    }
+    levels[level] += build_end - time;
+
+    uint64_t capacity = (uint64_t) max_jobs*wall;
+    uint64_t idle = capacity > busy ? capacity - busy : 0;
+    stitch_log(STITCH_INFO, "Parallelism: %.2f on average out of %zu job slots, %.2fs (%.0f%%) of the slot time was idle",
+               (double) busy/wall, max_jobs, idle/1e9, 100.0*idle/capacity);
+    for (size_t i = 0; i < levels_count; ++i) {
+        if (levels[i] == 0) continue;
+        stitch_log(STITCH_INFO, "  %3zu running: %8.2fs (%3.0f%%)", i, levels[i]/1e9, 100.0*levels[i]/wall);
+    }
+
+    if (path_busy*10 >= wall*9) {
+        stitch_log(STITCH_INFO, "The build is bound by its critical path: splitting the steps on it would help, more cores would not");
+    } else if (idle*10 <= capacity) {
+        stitch_log(STITCH_INFO, "The job slots were busy most of the time: more cores would help");
+    }
+
+defer:
+    STITCH_FREE(levels);
+    stitch_da_free(path);
+    stitch_da_free(events);
+}
+
+#ifdef __linux__
+typedef struct {
+    int wd;              // -1 if the directory is not watched anymore
+    const char *dir;
+} Stitch__Watch;
+
+typedef struct {
+    Stitch__Watch *items;
+    size_t count;
+    size_t capacity;
+    int fd;
+    Stitch__Index dirs;     // directory -> index of its watch
+    Stitch__Index sources;  // the files the changes of which trigger a rebuild
+    Stitch_Arena arena;     // the keys of both indices
+} Stitch__Watcher;
+
+#define STITCH__WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+// Inverse of the way stitch__watcher_add() splits the paths, so the joined path is exactly the source path
+static const char *stitch__watch_join(const char *dir, const char *name)
+{
+    if (strcmp(dir, ".") == 0) return name;
+    size_t dir_len = strlen(dir);
+    if (dir_len > 0 && dir[dir_len - 1] == '/') return stitch_temp_sprintf("%s%s", dir, name);
+    return stitch_temp_sprintf("%s/%s", dir, name);
+}
+
+static void stitch__watcher_add(Stitch__Watcher *watcher, const char *path)
+{
+    size_t index;
+    if (!stitch__index_get(&watcher->sources, path, &index)) {
+        stitch__index_put(&watcher->sources, stitch_arena_strdup(&watcher->arena, path), 0);
+    }
+
+    const char *slash = strrchr(path, '/');
+    const char *dir = ".";
+    if (slash != NULL) {
+        size_t dir_len = slash == path ? 1 : (size_t) (slash - path);
+        char *buf = stitch_arena_alloc(&watcher->arena, dir_len + 1);
+        memcpy(buf, path, dir_len);
+        buf[dir_len] = '\0';
+        dir = buf;
+    }
+
+    if (stitch__index_get(&watcher->dirs, dir, &index)) {
+        if (watcher->items[index].wd >= 0) return;
+    } else {
+        stitch_da_append(watcher, ((Stitch__Watch) {.wd = -1, .dir = dir}));
+        index = watcher->count - 1;
+        stitch__index_put(&watcher->dirs, dir, index);
+    }
+
+    // NOTE: the directories that do not exist yet are retried after the next build
+    int wd = inotify_add_watch(watcher->fd, dir, STITCH__WATCH_MASK);
+    if (wd < 0 && errno != ENOENT) stitch_log(STITCH_WARNING, "Could not watch directory %s: %s", dir, strerror(errno));
+    watcher->items[index].wd = wd;
+}
+
+// Watch the directories of all the sources of the graph. The depfiles might have brought in new ones since the last time.
+static bool stitch__watcher_update(Stitch__Watcher *watcher, const Stitch_Graph *graph)
+{
+    bool result = true;
+    Stitch__Index outputs = {0};
+    Stitch_File_Paths paths = {0};
+
+    for (size_t i = 0; i < graph->count; ++i) {
+        const Stitch_Target *target = &graph->items[i];
+        for (size_t j = 0; j < target->outputs.count; ++j) stitch__index_put(&outputs, target->outputs.items[j], i);
+    }
+    for (size_t i = 0; i < graph->count; ++i) {
+        const Stitch_Target *target = &graph->items[i];
+        paths.count = 0;
+        stitch_da_append_many(&paths, target->inputs.items, target->inputs.count);
+        if (target->depfile && stitch_depfile_deps(target->depfile, &paths) < 0) stitch_return_defer(false);
+        for (size_t j = 0; j < paths.count; ++j) {
+            size_t producer;
+            if (stitch__index_get(&outputs, paths.items[j], &producer)) continue;
+            stitch__watcher_add(watcher, paths.items[j]);
+        }
+    }
+
+defer:
+    stitch__index_free(&outputs);
+    stitch_da_free(paths);
+    return result;
+}
+
+// Read the pending events. Sets *changed if any of the sources has changed.
+// RETURNS 1 - read some events, 0 - nothing happened within timeout_ms, -1 - error
+static int stitch__watcher_wait(Stitch__Watcher *watcher, int timeout_ms, bool *changed)
+{
+    struct pollfd pollfd = {.fd = watcher->fd, .events = POLLIN};
+    int ready = poll(&pollfd, 1, timeout_ms);
+    if (ready < 0 && errno != EINTR) {
+        stitch_log(STITCH_ERROR, "Could not wait for the file changes: %s", strerror(errno));
+        return -1;
+    }
+    if (ready <= 0) return 0;
+
+    union {
+        struct inotify_event event;
+        char bytes[4096];
+    } buf;
+    ssize_t size = read(watcher->fd, buf.bytes, sizeof(buf.bytes));
+    if (size < 0) {
+        if (errno == EINTR || errno == EAGAIN) return 0;
+        stitch_log(STITCH_ERROR, "Could not read the file changes: %s", strerror(errno));
+        return -1;
+    }
+
+    size_t checkpoint = stitch_temp_save();
+    for (char *ptr = buf.bytes; ptr < buf.bytes + size;) {
+        const struct inotify_event *event = (const struct inotify_event *) ptr;
+        ptr += sizeof(*event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+            // Some events are lost, so nothing we know about the files can be trusted anymore
+            stitch_stat_cache_reset();
+            *changed = true;
+            continue;
+        }
+        for (size_t i = 0; i < watcher->count; ++i) {
+            // NOTE: several spellings of the same directory share the watch
+            if (watcher->items[i].wd != event->wd) continue;
+            if (event->mask & IN_IGNORED) {
+                watcher->items[i].wd = -1;
+                continue;
+            }
+            if (event->len == 0) continue;
+            const char *path = stitch__watch_join(watcher->items[i].dir, event->name);
+            size_t value;
+            if (!stitch__index_get(&watcher->sources, path, &value)) continue;
+            stitch_stat_cache_invalidate(path);
+            *changed = true;
+        }
+    }
+    stitch_temp_rewind(checkpoint);
+    return 1;
+}
+#endif // __linux__
+
+static void stitch__deps_cache_compact(void);
+
+bool stitch_graph_watch(Stitch_Graph *graph, Stitch_Watch_Opt opt)
+{
+#ifdef __linux__
+    bool result = true;
+    Stitch__Watcher watcher = {.fd = -1};
+    bool stat_cache_was_enabled = stitch_stat_cache_enabled;
+    stitch_stat_cache_enabled = true;
+    int debounce_ms = opt.debounce_ms > 0 ? (int) opt.debounce_ms : 50;
+
+    watcher.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (watcher.fd < 0) {
+        stitch_log(STITCH_ERROR, "Could not start watching the files: %s", strerror(errno));
+        stitch_return_defer(false);
+    }
+
+    for (size_t builds = 1;; ++builds) {
+        result = stitch_graph_build(graph, opt.max_jobs);
+        if (!stitch__watcher_update(&watcher, graph)) stitch_return_defer(false);
+        if (opt.after_build && !opt.after_build(graph, result, opt.data)) break;
+        if (opt.max_builds > 0 && builds >= opt.max_builds) break;
+        // Every rebuild rewrites the depfiles, so the deps of their old versions would pile up for good
+        stitch__deps_cache_compact();
+        stitch_log(STITCH_INFO, "watching %zu files in %zu directories", watcher.sources.count, watcher.count);
+
+        bool changed = false;
+        int events;
+        while ((events = stitch__watcher_wait(&watcher, -1, &changed)) >= 0 && !changed) {}
+        // An editor saving a file can fire several events, so wait until everything is quiet for a while
+        while (events > 0) events = stitch__watcher_wait(&watcher, debounce_ms, &changed);
+        if (events < 0) stitch_return_defer(false);
+    }
+
+defer:
+    if (watcher.fd >= 0) close(watcher.fd);
+    stitch_da_free(watcher);
+    stitch__index_free(&watcher.dirs);
+    stitch__index_free(&watcher.sources);
+    stitch_arena_free(&watcher.arena);
+    if (!stat_cache_was_enabled) {
+        stitch_stat_cache_enabled = false;
+        stitch_stat_cache_reset();
+    }
+    return result;
+#else
+    STITCH_UNUSED(graph);
+    STITCH_UNUSED(opt);
+    stitch_log(STITCH_ERROR, "Watching the files is only implemented on Linux yet");
+    return false;
+#endif // __linux__
+}
+
+bool stitch_cmd_run_sync_redirect(Stitch_Cmd cmd, Stitch_Cmd_Redirect redirect)
+{
+    Stitch_Proc p = stitch_cmd_run_async_redirect(cmd, redirect);
+    if (p == STITCH_INVALID_PROC) return false;
+    return stitch_proc_wait(p);
+}
+
+bool stitch_cmd_run_sync(Stitch_Cmd cmd)
+{
+    Stitch_Proc p = stitch_cmd_run_async(cmd);
+    if (p == STITCH_INVALID_PROC) return false;
+    return stitch_proc_wait(p);
+}
+
+bool stitch_cmd_run_sync_and_reset(Stitch_Cmd *cmd)
+{
+    bool p = stitch_cmd_run_sync(*cmd);
+    cmd->count = 0;
+    return p;
+}
+
+bool stitch_cmd_run_sync_redirect_and_reset(Stitch_Cmd *cmd, Stitch_Cmd_Redirect redirect)
+{
+    bool p = stitch_cmd_run_sync_redirect(*cmd, redirect);
+    cmd->count = 0;
+    if (redirect.fdin) {
+        stitch_fd_close(*redirect.fdin);
+        *redirect.fdin = STITCH_INVALID_FD;
+    }
+    if (redirect.fdout) {
+        stitch_fd_close(*redirect.fdout);
+        *redirect.fdout = STITCH_INVALID_FD;
+    }
+    if (redirect.fderr) {
+        stitch_fd_close(*redirect.fderr);
+        *redirect.fderr = STITCH_INVALID_FD;
+    }
+    return p;
+}
+
+bool stitch_cmd_run_capture(Stitch_Cmd cmd, Stitch_Cmd_Capture capture)
+{
+    return stitch_cmd_run_capture_many(&cmd, &capture, 1, NULL);
+}
+
+#ifndef _WIN32
+// The parent's end of a pipe of one of the captured commands
+typedef struct {
+    int fd;
+    size_t capture;                  // Index of the command
+    Stitch_String_Builder *sb;       // Where the output goes. NULL for stdin
+    size_t written;                  // How much of the stdin was already fed
+} Stitch__Capture_Pipe;
+
+typedef struct {
+    Stitch__Capture_Pipe *items;
+    size_t count;
+    size_t capacity;
+} Stitch__Capture_Pipes;
+#endif // _WIN32
+
+bool stitch_cmd_run_capture_many(const Stitch_Cmd *cmds, const Stitch_Cmd_Capture *captures, size_t count, bool *oks)
+{
+#ifdef _WIN32
+    STITCH_UNUSED(cmds);
+    STITCH_UNUSED(captures);
+    STITCH_UNUSED(count);
+    STITCH_UNUSED(oks);
+    stitch_log(STITCH_ERROR, "Capturing the output of the commands is not implemented on Windows yet");
+    return false;
+#else
+    bool result = true;
+    Stitch_Procs procs = {0};
+    Stitch__Capture_Pipes pipes = {0};
+    struct pollfd *pollfds = NULL;
+
+    for (size_t i = 0; i < count; ++i) {
+        const Stitch_Cmd_Capture *capture = &captures[i];
+        int in[2] = {-1, -1}, out[2] = {-1, -1}, err[2] = {-1, -1};
+        bool ok = true;
+        if (ok && capture->in.data) ok = stitch__pipe(in);
+        if (ok && capture->out)     ok = stitch__pipe(out);
+        if (ok && capture->err)     ok = stitch__pipe(err);
+
+        Stitch_Proc proc = STITCH_INVALID_PROC;
+        if (ok) {
+            proc = stitch_cmd_run_async_redirect(cmds[i], (Stitch_Cmd_Redirect) {
+                .fdin  = capture->in.data ? &in[0]  : NULL,
+                .fdout = capture->out     ? &out[1] : NULL,
+                .fderr = capture->err     ? &err[1] : NULL,
+            });
+        }
+        // NOTE: the children's ends must be closed in the parent, otherwise the pipes never reach EOF
+        if (in[0]  >= 0) close(in[0]);
+        if (out[1] >= 0) close(out[1]);
+        if (err[1] >= 0) close(err[1]);
+
+        // NOTE: procs.items[i] is the proc of cmds[i] even if it failed to spawn
+        stitch_da_append(&procs, proc);
+        if (proc == STITCH_INVALID_PROC) {
+            if (in[1]  >= 0) close(in[1]);
+            if (out[0] >= 0) close(out[0]);
+            if (err[0] >= 0) close(err[0]);
+            continue;
+        }
+        if (in[1] >= 0) {
+            // NOTE: the writes must not block, the command may be waiting for us to read its output
+            fcntl(in[1], F_SETFL, fcntl(in[1], F_GETFL) | O_NONBLOCK);
+            stitch_da_append(&pipes, ((Stitch__Capture_Pipe) {.fd = in[1], .capture = i}));
+        }
+        if (out[0] >= 0) stitch_da_append(&pipes, ((Stitch__Capture_Pipe) {.fd = out[0], .capture = i, .sb = capture->out}));
+        if (err[0] >= 0) stitch_da_append(&pipes, ((Stitch__Capture_Pipe) {.fd = err[0], .capture = i, .sb = capture->err}));
+    }
+
+    // NOTE: a command that exits without reading all of its stdin would kill us with SIGPIPE
+    stitch__ignore_sigpipe();
+
+    pollfds = STITCH_REALLOC(NULL, (pipes.count + 1)*sizeof(*pollfds));
+    STITCH_ASSERT(pollfds != NULL && "Buy more RAM lol");
+    for (;;) {
+        size_t open_count = 0;
+        for (size_t i = 0; i < pipes.count; ++i) {
+            if (pipes.items[i].fd < 0) continue;
+            pollfds[open_count].fd = pipes.items[i].fd;
+            pollfds[open_count].events = pipes.items[i].sb ? POLLIN : POLLOUT;
+            pollfds[open_count].revents = 0;
+            open_count += 1;
+        }
+        if (open_count == 0) break;
+
+        if (poll(pollfds, open_count, -1) < 0) {
+            if (errno == EINTR) continue;
+            stitch_log(STITCH_ERROR, "Could not poll the pipes: %s", strerror(errno));
+            stitch_return_defer(false);
+        }
+
+        for (size_t i = 0, j = 0; i < pipes.count; ++i) {
+            Stitch__Capture_Pipe *p = &pipes.items[i];
+            if (p->fd < 0) continue;
+            short revents = pollfds[j++].revents;
+            if (revents == 0) continue;
+
+            bool done = false;
+            if (p->sb) {
+                stitch_da_reserve(p->sb, p->sb->count + 4096);
+                ssize_t n = read(p->fd, p->sb->items + p->sb->count, p->sb->capacity - p->sb->count);
+                if (n > 0) p->sb->count += n;
+                done = n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN);
+            } else {
+                Stitch_String_View in = captures[p->capture].in;
+                ssize_t n = in.count > p->written ? write(p->fd, in.data + p->written, in.count - p->written) : 0;
+                if (n > 0) p->written += n;
+                // NOTE: EPIPE means the command is not interested in the rest of its stdin, which is its business
+                done = p->written == in.count || (n < 0 && errno != EINTR && errno != EAGAIN);
+            }
+            if (done) {
+                close(p->fd);
+                p->fd = -1;
+            }
+        }
+    }
+
+defer:
+    for (size_t i = 0; i < pipes.count; ++i) {
+        if (pipes.items[i].fd >= 0) close(pipes.items[i].fd);
+    }
+    for (size_t i = 0; i < procs.count; ++i) {
+        bool ok = procs.items[i] != STITCH_INVALID_PROC && stitch_proc_wait(procs.items[i]);
+        if (oks) oks[i] = ok;
+        if (!ok) result = false;
+    }
+    STITCH_FREE(pollfds);
+    stitch_da_free(pipes);
+    stitch_da_free(procs);
+    return result;
+#endif // _WIN32
+}
+
+void stitch_log(Stitch_Log_Level level, const char *fmt, ...)
+{
+    if (level < stitch_get_minimal_log_level()) return;
+
+    const char *prefix = NULL;
+    switch (level) {
+    case STITCH_INFO:
+        prefix = "[INFO] ";
+        break;
+    case STITCH_WARNING:
+        prefix = "[WARNING] ";
+        break;
+    case STITCH_ERROR:
+        prefix = "[ERROR] ";
+        break;
+    case STITCH_NO_LOGS: return;
+    default:
+        STITCH_UNREACHABLE("stitch_log");
+    }
+
+    // NOTE: the line is written with a single call, so it does not get spliced with the output of the
+    // commands that are running in parallel. Only the unusually long lines need the heap.
+    char stack_line[1024];
+    char *line = stack_line;
+    size_t prefix_len = strlen(prefix);
+    va_list args;
+    va_start(args, fmt);
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int n = vsnprintf(stack_line + prefix_len, sizeof(stack_line) - prefix_len, fmt, args);
+    if (n >= 0 && prefix_len + n + 1 > sizeof(stack_line)) {
+        line = STITCH_REALLOC(NULL, prefix_len + n + 1);
+        STITCH_ASSERT(line != NULL && "Buy more RAM lol");
+        vsnprintf(line + prefix_len, n + 1, fmt, args_copy);
+    }
+    va_end(args_copy);
+    va_end(args);
+    if (n < 0) return;
+
+    memcpy(line, prefix, prefix_len);
+    line[prefix_len + n] = '\n';
+    fwrite(line, 1, prefix_len + n + 1, stderr);
+    if (line != stack_line) STITCH_FREE(line);
+}
+
+bool stitch_read_entire_dir(const char *parent, Stitch_File_Paths *children)
+{
+    bool result = true;
+    DIR *dir = NULL;
+
+    dir = opendir(parent);
+    if (dir == NULL) {
+        #ifdef _WIN32
+        stitch_log(STITCH_ERROR, "Could not open directory %s: %s", parent, stitch_win32_error_message(GetLastError()));
+        #else
+        stitch_log(STITCH_ERROR, "Could not open directory %s: %s", parent, strerror(errno));
+        #endif // _WIN32
+        stitch_return_defer(false);
+    }
+
+    errno = 0;
+    struct dirent *ent = readdir(dir);
+    while (ent != NULL) {
+        stitch_da_append(children, stitch_temp_strdup(ent->d_name));
+        ent = readdir(dir);
+    }
+
+    if (errno != 0) {
+        #ifdef _WIN32
+        stitch_log(STITCH_ERROR, "Could not read directory %s: %s", parent, stitch_win32_error_message(GetLastError()));
+        #else
+        stitch_log(STITCH_ERROR, "Could not read directory %s: %s", parent, strerror(errno));
+        #endif // _WIN32
+        stitch_return_defer(false);
+    }
+
+defer:
+    if (dir) closedir(dir);
+    return result;
+}
+
+bool stitch_write_entire_file(const char *path, const void *data, size_t size)
+{
+    bool result = true;
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        stitch_log(STITCH_ERROR, "Could not open file %s for writing: %s\n", path, strerror(errno));
+        stitch_return_defer(false);
+    }
+
+    //           len
+    //           v
+    // aaaaaaaaaa
+    //     ^
+    //     data
+
+    const char *buf = data;
+    while (size > 0) {
+        size_t n = fwrite(buf, 1, size, f);
+        if (ferror(f)) {
+            stitch_log(STITCH_ERROR, "Could not write into file %s: %s\n", path, strerror(errno));
+            stitch_return_defer(false);
+        }
+        size -= n;
+        buf  += n;
+    }
+
+defer:
+    if (f) fclose(f);
+    return result;
+}
+
+Stitch_File_Type stitch_get_file_type(const char *path)
+{
+#ifdef _WIN32
+    DWORD attr = GetFileAttributesA(path);
+    if (attr == INVALID_FILE_ATTRIBUTES) {
+        stitch_log(STITCH_ERROR, "Could not get file attributes of %s: %s", path, stitch_win32_error_message(GetLastError()));
+        return -1;
+    }
+
+    if (attr & FILE_ATTRIBUTE_DIRECTORY) return STITCH_FILE_DIRECTORY;
+    // TODO: detect symlinks on Windows (whatever that means on Windows anyway)
+    return STITCH_FILE_REGULAR;
+#else // _WIN32
+    struct stat statbuf;
+    if (stat(path, &statbuf) < 0) {
+        stitch_log(STITCH_ERROR, "Could not get stat of %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (S_ISREG(statbuf.st_mode)) return STITCH_FILE_REGULAR;
+    if (S_ISDIR(statbuf.st_mode)) return STITCH_FILE_DIRECTORY;
+    if (S_ISLNK(statbuf.st_mode)) return STITCH_FILE_SYMLINK;
+    return STITCH_FILE_OTHER;
+#endif // _WIN32
+}
+
+bool stitch_delete_file(const char *path)
+{
+    stitch_log(STITCH_INFO, "deleting %s", path);
+#ifdef _WIN32
+    if (!DeleteFileA(path)) {
+        stitch_log(STITCH_ERROR, "Could not delete file %s: %s", path, stitch_win32_error_message(GetLastError()));
+        return false;
+    }
+    return true;
+#else
+    if (remove(path) < 0) {
+        stitch_log(STITCH_ERROR, "Could not delete file %s: %s", path, strerror(errno));
+        return false;
+    }
+    return true;
+#endif // _WIN32
+}
+
+bool stitch_copy_directory_recursively(const char *src_path, const char *dst_path)
+{
+    bool result = true;
+    Stitch_File_Paths children = {0};
+    Stitch_String_Builder src_sb = {0};
+    Stitch_String_Builder dst_sb = {0};
+    size_t temp_checkpoint = stitch_temp_save();
+
+    Stitch_File_Type type = stitch_get_file_type(src_path);
+    if (type < 0) return false;
+
+    switch (type) {
+        case STITCH_FILE_DIRECTORY: {
+            if (!stitch_mkdir_if_not_exists(dst_path)) stitch_return_defer(false);
+            if (!stitch_read_entire_dir(src_path, &children)) stitch_return_defer(false);
+
+            for (size_t i = 0; i < children.count; ++i) {
+                if (strcmp(children.items[i], ".") == 0) continue;
+                if (strcmp(children.items[i], "..") == 0) continue;
+
+                src_sb.count = 0;
+                stitch_sb_append_cstr(&src_sb, src_path);
+                stitch_sb_append_cstr(&src_sb, "/");
+                stitch_sb_append_cstr(&src_sb, children.items[i]);
+                stitch_sb_append_null(&src_sb);
+
+                dst_sb.count = 0;
+                stitch_sb_append_cstr(&dst_sb, dst_path);
+                stitch_sb_append_cstr(&dst_sb, "/");
+                stitch_sb_append_cstr(&dst_sb, children.items[i]);
+                stitch_sb_append_null(&dst_sb);
 
                 if (!stitch_copy_directory_recursively(src_sb.items, dst_sb.items)) {
                     stitch_return_defer(false);
                 }
             }
-        } break;
+        } break;
+
+        case STITCH_FILE_REGULAR: {
+            if (!stitch_copy_file(src_path, dst_path)) {
+                stitch_return_defer(false);
+            }
+        } break;
+
+        case STITCH_FILE_SYMLINK: {
+            stitch_log(STITCH_WARNING, "TODO: Copying symlinks is not supported yet");
+        } break;
+
+        case STITCH_FILE_OTHER: {
+            stitch_log(STITCH_ERROR, "Unsupported type of file %s", src_path);
+            stitch_return_defer(false);
+        } break;
+
+        default: STITCH_UNREACHABLE("stitch_copy_directory_recursively");
+    }
+
+defer:
+    stitch_temp_rewind(temp_checkpoint);
+    stitch_da_free(src_sb);
+    stitch_da_free(dst_sb);
+    stitch_da_free(children);
+    return result;
+}
+
+// NOTE: enough for anything but long double and SIMD types
+#define STITCH__ARENA_ALIGNMENT 16
+
+// NOTE: the strings are not padded, so the paths are packed as tightly as they were in the old fixed temp buffer
+static void *stitch__arena_alloc_aligned(Stitch_Arena *arena, size_t size, size_t alignment)
+{
+    for (;;) {
+        Stitch_Arena_Block *block = arena->last;
+        if (block != NULL) {
+            uintptr_t begin = (uintptr_t) (block->data + block->count);
+            size_t padding = (alignment - begin%alignment)%alignment;
+            if (block->count + padding + size <= block->capacity) {
+                void *result = block->data + block->count + padding;
+                block->count += padding + size;
+                return result;
+            }
+            // The blocks that were kept by stitch_arena_reset()
+            if (block->next != NULL) {
+                arena->last = block->next;
+                arena->last->count = 0;
+                continue;
+            }
+        }
+
+        // NOTE: the new blocks always go to the end of the chain, so the offsets of the existing ones never change
+        size_t capacity = STITCH_ARENA_BLOCK_CAPACITY;
+        if (capacity < size + alignment) capacity = size + alignment;
+        Stitch_Arena_Block *new_block = STITCH_REALLOC(NULL, sizeof(Stitch_Arena_Block) + capacity);
+        STITCH_ASSERT(new_block != NULL && "Buy more RAM lol");
+        new_block->next = NULL;
+        new_block->offset = 0;
+        new_block->count = 0;
+        new_block->capacity = capacity;
+        if (block == NULL) {
+            arena->first = new_block;
+        } else {
+            new_block->offset = block->offset + block->capacity;
+            block->next = new_block;
+        }
+        arena->last = new_block;
+    }
+}
+
+void *stitch_arena_alloc(Stitch_Arena *arena, size_t size)
+{
+    return stitch__arena_alloc_aligned(arena, size, STITCH__ARENA_ALIGNMENT);
+}
+
+char *stitch_arena_strdup(Stitch_Arena *arena, const char *cstr)
+{
+    size_t n = strlen(cstr);
+    char *result = stitch__arena_alloc_aligned(arena, n + 1, 1);
+    memcpy(result, cstr, n + 1);
+    return result;
+}
+
+static char *stitch__arena_vsprintf(Stitch_Arena *arena, const char *format, va_list args)
+{
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int n = vsnprintf(NULL, 0, format, args_copy);
+    va_end(args_copy);
+
+    STITCH_ASSERT(n >= 0);
+    char *result = stitch__arena_alloc_aligned(arena, n + 1, 1);
+    vsnprintf(result, n + 1, format, args);
+    return result;
+}
+
+char *stitch_arena_sprintf(Stitch_Arena *arena, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    char *result = stitch__arena_vsprintf(arena, format, args);
+    va_end(args);
+    return result;
+}
+
+void stitch_arena_reset(Stitch_Arena *arena)
+{
+    arena->last = arena->first;
+    if (arena->last != NULL) arena->last->count = 0;
+}
+
+size_t stitch_arena_save(const Stitch_Arena *arena)
+{
+    if (arena->last == NULL) return 0;
+    return arena->last->offset + arena->last->count;
+}
+
+void stitch_arena_rewind(Stitch_Arena *arena, size_t checkpoint)
+{
+    // NOTE: usually the checkpoint is within the current block, otherwise it's found from the start of the chain
+    Stitch_Arena_Block *block = arena->last;
+    if (block == NULL) return;
+    if (checkpoint < block->offset) {
+        block = arena->first;
+        while (checkpoint > block->offset + block->count) block = block->next;
+    }
+    block->count = checkpoint - block->offset;
+    arena->last = block;
+}
+
+void *stitch_arena_realloc(Stitch_Arena *arena, void *old, size_t old_size, size_t new_size)
+{
+    Stitch_Arena_Block *block = arena->last;
+    if (old != NULL && block != NULL && (char*) old + old_size == block->data + block->count) {
+        if (new_size <= old_size) return old;
+        if (block->count + (new_size - old_size) <= block->capacity) {
+            block->count += new_size - old_size;
+            return old;
+        }
+    }
+    void *result = stitch_arena_alloc(arena, new_size);
+    if (old != NULL) memcpy(result, old, old_size < new_size ? old_size : new_size);
+    return result;
+}
+
+void stitch_arena_free(Stitch_Arena *arena)
+{
+    Stitch_Arena_Block *block = arena->first;
+    while (block != NULL) {
+        Stitch_Arena_Block *next = block->next;
+        STITCH_FREE(block);
+        block = next;
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+static bool stitch__walk_ends_with_any(const char *name, const char **suffixes, size_t suffixes_count)
+{
+    Stitch_String_View sv = stitch_sv_from_cstr(name);
+    for (size_t i = 0; i < suffixes_count; ++i) {
+        if (stitch_sv_end_with(sv, suffixes[i])) return true;
+    }
+    return false;
+}
+
+static bool stitch__walk_is_any(const char *name, const char **names, size_t names_count)
+{
+    for (size_t i = 0; i < names_count; ++i) {
+        if (strcmp(name, names[i]) == 0) return true;
+    }
+    return false;
+}
+
+#ifndef _WIN32
+// The type of the entry without stat()-ing it, unless the file system does not fill in d_type
+static Stitch_File_Type stitch__walk_entry_type(int dir_fd, const struct dirent *ent)
+{
+#ifdef DT_UNKNOWN
+    switch (ent->d_type) {
+        case DT_REG: return STITCH_FILE_REGULAR;
+        case DT_DIR: return STITCH_FILE_DIRECTORY;
+        case DT_LNK: return STITCH_FILE_SYMLINK;
+        case DT_UNKNOWN: break;
+        default: return STITCH_FILE_OTHER;
+    }
+#endif // DT_UNKNOWN
+    struct stat statbuf;
+    if (fstatat(dir_fd, ent->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+        stitch_log(STITCH_ERROR, "Could not get stat of %s: %s", ent->d_name, strerror(errno));
+        return -1;
+    }
+    if (S_ISREG(statbuf.st_mode)) return STITCH_FILE_REGULAR;
+    if (S_ISDIR(statbuf.st_mode)) return STITCH_FILE_DIRECTORY;
+    if (S_ISLNK(statbuf.st_mode)) return STITCH_FILE_SYMLINK;
+    return STITCH_FILE_OTHER;
+}
+#endif // _WIN32
+
+// path is the NULL-terminated path of the directory. On POSIX dir_fd is its open fd, which is consumed.
+static bool stitch__walk_dir(Stitch_String_Builder *path, int dir_fd, size_t level, const Stitch_Walk_Opt *opt, Stitch_Walk_Entries *entries)
+{
+    bool result = true;
+    size_t path_count = path->count;
+
+#ifdef _WIN32
+    STITCH_UNUSED(dir_fd);
+    DIR *dir = opendir(path->items);
+#else
+    DIR *dir = fdopendir(dir_fd);
+    if (dir == NULL) close(dir_fd);
+#endif // _WIN32
+    if (dir == NULL) {
+        stitch_log(STITCH_ERROR, "Could not open directory %s: %s", path->items, strerror(errno));
+        return false;
+    }
+
+    struct dirent *ent;
+    while ((errno = 0, ent = readdir(dir)) != NULL) {
+        const char *name = ent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        if (name[0] == '.' && !opt->hidden) continue;
+
+        path->count = path_count;
+        if (path->count > 0 && path->items[path->count - 1] != '/') stitch_da_append(path, '/');
+        size_t name_offset = path->count;
+        stitch_sb_append_cstr(path, name);
+        stitch_sb_append_null(path);
+        path->count -= 1;
+
+#ifdef _WIN32
+        Stitch_File_Type type = stitch_get_file_type(path->items);
+#else
+        Stitch_File_Type type = stitch__walk_entry_type(dirfd(dir), ent);
+#endif // _WIN32
+        if (type < 0) stitch_return_defer(false);
+
+        bool is_dir = type == STITCH_FILE_DIRECTORY;
+        if (is_dir && stitch__walk_is_any(name, opt->prune, opt->prune_count)) continue;
+        bool report = is_dir
+            ? opt->dirs
+            : (opt->include_count == 0 || stitch__walk_ends_with_any(name, opt->include, opt->include_count))
+              && !stitch__walk_ends_with_any(name, opt->exclude, opt->exclude_count);
+        if (!report && !is_dir) continue;
+
+        Stitch_Walk_Entry entry = {
+            .path = path->items,
+            .name = path->items + name_offset,
+            .type = type,
+            .level = level,
+        };
+        if (opt->filter && !opt->filter(&entry, opt->filter_data)) continue;
+        if (report) {
+            entry.path = stitch_arena_strdup(&entries->arena, path->items);
+            entry.name = entry.path + name_offset;
+            stitch_da_append(entries, entry);
+        }
+
+        if (is_dir && (opt->max_depth == 0 || level + 1 < opt->max_depth)) {
+#ifdef _WIN32
+            int child_fd = -1;
+#else
+            int child_fd = openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child_fd < 0) {
+                stitch_log(STITCH_ERROR, "Could not open directory %s: %s", path->items, strerror(errno));
+                stitch_return_defer(false);
+            }
+#endif // _WIN32
+            if (!stitch__walk_dir(path, child_fd, level + 1, opt, entries)) stitch_return_defer(false);
+        }
+    }
+    if (errno != 0) {
+        path->count = path_count;
+        stitch_log(STITCH_ERROR, "Could not read directory %.*s: %s", (int) path->count, path->items, strerror(errno));
+        stitch_return_defer(false);
+    }
+
+defer:
+    closedir(dir);
+    path->count = path_count;
+    path->items[path->count] = '\0';
+    return result;
+}
+
+bool stitch_walk_dir(const char *root, Stitch_Walk_Opt opt, Stitch_Walk_Entries *entries)
+{
+    Stitch_String_Builder path = {0};
+    stitch_sb_append_cstr(&path, root);
+    stitch_sb_append_null(&path);
+    path.count -= 1;
+
+#ifdef _WIN32
+    int root_fd = -1;
+#else
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        stitch_log(STITCH_ERROR, "Could not open directory %s: %s", root, strerror(errno));
+        stitch_sb_free(path);
+        return false;
+    }
+#endif // _WIN32
+    bool result = stitch__walk_dir(&path, root_fd, 0, &opt, entries);
+    stitch_sb_free(path);
+    return result;
+}
+
+void stitch_walk_entries_free(Stitch_Walk_Entries *entries)
+{
+    stitch_arena_free(&entries->arena);
+    stitch_da_free(*entries);
+    memset(entries, 0, sizeof(*entries));
+}
+
+typedef struct {
+    Stitch_String_View *items;
+    size_t count;
+    size_t capacity;
+} Stitch__Glob_Segments;
+
+static void stitch__glob_split(const char *path, Stitch__Glob_Segments *segments)
+{
+    segments->count = 0;
+    Stitch_String_View sv = stitch_sv_from_cstr(path);
+    while (sv.count > 0) {
+        Stitch_String_View segment = stitch_sv_chop_by_delim(&sv, '/');
+        // NOTE: "a//b" and "./a" are the same as "a/b" and "a"
+        if (segment.count == 0 || stitch_sv_eq(segment, stitch_sv_from_cstr("."))) continue;
+        stitch_da_append(segments, segment);
+    }
+}
+
+// Expands the braces of the pattern into the alternatives allocated in the temp
+static void stitch__glob_expand_braces(const char *pattern, Stitch_File_Paths *alternatives)
+{
+    // Find the first top-level {...} that has a matching closing brace
+    size_t open = 0, close = 0;
+    bool found = false;
+    for (size_t i = 0; pattern[i] != '\0' && !found; ++i) {
+        if (pattern[i] != '{') continue;
+        size_t depth = 0;
+        for (size_t j = i; pattern[j] != '\0'; ++j) {
+            if (pattern[j] == '{') depth += 1;
+            if (pattern[j] == '}' && --depth == 0) {
+                open = i;
+                close = j;
+                found = true;
+                break;
+            }
+        }
+    }
+    if (!found) {
+        stitch_da_append(alternatives, pattern);
+        return;
+    }
+
+    size_t depth = 0, begin = open + 1;
+    for (size_t i = open + 1; i <= close; ++i) {
+        if (pattern[i] == '{') depth += 1;
+        if (pattern[i] == '}' && depth > 0) {
+            depth -= 1;
+            continue;
+        }
+        if ((pattern[i] == ',' && depth == 0) || i == close) {
+            const char *alternative = stitch_temp_sprintf("%.*s%.*s%s", (int) open, pattern,
+                                                          (int) (i - begin), pattern + begin, pattern + close + 1);
+            stitch__glob_expand_braces(alternative, alternatives);
+            begin = i + 1;
+        }
+    }
+}
+
+static bool stitch__glob_match_segment(Stitch_String_View pattern, Stitch_String_View name)
+{
+    // NOTE: the wildcards don't match the hidden files
+    if (name.count > 0 && name.data[0] == '.' && (pattern.count == 0 || pattern.data[0] != '.')) return false;
+
+    size_t p = 0, n = 0;
+    size_t star_p = SIZE_MAX, star_n = 0;
+    while (n < name.count) {
+        if (p < pattern.count && pattern.data[p] == '*') {
+            // Remember where to backtrack to if the rest does not match
+            star_p = ++p;
+            star_n = n;
+            continue;
+        }
+        if (p < pattern.count && pattern.data[p] == '[') {
+            size_t i = p + 1;
+            bool negate = i < pattern.count && (pattern.data[i] == '!' || pattern.data[i] == '^');
+            if (negate) i += 1;
+            bool matched = false;
+            size_t first = i;
+            while (i < pattern.count && (pattern.data[i] != ']' || i == first)) {
+                char lo = pattern.data[i], hi = lo;
+                if (i + 2 < pattern.count && pattern.data[i + 1] == '-' && pattern.data[i + 2] != ']') {
+                    hi = pattern.data[i + 2];
+                    i += 2;
+                }
+                if (lo <= name.data[n] && name.data[n] <= hi) matched = true;
+                i += 1;
+            }
+            // An unterminated [ is just a character
+            if (i < pattern.count) {
+                if (matched != negate) {
+                    p = i + 1;
+                    n += 1;
+                    continue;
+                }
+                goto backtrack;
+            }
+        }
+        if (p < pattern.count && (pattern.data[p] == '?' || pattern.data[p] == name.data[n])) {
+            p += 1;
+            n += 1;
+            continue;
+        }
+    backtrack:
+        if (star_p == SIZE_MAX) return false;
+        p = star_p;
+        n = ++star_n;
+    }
+    while (p < pattern.count && pattern.data[p] == '*') p += 1;
+    return p == pattern.count;
+}
+
+// With partial the path only needs to be a prefix of some matching path. That's what tells whether a directory
+// is worth entering.
+static bool stitch__glob_match_segments(const Stitch_String_View *pattern, size_t pattern_count,
+                                        const Stitch_String_View *path, size_t path_count, bool partial)
+{
+    while (pattern_count > 0) {
+        if (stitch_sv_eq(pattern[0], stitch_sv_from_cstr("**"))) {
+            if (partial && path_count == 0) return true;
+            if (stitch__glob_match_segments(pattern + 1, pattern_count - 1, path, path_count, partial)) return true;
+            if (path_count == 0 || path[0].data[0] == '.') return false;
+            path += 1;
+            path_count -= 1;
+            continue;
+        }
+        if (path_count == 0) return partial;
+        if (!stitch__glob_match_segment(pattern[0], path[0])) return false;
+        pattern += 1;
+        pattern_count -= 1;
+        path += 1;
+        path_count -= 1;
+    }
+    return path_count == 0;
+}
+
+bool stitch_glob_match(const char *pattern, const char *path)
+{
+    Stitch_File_Paths alternatives = {0};
+    Stitch__Glob_Segments pattern_segments = {0};
+    Stitch__Glob_Segments path_segments = {0};
+    size_t temp_checkpoint = stitch_temp_save();
+
+    stitch__glob_split(path, &path_segments);
+    stitch__glob_expand_braces(pattern, &alternatives);
+    bool result = false;
+    for (size_t i = 0; i < alternatives.count && !result; ++i) {
+        stitch__glob_split(alternatives.items[i], &pattern_segments);
+        result = stitch__glob_match_segments(pattern_segments.items, pattern_segments.count,
+                                             path_segments.items, path_segments.count, false);
+    }
+
+    stitch_temp_rewind(temp_checkpoint);
+    stitch_da_free(alternatives);
+    stitch_da_free(pattern_segments);
+    stitch_da_free(path_segments);
+    return result;
+}
+
+typedef struct {
+    const Stitch__Glob_Segments *pattern;  // The segments after the literal prefix
+    size_t prefix_len;                     // How much of the walked paths is the literal prefix
+    Stitch__Glob_Segments path;
+} Stitch__Glob_Walk;
+
+static bool stitch__glob_walk_filter(const Stitch_Walk_Entry *entry, void *data)
+{
+    Stitch__Glob_Walk *walk = data;
+    stitch__glob_split(entry->path + walk->prefix_len, &walk->path);
+    return stitch__glob_match_segments(walk->pattern->items, walk->pattern->count,
+                                       walk->path.items, walk->path.count,
+                                       entry->type == STITCH_FILE_DIRECTORY);
+}
+
+static int stitch__glob_compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(const char *const*) a, *(const char *const*) b);
+}
+
+bool stitch_glob(const char *pattern, Stitch_Glob_Paths *paths)
+{
+    bool result = true;
+    Stitch_File_Paths alternatives = {0};
+    Stitch__Glob_Segments segments = {0};
+    Stitch__Glob_Segments rest = {0};
+    Stitch_Walk_Entries entries = {0};
+    Stitch_String_Builder prefix = {0};
+    Stitch__Glob_Walk walk = {0};
+    size_t temp_checkpoint = stitch_temp_save();
+
+    stitch__glob_expand_braces(pattern, &alternatives);
+    for (size_t i = 0; i < alternatives.count; ++i) {
+        const char *alternative = alternatives.items[i];
+        stitch__glob_split(alternative, &segments);
+
+        // The literal segments are looked up directly instead of being matched against every entry
+        prefix.count = 0;
+        if (alternative[0] == '/') stitch_da_append(&prefix, '/');
+        size_t literal_count = 0;
+        while (literal_count < segments.count && strcspn(stitch_temp_sv_to_cstr(segments.items[literal_count]), "*?[") == segments.items[literal_count].count) {
+            if (prefix.count > 0 && prefix.items[prefix.count - 1] != '/') stitch_da_append(&prefix, '/');
+            stitch_sb_append_buf(&prefix, segments.items[literal_count].data, segments.items[literal_count].count);
+            literal_count += 1;
+        }
+        bool relative = prefix.count == 0;
+        if (relative) stitch_da_append(&prefix, '.');
+        stitch_sb_append_null(&prefix);
+
+        int exists = stitch_file_exists(prefix.items);
+        if (exists < 0) stitch_return_defer(false);
+        if (exists == 0) continue;
+        if (literal_count == segments.count) {
+            if (!relative) stitch_da_append(paths, stitch_arena_strdup(&paths->arena, prefix.items));
+            continue;
+        }
+
+        rest.count = 0;
+        stitch_da_append_many(&rest, segments.items + literal_count, segments.count - literal_count);
+        walk.pattern = &rest;
+        walk.prefix_len = prefix.count - 1;
+        Stitch_Walk_Opt opt = {
+            .dirs = true,
+            .hidden = true,
+            .filter = stitch__glob_walk_filter,
+            .filter_data = &walk,
+        };
+        // Without ** the depth of the matches is known upfront
+        bool recursive = false;
+        for (size_t j = 0; j < rest.count; ++j) recursive = recursive || stitch_sv_eq(rest.items[j], stitch_sv_from_cstr("**"));
+        if (!recursive) opt.max_depth = rest.count;
+
+        entries.count = 0;
+        if (!stitch_walk_dir(prefix.items, opt, &entries)) stitch_return_defer(false);
+        for (size_t j = 0; j < entries.count; ++j) {
+            const char *path = entries.items[j].path;
+            // The directories were only let through to be entered
+            if (entries.items[j].type == STITCH_FILE_DIRECTORY) {
+                stitch__glob_split(path + walk.prefix_len, &walk.path);
+                if (!stitch__glob_match_segments(rest.items, rest.count, walk.path.items, walk.path.count, false)) continue;
+            }
+            if (relative) path += 2; // "./"
+            stitch_da_append(paths, stitch_arena_strdup(&paths->arena, path));
+        }
+    }
+
+    qsort(paths->items, paths->count, sizeof(*paths->items), stitch__glob_compare_paths);
+    size_t unique = 0;
+    for (size_t i = 0; i < paths->count; ++i) {
+        if (unique > 0 && strcmp(paths->items[unique - 1], paths->items[i]) == 0) continue;
+        paths->items[unique++] = paths->items[i];
+    }
+    paths->count = unique;
+
+defer:
+    stitch_temp_rewind(temp_checkpoint);
+    stitch_da_free(alternatives);
+    stitch_da_free(segments);
+    stitch_da_free(rest);
+    stitch_da_free(walk.path);
+    stitch_sb_free(prefix);
+    stitch_walk_entries_free(&entries);
+    return result;
+}
+
+void stitch_glob_paths_free(Stitch_Glob_Paths *paths)
+{
+    stitch_arena_free(&paths->arena);
+    stitch_da_free(*paths);
+    memset(paths, 0, sizeof(*paths));
+}
+
+char *stitch_temp_strdup(const char *cstr)
+{
+    return stitch_arena_strdup(&stitch__temp, cstr);
+}
+
+void *stitch_temp_alloc(size_t size)
+{
+    return stitch_arena_alloc(&stitch__temp, size);
+}
+
+char *stitch_temp_sprintf(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    char *result = stitch__arena_vsprintf(&stitch__temp, format, args);
+    va_end(args);
+    return result;
+}
+
+void stitch_temp_reset(void)
+{
+    stitch_arena_reset(&stitch__temp);
+}
+
+size_t stitch_temp_save(void)
+{
+    return stitch_arena_save(&stitch__temp);
+}
+
+void stitch_temp_rewind(size_t checkpoint)
+{
+    stitch_arena_rewind(&stitch__temp, checkpoint);
+}
+
+void stitch_temp_free(void)
+{
+    stitch_arena_free(&stitch__temp);
+}
+
+const char *stitch_temp_sv_to_cstr(Stitch_String_View sv)
+{
+    char *result = stitch__arena_alloc_aligned(&stitch__temp, sv.count + 1, 1);
+    memcpy(result, sv.data, sv.count);
+    result[sv.count] = '\0';
+    return result;
+}
+
+static char *stitch__strdup(const char *cstr)
+{
+    size_t n = strlen(cstr);
+    char *result = STITCH_REALLOC(NULL, n + 1);
+    STITCH_ASSERT(result != NULL && "Buy more RAM lol");
+    memcpy(result, cstr, n + 1);
+    return result;
+}
+
+// Helpers for the binary caches. NOTE: the caches are local files that are never moved between
+// machines, so all the numbers are stored in the native byte order.
+static void stitch__sb_append_u64(Stitch_String_Builder *sb, uint64_t x)
+{
+    stitch_sb_append_buf(sb, (const char*) &x, sizeof(x));
+}
+
+static void stitch__sb_append_sized_cstr(Stitch_String_Builder *sb, const char *cstr)
+{
+    size_t n = strlen(cstr);
+    stitch__sb_append_u64(sb, n);
+    stitch_sb_append_buf(sb, cstr, n);
+}
+
+static bool stitch__sv_chop_u64(Stitch_String_View *sv, uint64_t *x)
+{
+    if (sv->count < sizeof(*x)) return false;
+    memcpy(x, sv->data, sizeof(*x));
+    stitch_sv_chop_left(sv, sizeof(*x));
+    return true;
+}
+
+static bool stitch__sv_chop_sized(Stitch_String_View *sv, Stitch_String_View *result)
+{
+    uint64_t n;
+    if (!stitch__sv_chop_u64(sv, &n)) return false;
+    if (sv->count < n) return false;
+    *result = stitch_sv_chop_left(sv, n);
+    return true;
+}
+
+typedef struct {
+    long long mtime;           // Nanoseconds since the Unix epoch
+    long long size;
+    unsigned long long inode;  // Always 0 on Windows
+} Stitch__File_Stat;
+
+#if defined(__APPLE__)
+#    define STITCH__ST_MTIM st_mtimespec
+#else
+#    define STITCH__ST_MTIM st_mtim
+#endif // __APPLE__
+
+// RETURNS:
+//  1 - the file exists
+//  0 - the file does not exist
+// -1 - error. The error is logged
+static int stitch__file_stat_uncached(const char *path, Stitch__File_Stat *st)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) {
+        DWORD err = GetLastError();
+        if (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND) return 0;
+        stitch_log(STITCH_ERROR, "Could not get attributes of %s: %s", path, stitch_win32_error_message(err));
+        return -1;
+    }
+    // FILETIME is the amount of 100-nanosecond intervals since January 1, 1601
+    long long ticks = ((long long) data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    st->mtime = (ticks - 116444736000000000LL)*100;
+    st->size  = ((long long) data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    st->inode = 0;
+    return 1;
+#else
+    struct stat statbuf;
+    if (stat(path, &statbuf) < 0) {
+        if (errno == ENOENT || errno == ENOTDIR) return 0;
+        stitch_log(STITCH_ERROR, "could not stat %s: %s", path, strerror(errno));
+        return -1;
+    }
+    st->mtime = (long long) statbuf.STITCH__ST_MTIM.tv_sec*1000000000LL + statbuf.STITCH__ST_MTIM.tv_nsec;
+    st->size  = statbuf.st_size;
+    st->inode = statbuf.st_ino;
+    return 1;
+#endif // _WIN32
+}
+
+static bool stitch__set_file_mtime(const char *path, long long mtime)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        stitch_log(STITCH_ERROR, "Could not open %s: %s", path, stitch_win32_error_message(GetLastError()));
+        return false;
+    }
+    long long ticks = mtime/100 + 116444736000000000LL;
+    FILETIME time = {.dwLowDateTime = (DWORD) ticks, .dwHighDateTime = (DWORD) (ticks >> 32)};
+    BOOL ok = SetFileTime(file, NULL, NULL, &time);
+    if (!ok) stitch_log(STITCH_ERROR, "Could not set the mtime of %s: %s", path, stitch_win32_error_message(GetLastError()));
+    CloseHandle(file);
+    return ok;
+#else
+    struct timespec times[2] = {
+        {.tv_sec = 0, .tv_nsec = UTIME_OMIT},
+        {.tv_sec = mtime/1000000000LL, .tv_nsec = mtime%1000000000LL},
+    };
+    if (utimensat(AT_FDCWD, path, times, 0) < 0) {
+        stitch_log(STITCH_ERROR, "Could not set the mtime of %s: %s", path, strerror(errno));
+        return false;
+    }
+    return true;
+#endif // _WIN32
+}
+
+// Like stitch_get_file_type() but does not follow the symlink at path
+static Stitch_File_Type stitch__get_file_type_nofollow(const char *path)
+{
+#ifdef _WIN32
+    return stitch_get_file_type(path);
+#else
+    struct stat statbuf;
+    if (lstat(path, &statbuf) < 0) {
+        stitch_log(STITCH_ERROR, "Could not get stat of %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (S_ISREG(statbuf.st_mode)) return STITCH_FILE_REGULAR;
+    if (S_ISDIR(statbuf.st_mode)) return STITCH_FILE_DIRECTORY;
+    if (S_ISLNK(statbuf.st_mode)) return STITCH_FILE_SYMLINK;
+    return STITCH_FILE_OTHER;
+#endif // _WIN32
+}
+
+static bool stitch__is_symlink(const char *path)
+{
+#ifdef _WIN32
+    STITCH_UNUSED(path);
+    return false;
+#else
+    struct stat statbuf;
+    return lstat(path, &statbuf) == 0 && S_ISLNK(statbuf.st_mode);
+#endif // _WIN32
+}
+
+// Recreates the symlink src_path at dst_path with the same target, unless dst_path already is that symlink
+static bool stitch__copy_symlink(const char *src_path, const char *dst_path)
+{
+#ifdef _WIN32
+    STITCH_UNUSED(dst_path);
+    stitch_log(STITCH_WARNING, "TODO: Copying symlinks is not supported on Windows yet: %s", src_path);
+    return true;
+#else
+    char target[PATH_MAX], existing[PATH_MAX];
+    ssize_t n = readlink(src_path, target, sizeof(target) - 1);
+    if (n < 0) {
+        stitch_log(STITCH_ERROR, "Could not read symlink %s: %s", src_path, strerror(errno));
+        return false;
+    }
+    target[n] = '\0';
+    ssize_t m = readlink(dst_path, existing, sizeof(existing) - 1);
+    if (m == n && memcmp(target, existing, n) == 0) return true;
+    unlink(dst_path);
+    if (symlink(target, dst_path) < 0) {
+        stitch_log(STITCH_ERROR, "Could not create symlink %s -> %s: %s", dst_path, target, strerror(errno));
+        return false;
+    }
+    return true;
+#endif // _WIN32
+}
+
+typedef struct {
+    char *src_path;
+    char *dst_path;
+    long long mtime;
+} Stitch__Sync_Copy;
+
+typedef struct {
+    Stitch__Sync_Copy *items;
+    size_t count;
+    size_t capacity;
+} Stitch__Sync_Copies;
+
+// Creates the directories and the symlinks right away and collects the files that need copying
+static bool stitch__sync_walk(const char *src_path, const char *dst_path, const Stitch_Sync_Opt *opt,
+                              Stitch__Sync_Copies *copies, size_t *up_to_date)
+{
+    bool result = true;
+    Stitch_File_Paths children = {0};
+
+    Stitch_File_Type type = stitch__get_file_type_nofollow(src_path);
+    if (type < 0) return false;
+
+    switch (type) {
+        case STITCH_FILE_DIRECTORY: {
+            if (!stitch__mkdir_silent(dst_path)) stitch_return_defer(false);
+            if (!stitch_read_entire_dir(src_path, &children)) stitch_return_defer(false);
+            for (size_t i = 0; i < children.count; ++i) {
+                if (strcmp(children.items[i], ".") == 0) continue;
+                if (strcmp(children.items[i], "..") == 0) continue;
+                size_t temp_checkpoint = stitch_temp_save();
+                const char *src_child = stitch_temp_sprintf("%s/%s", src_path, children.items[i]);
+                const char *dst_child = stitch_temp_sprintf("%s/%s", dst_path, children.items[i]);
+                bool ok = stitch__sync_walk(src_child, dst_child, opt, copies, up_to_date);
+                stitch_temp_rewind(temp_checkpoint);
+                if (!ok) stitch_return_defer(false);
+            }
+        } break;
+
+        case STITCH_FILE_REGULAR: {
+            Stitch__File_Stat src_stat, dst_stat;
+            if (stitch__file_stat_uncached(src_path, &src_stat) <= 0) stitch_return_defer(false);
+            int dst_exists = stitch__file_stat_uncached(dst_path, &dst_stat);
+            if (dst_exists < 0) stitch_return_defer(false);
+            // A symlink at the destination is replaced rather than compared through
+            if (dst_exists && !stitch__is_symlink(dst_path) && dst_stat.size == src_stat.size) {
+                bool same = dst_stat.mtime == src_stat.mtime;
+                if (!same && opt->compare_contents) {
+                    uint64_t src_hash, dst_hash;
+                    if (stitch_file_hash(src_path, &src_hash) <= 0) stitch_return_defer(false);
+                    if (stitch_file_hash(dst_path, &dst_hash) <= 0) stitch_return_defer(false);
+                    same = src_hash == dst_hash;
+                    // So the next sync does not need to hash it again
+                    if (same && !stitch__set_file_mtime(dst_path, src_stat.mtime)) stitch_return_defer(false);
+                }
+                if (same) {
+                    *up_to_date += 1;
+                    stitch_return_defer(true);
+                }
+            }
+            Stitch__Sync_Copy copy = {
+                .src_path = stitch__strdup(src_path),
+                .dst_path = stitch__strdup(dst_path),
+                .mtime = src_stat.mtime,
+            };
+            stitch_da_append(copies, copy);
+        } break;
+
+        case STITCH_FILE_SYMLINK: {
+            if (!stitch__copy_symlink(src_path, dst_path)) stitch_return_defer(false);
+        } break;
+
+        case STITCH_FILE_OTHER: {
+            stitch_log(STITCH_ERROR, "Unsupported type of file %s", src_path);
+            stitch_return_defer(false);
+        } break;
+
+        default: STITCH_UNREACHABLE("stitch__sync_walk");
+    }
+
+defer:
+    stitch_da_free(children);
+    return result;
+}
+
+static bool stitch__sync_copy(const Stitch__Sync_Copy *copy)
+{
+#ifndef _WIN32
+    // Copying through a symlink would write outside of the destination tree
+    if (stitch__is_symlink(copy->dst_path) && unlink(copy->dst_path) < 0) {
+        stitch_log(STITCH_ERROR, "Could not remove symlink %s: %s", copy->dst_path, strerror(errno));
+        return false;
+    }
+#endif // _WIN32
+    // The mtime of the source marks the copy as up to date for the next sync
+    return stitch__copy_file(copy->src_path, copy->dst_path) && stitch__set_file_mtime(copy->dst_path, copy->mtime);
+}
+
+#if !defined(_WIN32) && defined(STITCH_USE_THREADS)
+typedef struct {
+    const Stitch__Sync_Copies *copies;
+    size_t next;
+    bool failed;
+    pthread_mutex_t mutex;
+} Stitch__Sync_Queue;
+
+static void *stitch__sync_worker(void *arg)
+{
+    Stitch__Sync_Queue *queue = arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->mutex);
+        size_t i = queue->failed ? queue->copies->count : queue->next++;
+        pthread_mutex_unlock(&queue->mutex);
+        if (i >= queue->copies->count) return NULL;
+
+        if (!stitch__sync_copy(&queue->copies->items[i])) {
+            pthread_mutex_lock(&queue->mutex);
+            queue->failed = true;
+            pthread_mutex_unlock(&queue->mutex);
+        }
+    }
+}
+
+static void *stitch__sync_thread(void *arg)
+{
+    stitch__sync_worker(arg);
+    stitch_temp_free();
+    return NULL;
+}
+#endif // STITCH_USE_THREADS
+
+bool stitch_sync_directory(const char *src_path, const char *dst_path, Stitch_Sync_Opt opt)
+{
+    bool result = true;
+    Stitch__Sync_Copies copies = {0};
+    size_t up_to_date = 0;
+
+    if (!stitch__sync_walk(src_path, dst_path, &opt, &copies, &up_to_date)) stitch_return_defer(false);
+
+    size_t threads = opt.threads == 0 ? stitch_nprocs() : opt.threads;
+    if (threads > copies.count) threads = copies.count;
+#if defined(_WIN32) || !defined(STITCH_USE_THREADS)
+    threads = 1;
+#endif // STITCH_USE_THREADS
+
+    if (threads <= 1) {
+        for (size_t i = 0; i < copies.count; ++i) {
+            if (!stitch__sync_copy(&copies.items[i])) stitch_return_defer(false);
+        }
+    } else {
+#if !defined(_WIN32) && defined(STITCH_USE_THREADS)
+        Stitch__Sync_Queue queue = {.copies = &copies};
+        pthread_mutex_init(&queue.mutex, NULL);
+        pthread_t *workers = STITCH_REALLOC(NULL, threads*sizeof(*workers));
+        STITCH_ASSERT(workers != NULL && "Buy more RAM lol");
+        size_t started = 0;
+        for (; started < threads; ++started) {
+            int err = pthread_create(&workers[started], NULL, stitch__sync_thread, &queue);
+            if (err != 0) {
+                // The workers that did start copy everything anyway
+                if (started == 0) stitch__sync_worker(&queue);
+                break;
+            }
+        }
+        for (size_t i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+        STITCH_FREE(workers);
+        pthread_mutex_destroy(&queue.mutex);
+        if (queue.failed) stitch_return_defer(false);
+#endif // STITCH_USE_THREADS
+    }
+
+    stitch_log(STITCH_INFO, "synced %s -> %s: copied %zu files, %zu were up to date", src_path, dst_path, copies.count, up_to_date);
+
+defer:
+    for (size_t i = 0; i < copies.count; ++i) {
+        STITCH_FREE(copies.items[i].src_path);
+        STITCH_FREE(copies.items[i].dst_path);
+    }
+    stitch_da_free(copies);
+    return result;
+}
+
+typedef struct {
+    char *path;
+    int exists;
+    bool valid;
+    Stitch__File_Stat stat;
+} Stitch__Stat_Cache_Entry;
+
+typedef struct {
+    Stitch__Stat_Cache_Entry *items;
+    size_t count;
+    size_t capacity;
+    Stitch__Index index;  // path -> index of the entry
+    size_t invalidations; // How many times anything was invalidated
+} Stitch__Stat_Cache;
+
+static Stitch__Stat_Cache stitch__stat_cache = {0};
+static Stitch__Mutex stitch__stat_cache_mutex = STITCH__MUTEX_INIT;
+bool stitch_stat_cache_enabled = false;
+
+static int stitch__file_stat(const char *path, Stitch__File_Stat *st)
+{
+    if (!stitch_stat_cache_enabled) return stitch__file_stat_uncached(path, st);
+
+    Stitch__Stat_Cache *cache = &stitch__stat_cache;
+    size_t index;
+    stitch__mutex_lock(&stitch__stat_cache_mutex);
+    if (stitch__index_get(&cache->index, path, &index) && cache->items[index].valid) {
+        *st = cache->items[index].stat;
+        int exists = cache->items[index].exists;
+        stitch__mutex_unlock(&stitch__stat_cache_mutex);
+        return exists;
+    }
+    size_t invalidations = cache->invalidations;
+    stitch__mutex_unlock(&stitch__stat_cache_mutex);
+
+    int exists = stitch__file_stat_uncached(path, st);
+    // NOTE: errors are not cached, so they are reported every time
+    if (exists < 0) return exists;
+
+    stitch__mutex_lock(&stitch__stat_cache_mutex);
+    if (!stitch__index_get(&cache->index, path, &index)) {
+        char *key = stitch__strdup(path);
+        stitch_da_append(cache, ((Stitch__Stat_Cache_Entry) {.path = key}));
+        index = cache->count - 1;
+        stitch__index_put(&cache->index, key, index);
+    }
+    Stitch__Stat_Cache_Entry *entry = &cache->items[index];
+    entry->exists = exists;
+    entry->stat = *st;
+    // NOTE: the file might have been modified and invalidated by another thread while we were stat()-ing it
+    entry->valid = invalidations == cache->invalidations;
+    stitch__mutex_unlock(&stitch__stat_cache_mutex);
+    return exists;
+}
+
+void stitch_stat_cache_invalidate(const char *path)
+{
+    size_t index;
+    stitch__mutex_lock(&stitch__stat_cache_mutex);
+    if (stitch__index_get(&stitch__stat_cache.index, path, &index)) {
+        stitch__stat_cache.items[index].valid = false;
+    }
+    stitch__stat_cache.invalidations += 1;
+    stitch__mutex_unlock(&stitch__stat_cache_mutex);
+}
+
+void stitch_stat_cache_reset(void)
+{
+    Stitch__Stat_Cache *cache = &stitch__stat_cache;
+    stitch__mutex_lock(&stitch__stat_cache_mutex);
+    for (size_t i = 0; i < cache->count; ++i) STITCH_FREE(cache->items[i].path);
+    stitch_da_free(*cache);
+    stitch__index_free(&cache->index);
+    size_t invalidations = cache->invalidations;
+    memset(cache, 0, sizeof(*cache));
+    cache->invalidations = invalidations + 1;
+    stitch__mutex_unlock(&stitch__stat_cache_mutex);
+}
+
+static int stitch__needs_rebuild_mtime(const char *output_path, const char **input_paths, size_t input_paths_count)
+{
+    Stitch__File_Stat output_stat, input_stat;
+    int exists = stitch__file_stat(output_path, &output_stat);
+    if (exists < 0) return -1;
+    // NOTE: if output does not exist it 100% must be rebuilt
+    if (exists == 0) return 1;
+
+    for (size_t i = 0; i < input_paths_count; ++i) {
+        const char *input_path = input_paths[i];
+        exists = stitch__file_stat(input_path, &input_stat);
+        if (exists < 0) return -1;
+        if (exists == 0) {
+            // NOTE: non-existing input is an error cause it is needed for building in the first place
+            stitch_log(STITCH_ERROR, "input file %s does not exist", input_path);
+            return -1;
+        }
+        // NOTE: if even a single input_path is fresher than output_path that's 100% rebuild
+        if (input_stat.mtime > output_stat.mtime) return 1;
+    }
+
+    return 0;
+}
+
+// XXH64 by Yann Collet https://github.com/Cyan4973/xxHash
+// The main loop consumes 32 bytes per iteration in 4 independent lanes, so it keeps the
+// pipelines of the modern CPUs busy without any intrinsics.
+#define STITCH__XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define STITCH__XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define STITCH__XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define STITCH__XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define STITCH__XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define STITCH__ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t stitch__xxh_read64(const unsigned char *p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static uint32_t stitch__xxh_read32(const unsigned char *p)
+{
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static uint64_t stitch__xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input*STITCH__XXH_PRIME64_2;
+    acc  = STITCH__ROTL64(acc, 31);
+    return acc*STITCH__XXH_PRIME64_1;
+}
+
+static uint64_t stitch__xxh_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= stitch__xxh_round(0, val);
+    return acc*STITCH__XXH_PRIME64_1 + STITCH__XXH_PRIME64_4;
+}
+
+uint64_t stitch_hash(const void *data, size_t size, uint64_t seed)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        uint64_t v1 = seed + STITCH__XXH_PRIME64_1 + STITCH__XXH_PRIME64_2;
+        uint64_t v2 = seed + STITCH__XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - STITCH__XXH_PRIME64_1;
+        const unsigned char *limit = end - 32;
+        do {
+            v1 = stitch__xxh_round(v1, stitch__xxh_read64(p));      p += 8;
+            v2 = stitch__xxh_round(v2, stitch__xxh_read64(p));      p += 8;
+            v3 = stitch__xxh_round(v3, stitch__xxh_read64(p));      p += 8;
+            v4 = stitch__xxh_round(v4, stitch__xxh_read64(p));      p += 8;
+        } while (p <= limit);
+        h = STITCH__ROTL64(v1, 1) + STITCH__ROTL64(v2, 7) + STITCH__ROTL64(v3, 12) + STITCH__ROTL64(v4, 18);
+        h = stitch__xxh_merge_round(h, v1);
+        h = stitch__xxh_merge_round(h, v2);
+        h = stitch__xxh_merge_round(h, v3);
+        h = stitch__xxh_merge_round(h, v4);
+    } else {
+        h = seed + STITCH__XXH_PRIME64_5;
+    }
+
+    h += (uint64_t) size;
+
+    while (p + 8 <= end) {
+        h ^= stitch__xxh_round(0, stitch__xxh_read64(p));
+        h  = STITCH__ROTL64(h, 27)*STITCH__XXH_PRIME64_1 + STITCH__XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) stitch__xxh_read32(p)*STITCH__XXH_PRIME64_1;
+        h  = STITCH__ROTL64(h, 23)*STITCH__XXH_PRIME64_2 + STITCH__XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p)*STITCH__XXH_PRIME64_5;
+        h  = STITCH__ROTL64(h, 11)*STITCH__XXH_PRIME64_1;
+        p += 1;
+    }
+
+    h ^= h >> 33;
+    h *= STITCH__XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= STITCH__XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+Stitch_Rebuild_Mode stitch_rebuild_mode = STITCH_REBUILD_MTIME;
+
+typedef struct {
+    char *path;
+    Stitch__File_Stat stat;  // The stat of the file at the moment it was hashed
+    uint64_t hash;
+} Stitch__Hash_Cache_Entry;
+
+typedef struct {
+    Stitch__Hash_Cache_Entry *items;
+    size_t count;
+    size_t capacity;
+    Stitch__Index index;  // path -> index of the entry
+    bool dirty;           // Whether there is anything new to save
+} Stitch__Hash_Cache;
+
+static Stitch__Hash_Cache stitch__hash_cache = {0};
+static Stitch__Mutex stitch__hash_cache_mutex = STITCH__MUTEX_INIT;
+
+#define STITCH__HASH_CACHE_MAGIC "STITCHH1"
+
+static Stitch__Hash_Cache_Entry *stitch__hash_cache_entry(const char *path)
+{
+    Stitch__Hash_Cache *cache = &stitch__hash_cache;
+    size_t index;
+    if (stitch__index_get(&cache->index, path, &index)) return &cache->items[index];
+
+    char *key = stitch__strdup(path);
+    stitch_da_append(cache, ((Stitch__Hash_Cache_Entry) {.path = key, .stat = {.mtime = -1}}));
+    stitch__index_put(&cache->index, key, cache->count - 1);
+    return &stitch_da_last(cache);
+}
+
+static void stitch__hash_cache_reset(void)
+{
+    Stitch__Hash_Cache *cache = &stitch__hash_cache;
+    for (size_t i = 0; i < cache->count; ++i) STITCH_FREE(cache->items[i].path);
+    stitch_da_free(*cache);
+    stitch__index_free(&cache->index);
+    memset(cache, 0, sizeof(*cache));
+}
+
+int stitch_file_hash(const char *path, uint64_t *hash)
+{
+    Stitch__File_Stat st;
+    int exists = stitch__file_stat(path, &st);
+    if (exists <= 0) return exists;
+
+    stitch__mutex_lock(&stitch__hash_cache_mutex);
+    Stitch__Hash_Cache_Entry *entry = stitch__hash_cache_entry(path);
+    bool fresh = entry->stat.mtime == st.mtime && entry->stat.size == st.size && entry->stat.inode == st.inode;
+    *hash = entry->hash;
+    stitch__mutex_unlock(&stitch__hash_cache_mutex);
+    if (fresh) return 1;
+
+    // NOTE: the file is hashed without holding the lock, so the other threads can hash theirs at the same time.
+    // It is read rather than mapped: a source truncated by an editor while mapped would kill us with SIGBUS
+    Stitch_String_Builder content = {0};
+    if (!stitch_read_entire_file(path, &content)) {
+        stitch_sb_free(content);
+        return -1;
+    }
+    *hash = stitch_hash(content.items, content.count, 0);
+    stitch_sb_free(content);
+
+    stitch__mutex_lock(&stitch__hash_cache_mutex);
+    entry = stitch__hash_cache_entry(path);
+    entry->hash = *hash;
+    entry->stat = st;
+    stitch__hash_cache.dirty = true;
+    stitch__mutex_unlock(&stitch__hash_cache_mutex);
+    return 1;
+}
+
+bool stitch_hash_cache_load(const char *cache_path)
+{
+    bool result = true;
+    Stitch_Mapped_File file = {0};
+
+    stitch__mutex_lock(&stitch__hash_cache_mutex);
+    stitch__hash_cache_reset();
+
+    int exists = stitch_file_exists(cache_path);
+    if (exists < 0) stitch_return_defer(false);
+    if (exists == 0) stitch_return_defer(true);
+    if (!stitch_map_file(cache_path, &file)) stitch_return_defer(false);
+
+    Stitch_String_View sv = file.content;
+    Stitch_String_View magic = stitch_sv_chop_left(&sv, strlen(STITCH__HASH_CACHE_MAGIC));
+    if (!stitch_sv_eq(magic, stitch_sv_from_cstr(STITCH__HASH_CACHE_MAGIC))) goto corrupted;
+
+    uint64_t entries_count;
+    if (!stitch__sv_chop_u64(&sv, &entries_count)) goto corrupted;
+    for (uint64_t i = 0; i < entries_count; ++i) {
+        Stitch_String_View path;
+        uint64_t inode, size, mtime, hash;
+        if (!stitch__sv_chop_sized(&sv, &path)) goto corrupted;
+        if (!stitch__sv_chop_u64(&sv, &inode)) goto corrupted;
+        if (!stitch__sv_chop_u64(&sv, &size)) goto corrupted;
+        if (!stitch__sv_chop_u64(&sv, &mtime)) goto corrupted;
+        if (!stitch__sv_chop_u64(&sv, &hash)) goto corrupted;
+
+        size_t temp_checkpoint = stitch_temp_save();
+        Stitch__Hash_Cache_Entry *entry = stitch__hash_cache_entry(stitch_temp_sv_to_cstr(path));
+        stitch_temp_rewind(temp_checkpoint);
+        entry->stat.inode = inode;
+        entry->stat.size  = (long long) size;
+        entry->stat.mtime = (long long) mtime;
+        entry->hash = hash;
+    }
+    if (sv.count != 0) goto corrupted;
+    stitch_return_defer(true);
+
+corrupted:
+    stitch_log(STITCH_WARNING, "hash cache %s is corrupted. Starting with an empty one.", cache_path);
+    stitch__hash_cache_reset();
+
+defer:
+    stitch__mutex_unlock(&stitch__hash_cache_mutex);
+    stitch_unmap_file(&file);
+    return result;
+}
+
+bool stitch_hash_cache_save(const char *cache_path)
+{
+    Stitch__Hash_Cache *cache = &stitch__hash_cache;
+    stitch__mutex_lock(&stitch__hash_cache_mutex);
+    bool dirty = cache->dirty;
+    stitch__mutex_unlock(&stitch__hash_cache_mutex);
+    if (!dirty && stitch_file_exists(cache_path) == 1) return true;
+
+    Stitch_String_Builder sb = {0};
+    stitch__mutex_lock(&stitch__hash_cache_mutex);
+    stitch_sb_append_cstr(&sb, STITCH__HASH_CACHE_MAGIC);
+    stitch__sb_append_u64(&sb, cache->count);
+    for (size_t i = 0; i < cache->count; ++i) {
+        Stitch__Hash_Cache_Entry *entry = &cache->items[i];
+        stitch__sb_append_sized_cstr(&sb, entry->path);
+        stitch__sb_append_u64(&sb, entry->stat.inode);
+        stitch__sb_append_u64(&sb, (uint64_t) entry->stat.size);
+        stitch__sb_append_u64(&sb, (uint64_t) entry->stat.mtime);
+        stitch__sb_append_u64(&sb, entry->hash);
+    }
+    cache->dirty = false;
+    stitch__mutex_unlock(&stitch__hash_cache_mutex);
+
+    // NOTE: the entries added while the file was being written are saved the next time
+    bool ok = stitch_write_entire_file_atomic(cache_path, sb.items, sb.count);
+    if (!ok) {
+        stitch__mutex_lock(&stitch__hash_cache_mutex);
+        cache->dirty = true;
+        stitch__mutex_unlock(&stitch__hash_cache_mutex);
+    }
+    stitch_sb_free(sb);
+    return ok;
+}
+
+// Hash of the paths and the contents of all the inputs. RETURNS the same as stitch_file_hash()
+static int stitch__inputs_hash(const char **input_paths, size_t input_paths_count, uint64_t *hash)
+{
+    *hash = 0;
+    for (size_t i = 0; i < input_paths_count; ++i) {
+        uint64_t file_hash;
+        int exists = stitch_file_hash(input_paths[i], &file_hash);
+        if (exists <= 0) {
+            // NOTE: non-existing input is an error cause it is needed for building in the first place
+            if (exists == 0) stitch_log(STITCH_ERROR, "input file %s does not exist", input_paths[i]);
+            return exists;
+        }
+        *hash = stitch_hash(input_paths[i], strlen(input_paths[i]), *hash);
+        *hash = stitch_hash(&file_hash, sizeof(file_hash), *hash);
+    }
+    return 1;
+}
+
+typedef struct {
+    char *output_path;
+    bool has_inputs_hash;
+    bool has_cmd_hash;
+    uint64_t inputs_hash;  // Hash of the inputs the output was built from the last time
+    uint64_t cmd_hash;     // Hash of the command the output was built with the last time
+} Stitch__Build_Log_Entry;
+
+typedef struct {
+    Stitch__Build_Log_Entry *items;
+    size_t count;
+    size_t capacity;
+    Stitch__Index index;  // output_path -> index of the entry
+    FILE *file;
+} Stitch__Build_Log;
+
+static Stitch__Build_Log stitch__build_log = {0};
+static Stitch__Mutex stitch__build_log_mutex = STITCH__MUTEX_INIT;
+
+#define STITCH__BUILD_LOG_HEADER "# stitch build log v2\n"
+// The log is rewritten on open once it has this many times more records than outputs
+#define STITCH__BUILD_LOG_COMPACTION_RATIO 3
+#define STITCH__BUILD_LOG_COMPACTION_MIN_RECORDS 100
+
+static Stitch__Build_Log_Entry *stitch__build_log_entry(const char *output_path)
+{
+    Stitch__Build_Log *log = &stitch__build_log;
+    size_t index;
+    if (stitch__index_get(&log->index, output_path, &index)) return &log->items[index];
+
+    char *key = stitch__strdup(output_path);
+    stitch_da_append(log, ((Stitch__Build_Log_Entry) {.output_path = key}));
+    stitch__index_put(&log->index, key, log->count - 1);
+    return &stitch_da_last(log);
+}
+
+// Record format: <cmd hash>\t<inputs hash>\t<output path>\n. Unknown hashes are written as zeros.
+static void stitch__build_log_render(Stitch_String_Builder *sb, const Stitch__Build_Log_Entry *entry)
+{
+    stitch_sb_appendf(sb, "%016llx\t%016llx\t%s\n",
+                      (unsigned long long) (entry->has_cmd_hash ? entry->cmd_hash : 0),
+                      (unsigned long long) (entry->has_inputs_hash ? entry->inputs_hash : 0),
+                      entry->output_path);
+}
+
+static void stitch__build_log_append(const Stitch__Build_Log_Entry *entry)
+{
+    if (stitch__build_log.file == NULL) return;
+    Stitch_String_Builder sb = {0};
+    stitch__build_log_render(&sb, entry);
+    fwrite(sb.items, 1, sb.count, stitch__build_log.file);
+    stitch_sb_free(sb);
+}
+
+static bool stitch__parse_hash(Stitch_String_View sv, uint64_t *hash)
+{
+    if (sv.count != 16) return false;
+    *hash = 0;
+    for (size_t i = 0; i < sv.count; ++i) {
+        char c = sv.data[i];
+        uint64_t digit;
+        if      ('0' <= c && c <= '9') digit = c - '0';
+        else if ('a' <= c && c <= 'f') digit = c - 'a' + 10;
+        else return false;
+        *hash = (*hash << 4) | digit;
+    }
+    return true;
+}
+
+bool stitch_build_log_open(const char *log_path)
+{
+    bool result = true;
+    Stitch__Build_Log *log = &stitch__build_log;
+    Stitch_Mapped_File file = {0};
+    Stitch_String_Builder content = {0};
+    size_t records_count = 0;
+    bool torn = false;
+
+    stitch_build_log_close();
+    stitch__mutex_lock(&stitch__build_log_mutex);
+
+    int exists = stitch_file_exists(log_path);
+    if (exists < 0) stitch_return_defer(false);
+    if (exists == 1) {
+        if (!stitch_map_file(log_path, &file)) stitch_return_defer(false);
+        Stitch_String_View sv = file.content;
+        if (!stitch_sv_starts_with(sv, stitch_sv_from_cstr(STITCH__BUILD_LOG_HEADER))) {
+            stitch_log(STITCH_WARNING, "build log %s has unknown format. Starting a new one.", log_path);
+            exists = 0;
+        }
+        torn = sv.count > 0 && sv.data[sv.count - 1] != '\n';
+        stitch_sv_chop_by_delim(&sv, '\n');
+        // NOTE: the log is append-only, so the later records override the earlier ones
+        while (exists && sv.count > 0) {
+            Stitch_String_View line = stitch_sv_chop_by_delim(&sv, '\n');
+            uint64_t cmd_hash, inputs_hash;
+            // NOTE: an incomplete last line is what's left of the run that was killed in the middle of writing
+            if (!stitch__parse_hash(stitch_sv_chop_by_delim(&line, '\t'), &cmd_hash)) continue;
+            if (!stitch__parse_hash(stitch_sv_chop_by_delim(&line, '\t'), &inputs_hash)) continue;
+            if (line.count == 0) continue;
+            size_t temp_checkpoint = stitch_temp_save();
+            Stitch__Build_Log_Entry *entry = stitch__build_log_entry(stitch_temp_sv_to_cstr(line));
+            stitch_temp_rewind(temp_checkpoint);
+            entry->cmd_hash = cmd_hash;
+            entry->has_cmd_hash = cmd_hash != 0;
+            entry->inputs_hash = inputs_hash;
+            entry->has_inputs_hash = inputs_hash != 0;
+            records_count += 1;
+        }
+    }
+
+    if (exists == 1
+            && records_count >= STITCH__BUILD_LOG_COMPACTION_MIN_RECORDS
+            && records_count > log->count*STITCH__BUILD_LOG_COMPACTION_RATIO) {
+        stitch_log(STITCH_INFO, "compacting build log %s", log_path);
+        stitch_sb_append_cstr(&content, STITCH__BUILD_LOG_HEADER);
+        for (size_t i = 0; i < log->count; ++i) {
+            stitch__build_log_render(&content, &log->items[i]);
+        }
+        if (!stitch_write_entire_file_atomic(log_path, content.items, content.count)) stitch_return_defer(false);
+        torn = false;
+    }
+
+    log->file = fopen(log_path, exists == 1 ? "ab" : "wb");
+    if (log->file == NULL) {
+        stitch_log(STITCH_ERROR, "Could not open build log %s: %s", log_path, strerror(errno));
+        stitch_return_defer(false);
+    }
+    if (exists != 1) fputs(STITCH__BUILD_LOG_HEADER, log->file);
+    // Terminate the torn line, or the next record would be glued onto it
+    if (exists == 1 && torn) fputc('\n', log->file);
+
+defer:
+    stitch__mutex_unlock(&stitch__build_log_mutex);
+    stitch_unmap_file(&file);
+    stitch_sb_free(content);
+    return result;
+}
+
+void stitch_build_log_close(void)
+{
+    Stitch__Build_Log *log = &stitch__build_log;
+    stitch__mutex_lock(&stitch__build_log_mutex);
+    if (log->file) fclose(log->file);
+    for (size_t i = 0; i < log->count; ++i) STITCH_FREE(log->items[i].output_path);
+    stitch_da_free(*log);
+    stitch__index_free(&log->index);
+    memset(log, 0, sizeof(*log));
+    stitch__mutex_unlock(&stitch__build_log_mutex);
+}
+
+uint64_t stitch_cmd_hash(Stitch_Cmd cmd)
+{
+    uint64_t hash = 0;
+    for (size_t i = 0; i < cmd.count; ++i) {
+        // NOTE: the NULL-terminators are hashed too, so {"ab", "c"} and {"a", "bc"} are different
+        hash = stitch_hash(cmd.items[i], strlen(cmd.items[i]) + 1, hash);
+    }
+    return hash;
+}
+
+bool stitch_build_log_record(const char *output_path, Stitch_Cmd cmd, const char **input_paths, size_t input_paths_count)
+{
+    uint64_t cmd_hash = stitch_cmd_hash(cmd);
+    uint64_t inputs_hash = 0;
+    bool has_inputs_hash = stitch_rebuild_mode == STITCH_REBUILD_HASH;
+    if (has_inputs_hash && stitch__inputs_hash(input_paths, input_paths_count, &inputs_hash) <= 0) return false;
+
+    stitch__mutex_lock(&stitch__build_log_mutex);
+    Stitch__Build_Log_Entry *entry = stitch__build_log_entry(output_path);
+    Stitch__Build_Log_Entry new_entry = *entry;
+    new_entry.cmd_hash = cmd_hash;
+    new_entry.has_cmd_hash = true;
+    if (has_inputs_hash) {
+        new_entry.inputs_hash = inputs_hash;
+        new_entry.has_inputs_hash = true;
+    }
+    if (new_entry.has_cmd_hash    != entry->has_cmd_hash    || new_entry.cmd_hash    != entry->cmd_hash ||
+        new_entry.has_inputs_hash != entry->has_inputs_hash || new_entry.inputs_hash != entry->inputs_hash) {
+        *entry = new_entry;
+        stitch__build_log_append(entry);
+    }
+    stitch__mutex_unlock(&stitch__build_log_mutex);
+    return true;
+}
+
+// Checks if the output was built with a different command the last time. If it is not known what command
+// the output was built with, the current one is adopted.
+static int stitch__cmd_changed(const char *output_path, uint64_t cmd_hash)
+{
+    int result = 0;
+    stitch__mutex_lock(&stitch__build_log_mutex);
+    Stitch__Build_Log_Entry *entry = stitch__build_log_entry(output_path);
+    if (entry->has_cmd_hash) {
+        result = entry->cmd_hash != cmd_hash;
+    } else {
+        entry->cmd_hash = cmd_hash;
+        entry->has_cmd_hash = true;
+        stitch__build_log_append(entry);
+    }
+    stitch__mutex_unlock(&stitch__build_log_mutex);
+    return result;
+}
+
+int stitch_needs_rebuild_cmd(Stitch_Cmd cmd, const char *output_path, const char **input_paths, size_t input_paths_count)
+{
+    int result = stitch_needs_rebuild(output_path, input_paths, input_paths_count);
+    if (result != 0) return result;
+    return stitch__cmd_changed(output_path, stitch_cmd_hash(cmd));
+}
+
+static int stitch__needs_rebuild_hash(const char *output_path, const char **input_paths, size_t input_paths_count)
+{
+    Stitch__File_Stat output_stat;
+    int exists = stitch__file_stat(output_path, &output_stat);
+    if (exists < 0) return -1;
+    // NOTE: if output does not exist it 100% must be rebuilt
+    if (exists == 0) return 1;
+
+    uint64_t inputs_hash;
+    if (stitch__inputs_hash(input_paths, input_paths_count, &inputs_hash) <= 0) return -1;
+
+    size_t index;
+    Stitch__Build_Log *log = &stitch__build_log;
+    stitch__mutex_lock(&stitch__build_log_mutex);
+    bool known = stitch__index_get(&log->index, output_path, &index) && log->items[index].has_inputs_hash;
+    bool changed = known && log->items[index].inputs_hash != inputs_hash;
+    stitch__mutex_unlock(&stitch__build_log_mutex);
+    if (known) return changed;
+
+    // NOTE: we don't know what the output was built from. Let the timestamps decide and if they
+    // say that it's up to date adopt the current inputs.
+    int result = stitch__needs_rebuild_mtime(output_path, input_paths, input_paths_count);
+    if (result == 0) {
+        stitch__mutex_lock(&stitch__build_log_mutex);
+        Stitch__Build_Log_Entry *entry = stitch__build_log_entry(output_path);
+        entry->inputs_hash = inputs_hash;
+        entry->has_inputs_hash = true;
+        stitch__build_log_append(entry);
+        stitch__mutex_unlock(&stitch__build_log_mutex);
+    }
+    return result;
+}
+
+int stitch_needs_rebuild(const char *output_path, const char **input_paths, size_t input_paths_count)
+{
+    switch (stitch_rebuild_mode) {
+    case STITCH_REBUILD_MTIME: return stitch__needs_rebuild_mtime(output_path, input_paths, input_paths_count);
+    case STITCH_REBUILD_HASH:  return stitch__needs_rebuild_hash(output_path, input_paths, input_paths_count);
+    default: STITCH_UNREACHABLE("stitch_needs_rebuild");
+    }
+}
+
+int stitch_needs_rebuild1(const char *output_path, const char *input_path)
+{
+    return stitch_needs_rebuild(output_path, &input_path, 1);
+}
+
+static bool stitch__depfile_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool stitch_parse_depfile(Stitch_String_View content, Stitch_Depfile *depfile)
+{
+    bool result = true;
+    Stitch_Indices target_offsets = {0};
+    Stitch_Indices dep_offsets = {0};
+    Stitch__Index seen = {0};
+
+    depfile->targets.count = 0;
+    depfile->deps.count = 0;
+    depfile->strings.count = 0;
+
+    const char *s = content.data;
+    size_t n = content.count;
+    size_t i = 0;
+    bool in_deps = false;
+    while (i < n) {
+        if (s[i] == '\n') {
+            in_deps = false;
+            i += 1;
+            continue;
+        }
+        if (s[i] == ' ' || s[i] == '\t' || s[i] == '\r') {
+            i += 1;
+            continue;
+        }
+        // Line continuation
+        if (s[i] == '\\' && i + 1 < n && s[i + 1] == '\n') {
+            i += 2;
+            continue;
+        }
+        if (s[i] == '\\' && i + 2 < n && s[i + 1] == '\r' && s[i + 2] == '\n') {
+            i += 3;
+            continue;
+        }
+
+        size_t begin = depfile->strings.count;
+        bool colon = false;
+        while (i < n && !stitch__depfile_is_space(s[i])) {
+            if (s[i] == '\\') {
+                size_t backslashes = 0;
+                while (i + backslashes < n && s[i + backslashes] == '\\') backslashes += 1;
+                char next = i + backslashes < n ? s[i + backslashes] : '\0';
+                if (next == ' ' || next == '\t' || next == '#') {
+                    // 2N+1 backslashes escape the character after them, 2N backslashes are just N backslashes
+                    for (size_t k = 0; k < backslashes/2; ++k) stitch_da_append(&depfile->strings, '\\');
+                    i += backslashes;
+                    if (backslashes%2 == 1) {
+                        stitch_da_append(&depfile->strings, next);
+                        i += 1;
+                        continue;
+                    }
+                    if (next == '#') continue;
+                    break;
+                }
+                if (next == '\n' || next == '\r') {
+                    // The last backslash starts a line continuation
+                    for (size_t k = 0; k + 1 < backslashes; ++k) stitch_da_append(&depfile->strings, '\\');
+                    i += backslashes - 1;
+                    break;
+                }
+                // Backslashes that don't escape anything are literal, like in Windows paths
+                for (size_t k = 0; k < backslashes; ++k) stitch_da_append(&depfile->strings, '\\');
+                i += backslashes;
+                continue;
+            }
+            if (s[i] == '$' && i + 1 < n && s[i + 1] == '$') {
+                stitch_da_append(&depfile->strings, '$');
+                i += 2;
+                continue;
+            }
+            // NOTE: a colon that is not followed by a space is a part of the path, like in C:\foo.h
+            if (s[i] == ':' && (i + 1 >= n || stitch__depfile_is_space(s[i + 1]))) {
+                colon = true;
+                i += 1;
+                break;
+            }
+            stitch_da_append(&depfile->strings, s[i]);
+            i += 1;
+        }
+
+        if (depfile->strings.count > begin) {
+            stitch_da_append(&depfile->strings, '\0');
+            if (in_deps) {
+                stitch_da_append(&dep_offsets, begin);
+            } else {
+                stitch_da_append(&target_offsets, begin);
+            }
+        }
+
+        if (colon) {
+            if (in_deps) {
+                stitch_log(STITCH_ERROR, "unexpected `:` in the list of deps of the depfile");
+                stitch_return_defer(false);
+            }
+            in_deps = true;
+        }
+    }
+
+    // NOTE: the paths are only resolved at the end because the strings may be reallocated while parsing
+    for (size_t j = 0; j < dep_offsets.count; ++j) {
+        const char *dep = depfile->strings.items + dep_offsets.items[j];
+        size_t dummy;
+        if (stitch__index_get(&seen, dep, &dummy)) continue;
+        stitch__index_put(&seen, dep, j);
+        stitch_da_append(&depfile->deps, dep);
+    }
+    for (size_t j = 0; j < target_offsets.count; ++j) {
+        const char *target = depfile->strings.items + target_offsets.items[j];
+        size_t dummy;
+        // The targets of the phony rules generated by -MP are the deps of the main rule
+        if (stitch__index_get(&seen, target, &dummy)) continue;
+        stitch_da_append(&depfile->targets, target);
+    }
+
+defer:
+    stitch_da_free(target_offsets);
+    stitch_da_free(dep_offsets);
+    stitch__index_free(&seen);
+    return result;
+}
+
+bool stitch_read_depfile(const char *path, Stitch_Depfile *depfile)
+{
+    Stitch_String_Builder content = {0};
+    if (!stitch_read_entire_file(path, &content)) {
+        stitch_sb_free(content);
+        return false;
+    }
+    bool ok = stitch_parse_depfile(stitch_sb_to_sv(content), depfile);
+    if (!ok) stitch_log(STITCH_ERROR, "Could not parse depfile %s", path);
+    stitch_sb_free(content);
+    return ok;
+}
+
+void stitch_depfile_free(Stitch_Depfile *depfile)
+{
+    stitch_da_free(depfile->targets);
+    stitch_da_free(depfile->deps);
+    stitch_sb_free(depfile->strings);
+    memset(depfile, 0, sizeof(*depfile));
+}
+
+typedef struct {
+    char *depfile_path;
+    long long mtime;
+    long long size;
+    size_t deps_begin;  // Index of the first dep in Stitch__Deps_Cache.deps
+    size_t deps_count;
+} Stitch__Deps_Cache_Entry;
+
+typedef struct {
+    Stitch__Deps_Cache_Entry *items;
+    size_t count;
+    size_t capacity;
+    Stitch__Index index;      // depfile_path -> index of the entry
+    Stitch_File_Paths deps;   // The deps of all the entries one after another
+    Stitch_Arena strings;     // The deps never move, so they can be handed out to any thread
+    size_t abandoned;         // How many of the deps belong to the previous versions of the depfiles
+    bool dirty;               // Whether there is anything new to save
+} Stitch__Deps_Cache;
+
+static Stitch__Deps_Cache stitch__deps_cache = {0};
+static Stitch__Mutex stitch__deps_cache_mutex = STITCH__MUTEX_INIT;
+
+#define STITCH__DEPS_CACHE_MAGIC "STITCHD1"
+
+static void stitch__deps_cache_reset(void)
+{
+    Stitch__Deps_Cache *cache = &stitch__deps_cache;
+    for (size_t i = 0; i < cache->count; ++i) STITCH_FREE(cache->items[i].depfile_path);
+    stitch_da_free(*cache);
+    stitch__index_free(&cache->index);
+    stitch_da_free(cache->deps);
+    stitch_arena_free(&cache->strings);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static Stitch__Deps_Cache_Entry *stitch__deps_cache_entry(const char *depfile_path)
+{
+    Stitch__Deps_Cache *cache = &stitch__deps_cache;
+    size_t index;
+    if (stitch__index_get(&cache->index, depfile_path, &index)) return &cache->items[index];
+
+    char *key = stitch__strdup(depfile_path);
+    stitch_da_append(cache, ((Stitch__Deps_Cache_Entry) {.depfile_path = key, .mtime = -1}));
+    stitch__index_put(&cache->index, key, cache->count - 1);
+    return &stitch_da_last(cache);
+}
+
+static void stitch__deps_cache_add_dep(Stitch__Deps_Cache_Entry *entry, const char *dep, size_t dep_size)
+{
+    Stitch__Deps_Cache *cache = &stitch__deps_cache;
+    char *copy = stitch__arena_alloc_aligned(&cache->strings, dep_size + 1, 1);
+    memcpy(copy, dep, dep_size);
+    copy[dep_size] = '\0';
+    stitch_da_append(&cache->deps, copy);
+    entry->deps_count += 1;
+}
+
+int stitch_depfile_deps(const char *depfile_path, Stitch_File_Paths *deps)
+{
+    Stitch__Deps_Cache *cache = &stitch__deps_cache;
+    Stitch__File_Stat st;
+    int exists = stitch__file_stat(depfile_path, &st);
+    if (exists <= 0) return exists;
+
+    stitch__mutex_lock(&stitch__deps_cache_mutex);
+    Stitch__Deps_Cache_Entry *entry = stitch__deps_cache_entry(depfile_path);
+    if (entry->mtime != st.mtime || entry->size != st.size) {
+        // NOTE: the depfile is parsed without holding the lock, so the other threads can parse theirs at the same time
+        stitch__mutex_unlock(&stitch__deps_cache_mutex);
+        Stitch_Depfile depfile = {0};
+        if (!stitch_read_depfile(depfile_path, &depfile)) {
+            stitch_depfile_free(&depfile);
+            return -1;
+        }
+        stitch__mutex_lock(&stitch__deps_cache_mutex);
+        // NOTE: the deps of the previous version of the depfile are simply abandoned until the next
+        // stitch_deps_cache_save()/stitch_deps_cache_load() round trip or stitch__deps_cache_compact()
+        entry = stitch__deps_cache_entry(depfile_path);
+        cache->abandoned += entry->deps_count;
+        entry->deps_begin = cache->deps.count;
+        entry->deps_count = 0;
+        for (size_t i = 0; i < depfile.deps.count; ++i) {
+            stitch__deps_cache_add_dep(entry, depfile.deps.items[i], strlen(depfile.deps.items[i]));
+        }
+        entry->mtime = st.mtime;
+        entry->size  = st.size;
+        cache->dirty = true;
+        stitch_depfile_free(&depfile);
+    }
+
+    stitch_da_append_many(deps, cache->deps.items + entry->deps_begin, entry->deps_count);
+    stitch__mutex_unlock(&stitch__deps_cache_mutex);
+    return 1;
+}
+
+// Drops the deps abandoned by the depfiles that have changed, once they outnumber the live ones. Invalidates all
+// the deps handed out so far, so it's only done between the builds of stitch_graph_watch(), which rewrite the
+// depfiles over and over.
+static void stitch__deps_cache_compact(void)
+{
+    Stitch__Deps_Cache *cache = &stitch__deps_cache;
+    stitch__mutex_lock(&stitch__deps_cache_mutex);
+    if (cache->abandoned > 0 && cache->abandoned*2 >= cache->deps.count) {
+        Stitch_File_Paths old_deps = cache->deps;
+        Stitch_Arena old_strings = cache->strings;
+        memset(&cache->deps, 0, sizeof(cache->deps));
+        memset(&cache->strings, 0, sizeof(cache->strings));
+        for (size_t i = 0; i < cache->count; ++i) {
+            Stitch__Deps_Cache_Entry *entry = &cache->items[i];
+            const char **deps = old_deps.items + entry->deps_begin;
+            size_t deps_count = entry->deps_count;
+            entry->deps_begin = cache->deps.count;
+            entry->deps_count = 0;
+            for (size_t j = 0; j < deps_count; ++j) stitch__deps_cache_add_dep(entry, deps[j], strlen(deps[j]));
+        }
+        cache->abandoned = 0;
+        stitch_da_free(old_deps);
+        stitch_arena_free(&old_strings);
+    }
+    stitch__mutex_unlock(&stitch__deps_cache_mutex);
+}
+
+bool stitch_deps_cache_load(const char *cache_path)
+{
+    bool result = true;
+    Stitch_Mapped_File file = {0};
+    Stitch__Deps_Cache *cache = &stitch__deps_cache;
+
+    stitch__mutex_lock(&stitch__deps_cache_mutex);
+    stitch__deps_cache_reset();
+
+    int exists = stitch_file_exists(cache_path);
+    if (exists < 0) stitch_return_defer(false);
+    if (exists == 0) stitch_return_defer(true);
+    if (!stitch_map_file(cache_path, &file)) stitch_return_defer(false);
+
+    Stitch_String_View sv = file.content;
+    Stitch_String_View magic = stitch_sv_chop_left(&sv, strlen(STITCH__DEPS_CACHE_MAGIC));
+    if (!stitch_sv_eq(magic, stitch_sv_from_cstr(STITCH__DEPS_CACHE_MAGIC))) goto corrupted;
+
+    uint64_t entries_count;
+    if (!stitch__sv_chop_u64(&sv, &entries_count)) goto corrupted;
+    for (uint64_t i = 0; i < entries_count; ++i) {
+        Stitch_String_View path;
+        uint64_t mtime, size, deps_count;
+        if (!stitch__sv_chop_sized(&sv, &path)) goto corrupted;
+        if (!stitch__sv_chop_u64(&sv, &mtime)) goto corrupted;
+        if (!stitch__sv_chop_u64(&sv, &size)) goto corrupted;
+        if (!stitch__sv_chop_u64(&sv, &deps_count)) goto corrupted;
+
+        size_t temp_checkpoint = stitch_temp_save();
+        Stitch__Deps_Cache_Entry *entry = stitch__deps_cache_entry(stitch_temp_sv_to_cstr(path));
+        stitch_temp_rewind(temp_checkpoint);
+        entry->mtime = (long long) mtime;
+        entry->size = (long long) size;
+        entry->deps_begin = cache->deps.count;
+        entry->deps_count = 0;
+        for (uint64_t j = 0; j < deps_count; ++j) {
+            Stitch_String_View dep;
+            if (!stitch__sv_chop_sized(&sv, &dep)) goto corrupted;
+            stitch__deps_cache_add_dep(entry, dep.data, dep.count);
+        }
+    }
+    if (sv.count != 0) goto corrupted;
+    stitch_return_defer(true);
+
+corrupted:
+    stitch_log(STITCH_WARNING, "deps cache %s is corrupted. Starting with an empty one.", cache_path);
+    stitch__deps_cache_reset();
 
-        case STITCH_FILE_REGULAR: {
-            if (!stitch_copy_file(src_path, dst_path)) {
-                stitch_return_defer(false);
-            }
-        } break;
+defer:
+    stitch__mutex_unlock(&stitch__deps_cache_mutex);
+    stitch_unmap_file(&file);
+    return result;
+}
 
-        case STITCH_FILE_SYMLINK: {
-            stitch_log(STITCH_WARNING, "TODO: Copying symlinks is not supported yet");
-        } break;
+bool stitch_deps_cache_save(const char *cache_path)
+{
+    Stitch__Deps_Cache *cache = &stitch__deps_cache;
+    stitch__mutex_lock(&stitch__deps_cache_mutex);
+    bool dirty = cache->dirty;
+    stitch__mutex_unlock(&stitch__deps_cache_mutex);
+    if (!dirty && stitch_file_exists(cache_path) == 1) return true;
 
-        case STITCH_FILE_OTHER: {
-            stitch_log(STITCH_ERROR, "Unsupported type of file %s", src_path);
-            stitch_return_defer(false);
-        } break;
+    Stitch_String_Builder sb = {0};
+    stitch__mutex_lock(&stitch__deps_cache_mutex);
+    stitch_sb_append_cstr(&sb, STITCH__DEPS_CACHE_MAGIC);
+    stitch__sb_append_u64(&sb, cache->count);
+    for (size_t i = 0; i < cache->count; ++i) {
+        Stitch__Deps_Cache_Entry *entry = &cache->items[i];
+        stitch__sb_append_sized_cstr(&sb, entry->depfile_path);
+        stitch__sb_append_u64(&sb, (uint64_t) entry->mtime);
+        stitch__sb_append_u64(&sb, (uint64_t) entry->size);
+        stitch__sb_append_u64(&sb, entry->deps_count);
+        for (size_t j = 0; j < entry->deps_count; ++j) {
+            stitch__sb_append_sized_cstr(&sb, cache->deps.items[entry->deps_begin + j]);
+        }
+    }
+    cache->dirty = false;
+    stitch__mutex_unlock(&stitch__deps_cache_mutex);
+
+    // NOTE: the entries added while the file was being written are saved the next time
+    bool ok = stitch_write_entire_file_atomic(cache_path, sb.items, sb.count);
+    if (!ok) {
+        stitch__mutex_lock(&stitch__deps_cache_mutex);
+        cache->dirty = true;
+        stitch__mutex_unlock(&stitch__deps_cache_mutex);
+    }
+    stitch_sb_free(sb);
+    return ok;
+}
 
-        default: STITCH_UNREACHABLE("stitch_copy_directory_recursively");
+int stitch_needs_rebuild_with_depfile(const char *output_path, const char **input_paths, size_t input_paths_count, const char *depfile_path)
+{
+    int result = 0;
+    Stitch_File_Paths all_inputs = {0};
+    stitch_da_append_many(&all_inputs, input_paths, input_paths_count);
+
+    // NOTE: the depfile is generated along with the output, so if it's missing the output is stale
+    result = stitch_depfile_deps(depfile_path, &all_inputs);
+    if (result <= 0) stitch_return_defer(result < 0 ? -1 : 1);
+
+    for (size_t i = input_paths_count; i < all_inputs.count; ++i) {
+        // NOTE: a removed header is not an error here unlike a removed explicit input. The output
+        // has to be rebuilt to find out if the header is still needed at all.
+        Stitch__File_Stat st;
+        int exists = stitch__file_stat(all_inputs.items[i], &st);
+        if (exists < 0) stitch_return_defer(-1);
+        if (exists == 0) stitch_return_defer(1);
     }
+    result = stitch_needs_rebuild(output_path, all_inputs.items, all_inputs.count);
 
 defer:
-    stitch_temp_rewind(temp_checkpoint);
-    stitch_da_free(src_sb);
-    stitch_da_free(dst_sb);
-    stitch_da_free(children);
+    stitch_da_free(all_inputs);
     return result;
 }
 
-char *stitch_temp_strdup(const char *cstr)
+#ifndef _WIN32
+
+// Layout of the action cache:
+//   <dir>/lock                    - flock()-ed by the readers in the shared mode and by the writers exclusively
+//   <dir>/tmp/                    - the entries that are still being stored
+//   <dir>/<xx>/<key>/manifest     - the number of the outputs, their total size and the hashes of the deps
+//   <dir>/<xx>/<key>/<i>          - the i-th output
+// The mtime of the manifest is the time the entry was last used.
+#define STITCH__ACTION_MANIFEST_HEADER "# stitch action v1\n"
+// The staging entries of the crashed builds are removed by stitch_action_cache_trim() after that many seconds
+#define STITCH__ACTION_STAGING_TIMEOUT (60*60)
+
+// RETURNS the fd of the lock file or -1 on error. Closing the fd releases the lock.
+static int stitch__action_cache_lock(const Stitch_Action_Cache *cache, int operation)
 {
-    size_t n = strlen(cstr);
-    char *result = stitch_temp_alloc(n + 1);
-    STITCH_ASSERT(result != NULL && "Increase STITCH_TEMP_CAPACITY");
-    memcpy(result, cstr, n);
-    result[n] = '\0';
-    return result;
+    if (!stitch__mkdir_silent(cache->dir)) return -1;
+    const char *lock_path = stitch_temp_sprintf("%s/lock", cache->dir);
+    int fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        stitch_log(STITCH_ERROR, "Could not open lock file %s: %s", lock_path, strerror(errno));
+        return -1;
+    }
+    while (flock(fd, operation) < 0) {
+        if (errno == EINTR) continue;
+        stitch_log(STITCH_ERROR, "Could not lock %s: %s", lock_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-void *stitch_temp_alloc(size_t size)
+static const char *stitch__action_entry_path(const Stitch_Action_Cache *cache, uint64_t key)
 {
-    if (stitch_temp_size + size > STITCH_TEMP_CAPACITY) return NULL;
-    void *result = &stitch_temp[stitch_temp_size];
-    stitch_temp_size += size;
-    return result;
+    return stitch_temp_sprintf("%s/%02x/%016llx", cache->dir, (unsigned) (key >> 56), (unsigned long long) key);
 }
 
-char *stitch_temp_sprintf(const char *format, ...)
+// Entries are flat directories, so there is nothing to recurse into
+static void stitch__action_entry_remove(const char *entry_path)
 {
-    va_list args;
-    va_start(args, format);
-    int n = vsnprintf(NULL, 0, format, args);
-    va_end(args);
-
-    STITCH_ASSERT(n >= 0);
-    char *result = stitch_temp_alloc(n + 1);
-    STITCH_ASSERT(result != NULL && "Extend the size of the temporary allocator");
-    // TODO: use proper arenas for the temporary allocator;
-    va_start(args, format);
-    vsnprintf(result, n + 1, format, args);
-    va_end(args);
+    DIR *dir = opendir(entry_path);
+    if (dir == NULL) return;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        size_t temp_checkpoint = stitch_temp_save();
+        unlink(stitch_temp_sprintf("%s/%s", entry_path, ent->d_name));
+        stitch_temp_rewind(temp_checkpoint);
+    }
+    closedir(dir);
+    if (rmdir(entry_path) < 0) {
+        stitch_log(STITCH_WARNING, "Could not remove %s: %s", entry_path, strerror(errno));
+    }
+}
 
-    return result;
+// Makes dst_path a copy of src_path in the cheapest way available: a reflink, a hardlink (if allowed) or
+// stitch_copy_file(). The reflink goes first even when hardlinks are allowed, since it does not share the inode
+// with the cache, so touching or editing the restored file leaves the entry alone.
+static bool stitch__clone_file(const char *src_path, const char *dst_path, bool hardlink)
+{
+    unlink(dst_path);
+#ifdef FICLONE
+    if (hardlink) {
+        int src_fd = open(src_path, O_RDONLY | O_CLOEXEC);
+        if (src_fd >= 0) {
+            struct stat st;
+            int dst_fd = fstat(src_fd, &st) == 0 ? open(dst_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode) : -1;
+            bool cloned = dst_fd >= 0 && ioctl(dst_fd, FICLONE, src_fd) == 0;
+            if (dst_fd >= 0) close(dst_fd);
+            close(src_fd);
+            if (cloned) return true;
+            if (dst_fd >= 0) unlink(dst_path);
+        }
+    }
+#endif // FICLONE
+    if (hardlink) return stitch_link_or_copy_file(src_path, dst_path);
+    // NOTE: stitch_copy_file() tries the reflink on its own
+    return stitch_copy_file(src_path, dst_path);
 }
 
-void stitch_temp_reset(void)
+// Whether path is what execvp() would run. Fails silently, since most of the PATH candidates don't exist
+static bool stitch__executable_stat(const char *path, Stitch__File_Stat *st)
 {
-    stitch_temp_size = 0;
+    struct stat statbuf;
+    if (stat(path, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) || access(path, X_OK) < 0) return false;
+    st->mtime = (long long) statbuf.STITCH__ST_MTIM.tv_sec*1000000000LL + statbuf.STITCH__ST_MTIM.tv_nsec;
+    st->size  = statbuf.st_size;
+    st->inode = statbuf.st_ino;
+    return true;
 }
 
-size_t stitch_temp_save(void)
+// The identity of the executable that runs the command: its resolved path, size and mtime.
+// Way cheaper than hashing the compiler binary on every run and good enough to notice upgrades.
+static uint64_t stitch__tool_identity(const char *tool, uint64_t seed)
 {
-    return stitch_temp_size;
+    Stitch__File_Stat st = {0};
+    bool found = false;
+    if (strchr(tool, '/') != NULL) {
+        found = stitch__executable_stat(tool, &st);
+    } else {
+        // NOTE: the candidates bypass the stat cache, which would keep every one of them around.
+        // Without PATH execvp() searches the default path of the libc
+        const char *path_var = getenv("PATH");
+        Stitch_String_View dirs = stitch_sv_from_cstr(path_var ? path_var : "/bin:/usr/bin");
+        for (bool last = false; !last && !found;) {
+            size_t rest = dirs.count;
+            Stitch_String_View dir = stitch_sv_chop_by_delim(&dirs, ':');
+            last = dir.count == rest;
+            // An empty entry (including a leading or a trailing colon) means the current directory
+            if (dir.count == 0) dir = stitch_sv_from_cstr(".");
+            const char *candidate = stitch_temp_sprintf(SV_Fmt"/%s", (int) dir.count, dir.data, tool);
+            found = stitch__executable_stat(candidate, &st);
+            if (found) tool = candidate;
+        }
+    }
+    uint64_t hash = stitch_hash(tool, strlen(tool) + 1, seed);
+    if (found) {
+        hash = stitch_hash(&st.mtime, sizeof(st.mtime), hash);
+        hash = stitch_hash(&st.size, sizeof(st.size), hash);
+    }
+    return hash;
 }
 
-void stitch_temp_rewind(size_t checkpoint)
+#endif // _WIN32
+
+bool stitch_action_key(const Stitch_Action_Cache *cache, Stitch_Cmd cmd, const char **input_paths, size_t input_paths_count, uint64_t *key)
 {
-    stitch_temp_size = checkpoint;
+    uint64_t hash = stitch_cmd_hash(cmd);
+    for (size_t i = 0; i < input_paths_count; ++i) {
+        uint64_t input_hash;
+        int exists = stitch_file_hash(input_paths[i], &input_hash);
+        if (exists == 0) stitch_log(STITCH_ERROR, "input file %s does not exist", input_paths[i]);
+        if (exists <= 0) return false;
+        hash = stitch_hash(&input_hash, sizeof(input_hash), hash);
+    }
+    for (size_t i = 0; i < cache->env_vars_count; ++i) {
+        const char *value = getenv(cache->env_vars[i]);
+        hash = stitch_hash(cache->env_vars[i], strlen(cache->env_vars[i]) + 1, hash);
+        // NOTE: an unset variable contributes nothing, while an empty one contributes the NULL-terminator
+        if (value) hash = stitch_hash(value, strlen(value) + 1, hash);
+    }
+#ifndef _WIN32
+    if (cmd.count > 0) {
+        size_t temp_checkpoint = stitch_temp_save();
+        hash = stitch__tool_identity(cmd.items[0], hash);
+        stitch_temp_rewind(temp_checkpoint);
+    }
+#endif // _WIN32
+    *key = hash;
+    return true;
 }
 
-const char *stitch_temp_sv_to_cstr(Stitch_String_View sv)
+int stitch_action_cache_restore(const Stitch_Action_Cache *cache, uint64_t key, const char **output_paths, size_t output_paths_count)
 {
-    char *result = stitch_temp_alloc(sv.count + 1);
-    STITCH_ASSERT(result != NULL && "Extend the size of the temporary allocator");
-    memcpy(result, sv.data, sv.count);
-    result[sv.count] = '\0';
+#ifdef _WIN32
+    STITCH_UNUSED(cache);
+    STITCH_UNUSED(key);
+    STITCH_UNUSED(output_paths);
+    STITCH_UNUSED(output_paths_count);
+    return 0;
+#else
+    int result = 0;
+    Stitch_String_Builder manifest = {0};
+    size_t temp_checkpoint = stitch_temp_save();
+
+    int lock_fd = stitch__action_cache_lock(cache, LOCK_SH);
+    if (lock_fd < 0) stitch_return_defer(-1);
+
+    const char *entry_path = stitch__action_entry_path(cache, key);
+    const char *manifest_path = stitch_temp_sprintf("%s/manifest", entry_path);
+    int exists = stitch_file_exists(manifest_path);
+    if (exists <= 0) stitch_return_defer(exists);
+    if (!stitch_read_entire_file(manifest_path, &manifest)) stitch_return_defer(-1);
+
+    Stitch_String_View sv = stitch_sb_to_sv(manifest);
+    if (!stitch_sv_starts_with(sv, stitch_sv_from_cstr(STITCH__ACTION_MANIFEST_HEADER))) {
+        stitch_log(STITCH_WARNING, "action cache entry %s has unknown format", entry_path);
+        stitch_return_defer(0);
+    }
+    stitch_sv_chop_by_delim(&sv, '\n');
+    Stitch_String_View outputs_count = stitch_sv_chop_by_delim(&sv, '\t');
+    stitch_sv_chop_by_delim(&sv, '\n');
+    if (strtoull(stitch_temp_sv_to_cstr(outputs_count), NULL, 10) != output_paths_count) stitch_return_defer(0);
+
+    while (sv.count > 0) {
+        Stitch_String_View line = stitch_sv_chop_by_delim(&sv, '\n');
+        uint64_t expected_hash, actual_hash;
+        if (!stitch__parse_hash(stitch_sv_chop_by_delim(&line, '\t'), &expected_hash)) stitch_return_defer(0);
+        int dep_exists = stitch_file_hash(stitch_temp_sv_to_cstr(line), &actual_hash);
+        if (dep_exists < 0) stitch_return_defer(-1);
+        if (dep_exists == 0 || actual_hash != expected_hash) stitch_return_defer(0);
+    }
+
+    for (size_t i = 0; i < output_paths_count; ++i) {
+        const char *src_path = stitch_temp_sprintf("%s/%zu", entry_path, i);
+        const char *tmp_path = stitch_temp_sprintf("%s.stitch-tmp", output_paths[i]);
+        if (!stitch__clone_file(src_path, tmp_path, cache->hardlink)) stitch_return_defer(-1);
+        // NOTE: the hardlinked output keeps the mtime of the entry, but it must look newer than its inputs
+        if (utimensat(AT_FDCWD, tmp_path, NULL, 0) < 0 || rename(tmp_path, output_paths[i]) < 0) {
+            stitch_log(STITCH_ERROR, "Could not restore %s: %s", output_paths[i], strerror(errno));
+            unlink(tmp_path);
+            stitch_return_defer(-1);
+        }
+        stitch_log(STITCH_INFO, "restored %s from the action cache", output_paths[i]);
+    }
+    // Mark the entry as recently used for stitch_action_cache_trim()
+    utimensat(AT_FDCWD, manifest_path, NULL, 0);
+    result = 1;
+
+defer:
+    if (lock_fd >= 0) close(lock_fd);
+    stitch_sb_free(manifest);
+    stitch_temp_rewind(temp_checkpoint);
     return result;
+#endif // _WIN32
 }
 
-int stitch_needs_rebuild(const char *output_path, const char **input_paths, size_t input_paths_count)
+bool stitch_action_cache_store(const Stitch_Action_Cache *cache, uint64_t key,
+                               const char **output_paths, size_t output_paths_count,
+                               const char **dep_paths, size_t dep_paths_count)
 {
 #ifdef _WIN32
-    BOOL bSuccess;
+    STITCH_UNUSED(cache);
+    STITCH_UNUSED(key);
+    STITCH_UNUSED(output_paths);
+    STITCH_UNUSED(output_paths_count);
+    STITCH_UNUSED(dep_paths);
+    STITCH_UNUSED(dep_paths_count);
+    return true;
+#else
+    bool result = true;
+    Stitch_String_Builder manifest = {0};
+    size_t temp_checkpoint = stitch_temp_save();
+    int lock_fd = -1;
+    const char *staging_path = NULL;
+    const char *replaced_path = NULL;
+
+    if (!stitch__mkdir_silent(cache->dir)) stitch_return_defer(false);
+    const char *tmp_dir = stitch_temp_sprintf("%s/tmp", cache->dir);
+    if (!stitch__mkdir_silent(tmp_dir)) stitch_return_defer(false);
+    // NOTE: the entry is assembled in a private directory, so nobody sees it half-written
+    staging_path = stitch_temp_sprintf("%s/%016llx.%ld.%ld", tmp_dir, (unsigned long long) key, stitch__self_pid(),
+                                  stitch__next_temp_file_id());
+    if (!stitch__mkdir_silent(staging_path)) stitch_return_defer(false);
+
+    unsigned long long size = 0;
+    for (size_t i = 0; i < output_paths_count; ++i) {
+        const char *dst_path = stitch_temp_sprintf("%s/%zu", staging_path, i);
+        if (!stitch__clone_file(output_paths[i], dst_path, cache->hardlink)) stitch_return_defer(false);
+        struct stat st;
+        if (stat(dst_path, &st) == 0) size += st.st_size;
+    }
 
-    HANDLE output_path_fd = CreateFile(output_path, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_READONLY, NULL);
-    if (output_path_fd == INVALID_HANDLE_VALUE) {
-        // NOTE: if output does not exist it 100% must be rebuilt
-        if (GetLastError() == ERROR_FILE_NOT_FOUND) return 1;
-        stitch_log(STITCH_ERROR, "Could not open file %s: %s", output_path, stitch_win32_error_message(GetLastError()));
-        return -1;
+    stitch_sb_append_cstr(&manifest, STITCH__ACTION_MANIFEST_HEADER);
+    stitch_sb_appendf(&manifest, "%zu\t%llu\n", output_paths_count, size);
+    for (size_t i = 0; i < dep_paths_count; ++i) {
+        uint64_t hash;
+        int exists = stitch_file_hash(dep_paths[i], &hash);
+        if (exists == 0) stitch_log(STITCH_ERROR, "dep %s does not exist", dep_paths[i]);
+        if (exists <= 0) stitch_return_defer(false);
+        stitch_sb_appendf(&manifest, "%016llx\t%s\n", (unsigned long long) hash, dep_paths[i]);
     }
-    FILETIME output_path_time;
-    bSuccess = GetFileTime(output_path_fd, NULL, NULL, &output_path_time);
-    CloseHandle(output_path_fd);
-    if (!bSuccess) {
-        stitch_log(STITCH_ERROR, "Could not get time of %s: %s", output_path, stitch_win32_error_message(GetLastError()));
-        return -1;
+    if (!stitch_write_entire_file(stitch_temp_sprintf("%s/manifest", staging_path), manifest.items, manifest.count)) {
+        stitch_return_defer(false);
     }
 
-    for (size_t i = 0; i < input_paths_count; ++i) {
-        const char *input_path = input_paths[i];
-        HANDLE input_path_fd = CreateFile(input_path, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_READONLY, NULL);
-        if (input_path_fd == INVALID_HANDLE_VALUE) {
-            // NOTE: non-existing input is an error cause it is needed for building in the first place
-            stitch_log(STITCH_ERROR, "Could not open file %s: %s", input_path, stitch_win32_error_message(GetLastError()));
-            return -1;
-        }
-        FILETIME input_path_time;
-        bSuccess = GetFileTime(input_path_fd, NULL, NULL, &input_path_time);
-        CloseHandle(input_path_fd);
-        if (!bSuccess) {
-            stitch_log(STITCH_ERROR, "Could not get time of %s: %s", input_path, stitch_win32_error_message(GetLastError()));
-            return -1;
+    lock_fd = stitch__action_cache_lock(cache, LOCK_EX);
+    if (lock_fd < 0) stitch_return_defer(false);
+    const char *entry_path = stitch__action_entry_path(cache, key);
+    if (!stitch__mkdir_silent(stitch_temp_sprintf("%s/%02x", cache->dir, (unsigned) (key >> 56)))) stitch_return_defer(false);
+    // The entry with the same key but different deps is replaced by the newer one
+    if (stitch_file_exists(entry_path) == 1) {
+        replaced_path = stitch_temp_sprintf("%s.old", staging_path);
+        if (rename(entry_path, replaced_path) < 0) {
+            stitch_log(STITCH_ERROR, "Could not replace %s: %s", entry_path, strerror(errno));
+            replaced_path = NULL;
+            stitch_return_defer(false);
         }
+    }
+    if (rename(staging_path, entry_path) < 0) {
+        stitch_log(STITCH_ERROR, "Could not store %s: %s", entry_path, strerror(errno));
+        stitch_return_defer(false);
+    }
+    staging_path = NULL;
 
-        // NOTE: if even a single input_path is fresher than output_path that's 100% rebuild
-        if (CompareFileTime(&input_path_time, &output_path_time) == 1) return 1;
+defer:
+    if (lock_fd >= 0) close(lock_fd);
+    if (staging_path) stitch__action_entry_remove(staging_path);
+    if (replaced_path) stitch__action_entry_remove(replaced_path);
+    stitch_sb_free(manifest);
+    stitch_temp_rewind(temp_checkpoint);
+    return result;
+#endif // _WIN32
+}
+
+#ifndef _WIN32
+
+typedef struct {
+    char *path;
+    long long last_used;
+    unsigned long long size;
+} Stitch__Action_Entry;
+
+typedef struct {
+    Stitch__Action_Entry *items;
+    size_t count;
+    size_t capacity;
+} Stitch__Action_Entries;
+
+static int stitch__action_entry_compare(const void *a, const void *b)
+{
+    const Stitch__Action_Entry *x = a;
+    const Stitch__Action_Entry *y = b;
+    return (x->last_used > y->last_used) - (x->last_used < y->last_used);
+}
+
+static bool stitch__action_entries_collect(const char *shard_path, Stitch__Action_Entries *entries, unsigned long long *total_size)
+{
+    DIR *dir = opendir(shard_path);
+    if (dir == NULL) {
+        stitch_log(STITCH_ERROR, "Could not open directory %s: %s", shard_path, strerror(errno));
+        return false;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        size_t temp_checkpoint = stitch_temp_save();
+        Stitch__Action_Entry entry = {.path = stitch__strdup(stitch_temp_sprintf("%s/%s", shard_path, ent->d_name))};
+        const char *manifest_path = stitch_temp_sprintf("%s/manifest", entry.path);
+        Stitch__File_Stat st;
+        Stitch_String_Builder manifest = {0};
+        // NOTE: an entry without a readable manifest is garbage, so it goes first
+        if (stitch__file_stat_uncached(manifest_path, &st) == 1 && stitch_read_entire_file(manifest_path, &manifest)) {
+            Stitch_String_View sv = stitch_sb_to_sv(manifest);
+            stitch_sv_chop_by_delim(&sv, '\n');
+            stitch_sv_chop_by_delim(&sv, '\t');
+            entry.size = strtoull(stitch_temp_sv_to_cstr(stitch_sv_chop_by_delim(&sv, '\n')), NULL, 10);
+            entry.last_used = st.mtime;
+        }
+        stitch_sb_free(manifest);
+        stitch_temp_rewind(temp_checkpoint);
+        *total_size += entry.size;
+        stitch_da_append(entries, entry);
     }
+    closedir(dir);
+    return true;
+}
 
-    return 0;
+#endif // _WIN32
+
+bool stitch_action_cache_trim(const Stitch_Action_Cache *cache)
+{
+#ifdef _WIN32
+    STITCH_UNUSED(cache);
+    return true;
 #else
-    struct stat statbuf = {0};
+    bool result = true;
+    Stitch__Action_Entries entries = {0};
+    unsigned long long total_size = 0;
+    size_t temp_checkpoint = stitch_temp_save();
+    DIR *dir = NULL;
 
-    if (stat(output_path, &statbuf) < 0) {
-        // NOTE: if output does not exist it 100% must be rebuilt
-        if (errno == ENOENT) return 1;
-        stitch_log(STITCH_ERROR, "could not stat %s: %s", output_path, strerror(errno));
-        return -1;
+    int lock_fd = stitch__action_cache_lock(cache, LOCK_EX);
+    if (lock_fd < 0) stitch_return_defer(false);
+
+    dir = opendir(cache->dir);
+    if (dir == NULL) {
+        stitch_log(STITCH_ERROR, "Could not open directory %s: %s", cache->dir, strerror(errno));
+        stitch_return_defer(false);
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        const char *name = ent->d_name;
+        bool is_shard = strlen(name) == 2 && isxdigit((unsigned char) name[0]) && isxdigit((unsigned char) name[1]);
+        if (!is_shard) continue;
+        if (!stitch__action_entries_collect(stitch_temp_sprintf("%s/%s", cache->dir, name), &entries, &total_size)) {
+            stitch_return_defer(false);
+        }
     }
-    int output_path_time = statbuf.st_mtime;
 
-    for (size_t i = 0; i < input_paths_count; ++i) {
-        const char *input_path = input_paths[i];
-        if (stat(input_path, &statbuf) < 0) {
-            // NOTE: non-existing input is an error cause it is needed for building in the first place
-            stitch_log(STITCH_ERROR, "could not stat %s: %s", input_path, strerror(errno));
-            return -1;
+    // Leftovers of the builds that crashed in the middle of storing an entry
+    const char *tmp_dir = stitch_temp_sprintf("%s/tmp", cache->dir);
+    if (stitch_file_exists(tmp_dir) == 1) {
+        Stitch__Action_Entries staging = {0};
+        unsigned long long staging_size = 0;
+        long long now = (long long) time(NULL)*1000*1000*1000;
+        if (stitch__action_entries_collect(tmp_dir, &staging, &staging_size)) {
+            for (size_t i = 0; i < staging.count; ++i) {
+                Stitch__File_Stat st;
+                bool stale = stitch__file_stat_uncached(staging.items[i].path, &st) == 1
+                          && now - st.mtime > (long long) STITCH__ACTION_STAGING_TIMEOUT*1000*1000*1000;
+                if (stale) stitch__action_entry_remove(staging.items[i].path);
+            }
         }
-        int input_path_time = statbuf.st_mtime;
-        // NOTE: if even a single input_path is fresher than output_path that's 100% rebuild
-        if (input_path_time > output_path_time) return 1;
+        for (size_t i = 0; i < staging.count; ++i) STITCH_FREE(staging.items[i].path);
+        stitch_da_free(staging);
     }
 
-    return 0;
-#endif
-}
+    if (cache->max_size == 0 || total_size <= cache->max_size) stitch_return_defer(true);
 
-int stitch_needs_rebuild1(const char *output_path, const char *input_path)
-{
-    return stitch_needs_rebuild(output_path, &input_path, 1);
+    qsort(entries.items, entries.count, sizeof(*entries.items), stitch__action_entry_compare);
+    size_t evicted = 0;
+    for (; evicted < entries.count && total_size > cache->max_size; ++evicted) {
+        stitch__action_entry_remove(entries.items[evicted].path);
+        total_size -= entries.items[evicted].size;
+    }
+    stitch_log(STITCH_INFO, "evicted %zu entries from the action cache %s", evicted, cache->dir);
+
+defer:
+    if (dir) closedir(dir);
+    if (lock_fd >= 0) close(lock_fd);
+    for (size_t i = 0; i < entries.count; ++i) STITCH_FREE(entries.items[i].path);
+    stitch_da_free(entries);
+    stitch_temp_rewind(temp_checkpoint);
+    return result;
+#endif // _WIN32
 }
 
 const char *stitch_path_name(const char *path)
@@ -1284,37 +5938,206 @@ bool stitch_rename(const char *old_path, const char *new_path)
     return true;
 }
 
-bool stitch_read_entire_file(const char *path, Stitch_String_Builder *sb)
+#ifndef _WIN32
+// Follows the symlinks (even a dangling one) to the file that is actually written, so replacing it does not
+// turn the link into a regular file. The result is allocated in the temporary allocator.
+static const char *stitch__resolve_symlinks(const char *path)
 {
-    bool result = true;
+    // NOTE: the same limit as the one of the kernel
+    for (size_t depth = 0; depth < 40; ++depth) {
+        char target[PATH_MAX];
+        ssize_t n = readlink(path, target, sizeof(target) - 1);
+        if (n < 0) return path;
+        target[n] = '\0';
+        const char *slash = strrchr(path, '/');
+        if (target[0] == '/' || slash == NULL) {
+            path = stitch_temp_strdup(target);
+        } else {
+            path = stitch_temp_sprintf("%.*s/%s", (int) (slash - path), path, target);
+        }
+    }
+    return path;
+}
+#endif // _WIN32
 
-    FILE *f = fopen(path, "rb");
-    if (f == NULL)                 stitch_return_defer(false);
-    if (fseek(f, 0, SEEK_END) < 0) stitch_return_defer(false);
-    long m = ftell(f);
-    if (m < 0)                     stitch_return_defer(false);
-    if (fseek(f, 0, SEEK_SET) < 0) stitch_return_defer(false);
-
-    size_t new_count = sb->count + m;
-    if (new_count > sb->capacity) {
-        sb->items = STITCH_REALLOC(sb->items, new_count);
-        STITCH_ASSERT(sb->items != NULL && "Buy more RAM lool!!");
-        sb->capacity = new_count;
-    }
-
-    fread(sb->items + sb->count, m, 1, f);
-    if (ferror(f)) {
-        // TODO: Afaik, ferror does not set errno. So the error reporting in defer is not correct in this case.
-        stitch_return_defer(false);
+bool stitch_write_entire_file_atomic(const char *path, const void *data, size_t size)
+{
+    size_t temp_checkpoint = stitch_temp_save();
+    const char *target = path;
+#ifndef _WIN32
+    target = stitch__resolve_symlinks(path);
+    // The replacement keeps the mode of the file it replaces, so a regenerated script stays executable
+    struct stat target_stat;
+    bool keep_mode = stat(target, &target_stat) == 0;
+#endif // _WIN32
+    // NOTE: the pid keeps the concurrent processes off each other's temporary files and the id does the same for
+    // the threads of this process
+    const char *temp_path = stitch_temp_sprintf("%s.stitch-tmp.%ld.%ld", target, stitch__self_pid(), stitch__next_temp_file_id());
+    bool result = stitch_write_entire_file(temp_path, data, size);
+#ifndef _WIN32
+    if (result && keep_mode && chmod(temp_path, target_stat.st_mode & 07777) < 0) {
+        stitch_log(STITCH_ERROR, "could not set mode of %s: %s", temp_path, strerror(errno));
+        result = false;
+    }
+#endif // _WIN32
+    if (result) {
+#ifdef _WIN32
+        result = MoveFileEx(temp_path, target, MOVEFILE_REPLACE_EXISTING);
+        if (!result) stitch_log(STITCH_ERROR, "could not rename %s to %s: %s", temp_path, target, stitch_win32_error_message(GetLastError()));
+#else
+        result = rename(temp_path, target) == 0;
+        if (!result) stitch_log(STITCH_ERROR, "could not rename %s to %s: %s", temp_path, target, strerror(errno));
+#endif // _WIN32
     }
-    sb->count = new_count;
+    if (!result) remove(temp_path);
+    if (result) {
+        stitch_stat_cache_invalidate(path);
+        if (target != path) stitch_stat_cache_invalidate(target);
+    }
+    stitch_temp_rewind(temp_checkpoint);
+    return result;
+}
 
-defer:
-    if (!result) stitch_log(STITCH_ERROR, "Could not read file %s: %s", path, strerror(errno));
+int stitch_write_entire_file_if_changed(const char *path, const void *data, size_t size)
+{
+    Stitch__File_Stat st;
+    int exists = stitch__file_stat_uncached(path, &st);
+    if (exists < 0) return -1;
+    if (exists > 0 && (unsigned long long) st.size == size) {
+        Stitch_String_Builder content = {0};
+        bool same = stitch_read_entire_file(path, &content) && content.count == size
+                    && (size == 0 || memcmp(content.items, data, size) == 0);
+        stitch_sb_free(content);
+        if (same) return 0;
+    }
+    return stitch_write_entire_file_atomic(path, data, size) ? 1 : -1;
+}
+
+#ifndef _WIN32
+// Appends everything that is left in fd to sb. Does not trust the size the file reports, since pipes and the
+// files in /proc report 0.
+static bool stitch__read_fd(int fd, Stitch_String_Builder *sb)
+{
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        // +1 so the read() that hits the end of the file does not need to grow the sb
+        stitch_da_reserve(sb, sb->count + (size_t) st.st_size + 1);
+    }
+    for (;;) {
+        stitch_da_reserve(sb, sb->count + 1);
+        ssize_t n = read(fd, sb->items + sb->count, sb->capacity - sb->count);
+        if (n == 0) return true;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        sb->count += n;
+    }
+}
+#endif // _WIN32
+
+bool stitch_read_entire_file(const char *path, Stitch_String_Builder *sb)
+{
+    size_t count = sb->count;
+#ifdef _WIN32
+    FILE *f = fopen(path, "rb");
+    bool result = f != NULL;
+    while (result) {
+        stitch_da_reserve(sb, sb->count + 1);
+        size_t n = fread(sb->items + sb->count, 1, sb->capacity - sb->count, f);
+        sb->count += n;
+        if (n == 0) {
+            result = !ferror(f);
+            break;
+        }
+    }
     if (f) fclose(f);
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    bool result = fd >= 0 && stitch__read_fd(fd, sb);
+    if (fd >= 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    }
+#endif // _WIN32
+    if (!result) {
+        stitch_log(STITCH_ERROR, "Could not read file %s: %s", path, strerror(errno));
+        sb->count = count;
+    }
     return result;
 }
 
+bool stitch_map_file(const char *path, Stitch_Mapped_File *file)
+{
+    memset(file, 0, sizeof(*file));
+    Stitch_String_Builder sb = {0};
+
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        stitch_log(STITCH_ERROR, "Could not open file %s: %s", path, stitch_win32_error_message(GetLastError()));
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (GetFileType(handle) == FILE_TYPE_DISK && GetFileSizeEx(handle, &size) && size.QuadPart > 0 && (unsigned long long) size.QuadPart <= SIZE_MAX) {
+        HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        // NOTE: the view keeps the mapping and the file alive on its own
+        void *view = mapping != NULL ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (mapping != NULL) CloseHandle(mapping);
+        if (view != NULL) {
+            CloseHandle(handle);
+            file->content = stitch_sv_from_parts(view, (size_t) size.QuadPart);
+            file->mapped = true;
+            return true;
+        }
+    }
+    CloseHandle(handle);
+    if (!stitch_read_entire_file(path, &sb)) return false;
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        stitch_log(STITCH_ERROR, "Could not open file %s: %s", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && (unsigned long long) st.st_size <= SIZE_MAX) {
+        void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            close(fd);
+            file->content = stitch_sv_from_parts(data, (size_t) st.st_size);
+            file->mapped = true;
+            return true;
+        }
+    }
+    // Pipes, the files in /proc that report the size 0, the empty files and anything else that can't be mapped
+    bool ok = stitch__read_fd(fd, &sb);
+    if (!ok) stitch_log(STITCH_ERROR, "Could not read file %s: %s", path, strerror(errno));
+    close(fd);
+    if (!ok) {
+        stitch_sb_free(sb);
+        return false;
+    }
+#endif // _WIN32
+
+    file->content = stitch_sb_to_sv(sb);
+    return true;
+}
+
+void stitch_unmap_file(Stitch_Mapped_File *file)
+{
+    if (file->mapped) {
+#ifdef _WIN32
+        UnmapViewOfFile(file->content.data);
+#else
+        munmap((void*) file->content.data, file->content.count);
+#endif // _WIN32
+    } else {
+        STITCH_FREE((void*) file->content.data);
+    }
+    memset(file, 0, sizeof(*file));
+}
+
 int stitch_sb_appendf(Stitch_String_Builder *sb, const char *fmt, ...)
 {
     va_list args;
@@ -1326,7 +6149,7 @@ int stitch_sb_appendf(Stitch_String_Builder *sb, const char *fmt, ...)
     // NOTE: the new_capacity needs to be +1 because of the null terminator.
     // However, further below we increase sb->count by n, not n + 1.
     // This is because we don't want the sb to include the null terminator. The user can always sb_append_null() if they want it
-    stitch_da_reserve(sb, sb->count + n + 1);
+    stitch__da_reserve_init_cap(sb, sb->count + n + 1, STITCH_SB_INIT_CAP);
     char *dest = sb->items + sb->count;
     va_start(args, fmt);
     vsprintf(dest, fmt, args);
@@ -1614,6 +6437,8 @@ int closedir(DIR *dirp)
         #define NO_LOGS STITCH_NO_LOGS
         #define Log_Level Stitch_Log_Level
         #define minimal_log_level stitch_minimal_log_level
+        #define set_minimal_log_level stitch_set_minimal_log_level
+        #define get_minimal_log_level stitch_get_minimal_log_level
         // NOTE: Name log is already defined in math.h and historically always was the natural logarithmic function.
         // So there should be no reason to strip the `stitch_` prefix in this specific case.
         // #define log stitch_log
@@ -1627,9 +6452,41 @@ int closedir(DIR *dirp)
         #define File_Type Stitch_File_Type
         #define mkdir_if_not_exists stitch_mkdir_if_not_exists
         #define copy_file stitch_copy_file
+        #define Sync_Opt Stitch_Sync_Opt
+        #define sync_directory stitch_sync_directory
+        #define link_or_copy_file stitch_link_or_copy_file
         #define copy_directory_recursively stitch_copy_directory_recursively
         #define read_entire_dir stitch_read_entire_dir
+        #define Arena Stitch_Arena
+        #define arena_alloc stitch_arena_alloc
+        #define arena_strdup stitch_arena_strdup
+        #define arena_sprintf stitch_arena_sprintf
+        #define arena_reset stitch_arena_reset
+        #define arena_save stitch_arena_save
+        #define arena_rewind stitch_arena_rewind
+        #define arena_realloc stitch_arena_realloc
+        #define da_reserve_arena stitch_da_reserve_arena
+        #define da_append_arena stitch_da_append_arena
+        #define da_append_many_arena stitch_da_append_many_arena
+        #define da_resize_arena stitch_da_resize_arena
+        #define sb_append_buf_arena stitch_sb_append_buf_arena
+        #define sb_append_cstr_arena stitch_sb_append_cstr_arena
+        #define sb_append_null_arena stitch_sb_append_null_arena
+        #define cmd_append_arena stitch_cmd_append_arena
+        #define arena_free stitch_arena_free
+        #define Walk_Entry Stitch_Walk_Entry
+        #define Walk_Entries Stitch_Walk_Entries
+        #define Walk_Opt Stitch_Walk_Opt
+        #define walk_dir stitch_walk_dir
+        #define walk_entries_free stitch_walk_entries_free
+        #define Glob_Paths Stitch_Glob_Paths
+        #define glob_match stitch_glob_match
+        // NOTE: glob is already defined in glob.h, so stitch_glob stays as it is
+        // #define glob stitch_glob
+        #define glob_paths_free stitch_glob_paths_free
         #define write_entire_file stitch_write_entire_file
+        #define write_entire_file_atomic stitch_write_entire_file_atomic
+        #define write_entire_file_if_changed stitch_write_entire_file_if_changed
         #define get_file_type stitch_get_file_type
         #define delete_file stitch_delete_file
         #define return_defer stitch_return_defer
@@ -1642,6 +6499,9 @@ int closedir(DIR *dirp)
         #define da_remove_unordered stitch_da_remove_unordered
         #define String_Builder Stitch_String_Builder
         #define read_entire_file stitch_read_entire_file
+        #define Mapped_File Stitch_Mapped_File
+        #define map_file stitch_map_file
+        #define unmap_file stitch_unmap_file
         #define sb_appendf stitch_sb_appendf
         #define sb_append_buf stitch_sb_append_buf
         #define sb_append_cstr stitch_sb_append_cstr
@@ -1658,12 +6518,53 @@ int closedir(DIR *dirp)
         #define procs_wait stitch_procs_wait
         #define procs_wait_and_reset stitch_procs_wait_and_reset
         #define proc_wait stitch_proc_wait
+        #define Proc_Result Stitch_Proc_Result
+        #define proc_wait_result stitch_proc_wait_result
+        #define proc_stats_enabled stitch_proc_stats_enabled
+        #define proc_stats_report stitch_proc_stats_report
+        #define proc_stats_reset stitch_proc_stats_reset
+        #define nprocs stitch_nprocs
+        #define nanos_since_unspecified_epoch stitch_nanos_since_unspecified_epoch
+        #define trace_begin stitch_trace_begin
+        #define trace_end stitch_trace_end
+        #define Job Stitch_Job
+        #define Jobs Stitch_Jobs
+        #define Output_Policy Stitch_Output_Policy
+        #define OUTPUT_INHERIT STITCH_OUTPUT_INHERIT
+        #define OUTPUT_BUFFER STITCH_OUTPUT_BUFFER
+        #define OUTPUT_FAILED_ONLY STITCH_OUTPUT_FAILED_ONLY
+        #define jobs_start stitch_jobs_start
+        #define jobs_start_and_reset stitch_jobs_start_and_reset
+        #define jobs_full stitch_jobs_full
+        #define jobs_wait_any stitch_jobs_wait_any
+        #define jobs_wait_all stitch_jobs_wait_all
+        #define jobs_free stitch_jobs_free
+        #define Indices Stitch_Indices
+        #define Target Stitch_Target
+        #define Graph Stitch_Graph
+        #define target_inputs stitch_target_inputs
+        #define target_inputs_many stitch_target_inputs_many
+        #define target_outputs stitch_target_outputs
+        #define target_outputs_many stitch_target_outputs_many
+        #define graph_add stitch_graph_add
+        #define graph_build stitch_graph_build
+        #define graph_critical_path stitch_graph_critical_path
+        #define graph_report_critical_path stitch_graph_report_critical_path
+        #define Watch_Opt Stitch_Watch_Opt
+        #define graph_watch stitch_graph_watch
+        #define graph_free stitch_graph_free
         #define Cmd Stitch_Cmd
         #define Cmd_Redirect Stitch_Cmd_Redirect
         #define cmd_render stitch_cmd_render
         #define cmd_append stitch_cmd_append
         #define cmd_extend stitch_cmd_extend
         #define cmd_free stitch_cmd_free
+        #define Small_Cmd Stitch_Small_Cmd
+        #define small_cmd_items stitch_small_cmd_items
+        #define small_cmd_append_many stitch_small_cmd_append_many
+        #define small_cmd_append stitch_small_cmd_append
+        #define small_cmd_view stitch_small_cmd_view
+        #define small_cmd_free stitch_small_cmd_free
         #define cmd_run_async stitch_cmd_run_async
         #define cmd_run_async_and_reset stitch_cmd_run_async_and_reset
         #define cmd_run_async_redirect stitch_cmd_run_async_redirect
@@ -1672,16 +6573,42 @@ int closedir(DIR *dirp)
         #define cmd_run_sync_and_reset stitch_cmd_run_sync_and_reset
         #define cmd_run_sync_redirect stitch_cmd_run_sync_redirect
         #define cmd_run_sync_redirect_and_reset stitch_cmd_run_sync_redirect_and_reset
+        #define Cmd_Capture Stitch_Cmd_Capture
+        #define cmd_run_capture stitch_cmd_run_capture
+        #define cmd_run_capture_many stitch_cmd_run_capture_many
         #define temp_strdup stitch_temp_strdup
         #define temp_alloc stitch_temp_alloc
         #define temp_sprintf stitch_temp_sprintf
         #define temp_reset stitch_temp_reset
         #define temp_save stitch_temp_save
         #define temp_rewind stitch_temp_rewind
+        #define temp_free stitch_temp_free
         #define path_name stitch_path_name
         #define rename stitch_rename
         #define needs_rebuild stitch_needs_rebuild
         #define needs_rebuild1 stitch_needs_rebuild1
+        #define stat_cache_enabled stitch_stat_cache_enabled
+        #define stat_cache_invalidate stitch_stat_cache_invalidate
+        #define stat_cache_reset stitch_stat_cache_reset
+        #define REBUILD_MTIME STITCH_REBUILD_MTIME
+        #define REBUILD_HASH STITCH_REBUILD_HASH
+        #define Rebuild_Mode Stitch_Rebuild_Mode
+        #define rebuild_mode stitch_rebuild_mode
+        // NOTE: hash is too common of a name to be stripped safely, so stitch_hash stays as it is
+        // #define hash stitch_hash
+        #define file_hash stitch_file_hash
+        #define hash_cache_load stitch_hash_cache_load
+        #define hash_cache_save stitch_hash_cache_save
+        #define build_log_open stitch_build_log_open
+        #define build_log_close stitch_build_log_close
+        #define build_log_record stitch_build_log_record
+        #define cmd_hash stitch_cmd_hash
+        #define Action_Cache Stitch_Action_Cache
+        #define action_key stitch_action_key
+        #define action_cache_restore stitch_action_cache_restore
+        #define action_cache_store stitch_action_cache_store
+        #define action_cache_trim stitch_action_cache_trim
+        #define needs_rebuild_cmd stitch_needs_rebuild_cmd
         #define file_exists stitch_file_exists
         #define get_current_dir_temp stitch_get_current_dir_temp
         #define set_current_dir stitch_set_current_dir
@@ -1698,6 +6625,14 @@ int closedir(DIR *dirp)
         #define sv_from_cstr stitch_sv_from_cstr
         #define sv_from_parts stitch_sv_from_parts
         #define sb_to_sv stitch_sb_to_sv
+        #define Depfile Stitch_Depfile
+        #define parse_depfile stitch_parse_depfile
+        #define read_depfile stitch_read_depfile
+        #define depfile_free stitch_depfile_free
+        #define depfile_deps stitch_depfile_deps
+        #define deps_cache_load stitch_deps_cache_load
+        #define deps_cache_save stitch_deps_cache_save
+        #define needs_rebuild_with_depfile stitch_needs_rebuild_with_depfile
         #define win32_error_message stitch_win32_error_message
     #endif // STITCH_STRIP_PREFIX
 #endif // STITCH_STRIP_PREFIX_GUARD_
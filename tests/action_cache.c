@@ -0,0 +1,127 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define ACTION_FOLDER BUILD_FOLDER "action_cache/"
+#define CACHE_FOLDER ACTION_FOLDER "cache"
+#define INPUT_PATH ACTION_FOLDER "input.txt"
+#define OUTPUT_PATH ACTION_FOLDER "output.txt"
+#define RUNS_PATH ACTION_FOLDER "runs.txt"
+#define ENV_VAR "STITCH_ACTION_CACHE_TEST"
+
+// Copies the input to the output and counts how many times it actually ran
+void add_target(Graph *graph)
+{
+    Target target = {0};
+    cmd_append(&target.cmd, "sh", "-c", "cat "INPUT_PATH" > "OUTPUT_PATH" && echo run >> "RUNS_PATH);
+    target_inputs(&target, INPUT_PATH);
+    target_outputs(&target, OUTPUT_PATH);
+    graph_add(graph, target);
+}
+
+bool expect_runs(size_t expected)
+{
+    String_Builder sb = {0};
+    if (!read_entire_file(RUNS_PATH, &sb)) return false;
+    size_t actual = 0;
+    for (size_t i = 0; i < sb.count; ++i) actual += sb.items[i] == '\n';
+    sb_free(sb);
+    if (actual != expected) {
+        stitch_log(ERROR, "expected the command to run %zu times, got %zu", expected, actual);
+        return false;
+    }
+    return true;
+}
+
+bool expect_output(const char *expected)
+{
+    String_Builder sb = {0};
+    if (!read_entire_file(OUTPUT_PATH, &sb)) return false;
+    bool ok = sb.count == strlen(expected) && memcmp(sb.items, expected, sb.count) == 0;
+    if (!ok) stitch_log(ERROR, "expected output `%s`, got `%.*s`", expected, (int) sb.count, sb.items);
+    sb_free(sb);
+    return ok;
+}
+
+bool build(Graph *graph, const char *input, size_t expected_runs)
+{
+    if (!write_entire_file(INPUT_PATH, input, strlen(input))) return false;
+    if (file_exists(OUTPUT_PATH) == 1 && !delete_file(OUTPUT_PATH)) return false;
+    if (!graph_build(graph, 1)) return false;
+    return expect_runs(expected_runs) && expect_output(input);
+}
+
+int main(void)
+{
+    int result = 0;
+    Graph graph = {0};
+    const char *env_vars[] = {ENV_VAR};
+    Action_Cache cache = {
+        .dir = CACHE_FOLDER,
+        .env_vars = env_vars,
+        .env_vars_count = ARRAY_LEN(env_vars),
+    };
+
+    if (!mkdir_if_not_exists(ACTION_FOLDER)) return_defer(1);
+    if (!write_entire_file(RUNS_PATH, "", 0)) return_defer(1);
+    unsetenv(ENV_VAR);
+    graph.action_cache = &cache;
+    add_target(&graph);
+
+    stitch_log(INFO, "--- miss ---");
+    if (!build(&graph, "foo", 1)) return_defer(1);
+    stitch_log(INFO, "--- hit ---");
+    if (!build(&graph, "foo", 1)) return_defer(1);
+    stitch_log(INFO, "--- the input has changed ---");
+    if (!build(&graph, "bar", 2)) return_defer(1);
+    stitch_log(INFO, "--- the input is back ---");
+    if (!build(&graph, "foo", 2)) return_defer(1);
+    stitch_log(INFO, "--- the environment has changed ---");
+    setenv(ENV_VAR, "1", 1);
+    if (!build(&graph, "foo", 3)) return_defer(1);
+    if (!build(&graph, "foo", 3)) return_defer(1);
+    unsetenv(ENV_VAR);
+
+    stitch_log(INFO, "--- the deps are verified on restore ---");
+    const char *dep_path = ACTION_FOLDER "dep.h";
+    const char *output_path = OUTPUT_PATH;
+    if (!write_entire_file(dep_path, "1", 1)) return_defer(1);
+    if (!action_cache_store(&cache, 69, &output_path, 1, &dep_path, 1)) return_defer(1);
+    if (action_cache_restore(&cache, 69, &output_path, 1) != 1) return_defer(1);
+    if (!write_entire_file(dep_path, "2", 1)) return_defer(1);
+    if (action_cache_restore(&cache, 69, &output_path, 1) != 0) return_defer(1);
+    if (action_cache_restore(&cache, 420, &output_path, 1) != 0) return_defer(1);
+
+    stitch_log(INFO, "--- the key follows the executable found in PATH ---");
+    // A directory with the name of the tool earlier in PATH is not what execvp() runs
+    if (!mkdir_if_not_exists(ACTION_FOLDER "bin1")) return_defer(1);
+    if (!mkdir_if_not_exists(ACTION_FOLDER "bin1/tool")) return_defer(1);
+    if (!mkdir_if_not_exists(ACTION_FOLDER "bin2")) return_defer(1);
+    const char *old_path = temp_strdup(getenv("PATH"));
+    setenv("PATH", ACTION_FOLDER "bin1:" ACTION_FOLDER "bin2", 1);
+    Cmd tool = {0};
+    cmd_append(&tool, "tool");
+    uint64_t key1, key2;
+    if (!write_entire_file(ACTION_FOLDER "bin2/tool", "#!/bin/sh\n", 10) || chmod(ACTION_FOLDER "bin2/tool", 0755) < 0) return_defer(1);
+    if (!action_key(&cache, tool, NULL, 0, &key1)) return_defer(1);
+    if (!write_entire_file(ACTION_FOLDER "bin2/tool", "#!/bin/sh\ntrue\n", 15)) return_defer(1);
+    if (!action_key(&cache, tool, NULL, 0, &key2)) return_defer(1);
+    setenv("PATH", old_path, 1);
+    cmd_free(tool);
+    if (key1 == key2) {
+        stitch_log(ERROR, "the key did not change with the executable");
+        return_defer(1);
+    }
+
+    stitch_log(INFO, "--- trim ---");
+    cache.max_size = 1;
+    if (!action_cache_trim(&cache)) return_defer(1);
+    if (!build(&graph, "foo", 4)) return_defer(1);
+
+    stitch_log(INFO, "OK");
+
+defer:
+    graph_free(&graph);
+    return result;
+}
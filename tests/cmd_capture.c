@@ -0,0 +1,92 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+bool expect_sb(const char *what, String_Builder sb, const char *expected, size_t expected_count)
+{
+    if (sb.count != expected_count || memcmp(sb.items, expected, expected_count) != 0) {
+        stitch_log(ERROR, "%s: expected %zu bytes `%.*s`, got %zu bytes `%.*s`", what,
+                   expected_count, (int) (expected_count < 64 ? expected_count : 64), expected,
+                   sb.count, (int) (sb.count < 64 ? sb.count : 64), sb.items);
+        return false;
+    }
+    return true;
+}
+
+int main(void)
+{
+    int result = 0;
+    Cmd cmd = {0};
+    String_Builder out = {0};
+    String_Builder err = {0};
+    String_Builder big = {0};
+
+    if (!build_tool(&cmd, "echo")) return_defer(1);
+
+    stitch_log(INFO, "--- stdout ---");
+    cmd_append(&cmd, BUILD_FOLDER TOOLS_FOLDER "echo", "Hello", "World");
+    if (!cmd_run_capture(cmd, (Cmd_Capture) {.out = &out})) return_defer(1);
+    if (!expect_sb("stdout", out, "Hello World\n", 12)) return_defer(1);
+    cmd.count = 0;
+    out.count = 0;
+
+    stitch_log(INFO, "--- stderr and the exit code ---");
+    cmd_append(&cmd, "sh", "-c", "echo oops >&2; exit 69");
+    if (cmd_run_capture(cmd, (Cmd_Capture) {.out = &out, .err = &err})) return_defer(1);
+    if (!expect_sb("stdout", out, "", 0)) return_defer(1);
+    if (!expect_sb("stderr", err, "oops\n", 5)) return_defer(1);
+    cmd.count = 0;
+
+    // Way more than a pipe can hold, so feeding stdin and reading stdout must be interleaved
+    stitch_log(INFO, "--- big stdin ---");
+    for (size_t i = 0; i < 1024*1024; ++i) da_append(&big, 'a' + i%26);
+    cmd_append(&cmd, "cat");
+    if (!cmd_run_capture(cmd, (Cmd_Capture) {.in = sb_to_sv(big), .out = &out})) return_defer(1);
+    if (!expect_sb("cat", out, big.items, big.count)) return_defer(1);
+    out.count = 0;
+
+    stitch_log(INFO, "--- the command does not read its stdin ---");
+    Cmd t = {0};
+    cmd_append(&t, "true");
+    if (!cmd_run_capture(t, (Cmd_Capture) {.in = sb_to_sv(big)})) return_defer(1);
+    cmd_free(t);
+
+    stitch_log(INFO, "--- the commands get the default SIGPIPE back ---");
+    // A shell can't be killed by the signals that were ignored when it started
+    cmd.count = 0;
+    cmd_append(&cmd, "sh", "-c", "kill -PIPE $$");
+    if (cmd_run_sync_and_reset(&cmd)) return_defer(1);
+
+    stitch_log(INFO, "--- many ---");
+    enum { COUNT = 8 };
+    Cmd cmds[COUNT] = {0};
+    Cmd_Capture captures[COUNT] = {0};
+    String_Builder outs[COUNT] = {0};
+    bool oks[COUNT];
+    for (size_t i = 0; i < COUNT; ++i) {
+        cmd_append(&cmds[i], "sh", "-c", temp_sprintf("cat; echo %zu", i));
+        captures[i] = (Cmd_Capture) {.in = sv_from_cstr(temp_sprintf("%zu:", i)), .out = &outs[i]};
+    }
+    cmd_append(&cmds[COUNT - 1], "does not matter");
+    cmds[COUNT - 1].items[0] = "stitch-this-command-does-not-exist";
+    if (cmd_run_capture_many(cmds, captures, COUNT, oks)) return_defer(1);
+    for (size_t i = 0; i < COUNT - 1; ++i) {
+        const char *expected = temp_sprintf("%zu:%zu\n", i, i);
+        if (!oks[i] || !expect_sb("many", outs[i], expected, strlen(expected))) return_defer(1);
+    }
+    if (oks[COUNT - 1]) return_defer(1);
+    for (size_t i = 0; i < COUNT; ++i) {
+        cmd_free(cmds[i]);
+        sb_free(outs[i]);
+    }
+
+    stitch_log(INFO, "OK");
+
+defer:
+    cmd_free(cmd);
+    sb_free(out);
+    sb_free(err);
+    sb_free(big);
+    return result;
+}
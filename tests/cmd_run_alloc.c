@@ -0,0 +1,56 @@
+#include <stdlib.h>
+
+static size_t allocations_count = 0;
+
+void *counting_realloc(void *ptr, size_t size)
+{
+    allocations_count += 1;
+    return realloc(ptr, size);
+}
+
+#define STITCH_REALLOC counting_realloc
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+
+bool expect_no_allocations(Cmd cmd, const char *what)
+{
+    size_t before = allocations_count;
+    for (size_t i = 0; i < 10; ++i) {
+        if (!cmd_run_sync(cmd)) return false;
+    }
+    if (allocations_count != before) {
+        stitch_log(ERROR, "%s: expected no allocations, got %zu", what, allocations_count - before);
+        return false;
+    }
+    return true;
+}
+
+int main(void)
+{
+    Cmd cmd = {0};
+    cmd_append(&cmd, "true");
+
+    minimal_log_level = WARNING;
+    // The table of the running commands is allocated once by the first launch
+    if (!cmd_run_sync(cmd)) return 1;
+    // The argv is copied onto the stack along with its NULL-terminator, whoever owns the items
+    if (!expect_no_allocations(cmd, "owned cmd")) return 1;
+    const char *args[] = {"true", "foo"};
+    if (!expect_no_allocations((Cmd) {.items = args, .count = 2, .capacity = 2}, "borrowed cmd")) return 1;
+    // So the slot after the count is never written, even when it belongs to the longer cmd this one is a view of
+    const char *longer[] = {"true", "foo", "bar"};
+    if (!expect_no_allocations((Cmd) {.items = longer, .count = 2, .capacity = 3}, "prefix view")) return 1;
+    if (longer[2] == NULL || strcmp(longer[2], "bar") != 0) {
+        stitch_log(ERROR, "prefix view: the argument after the view was overwritten");
+        return 1;
+    }
+    // And the storage of the cmd may be read-only
+    static const char *const read_only[] = {"true", "foo", "bar"};
+    if (!expect_no_allocations((Cmd) {.items = (const char **) read_only, .count = 2, .capacity = 3}, "read-only")) return 1;
+    minimal_log_level = INFO;
+
+    cmd_free(cmd);
+    stitch_log(INFO, "OK");
+    return 0;
+}
@@ -0,0 +1,128 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define INPUT_PATH BUILD_FOLDER "cmd_signature_input.c"
+#define OUTPUT_PATH BUILD_FOLDER "cmd_signature_output.o"
+#define LOG_PATH BUILD_FOLDER "cmd_signature.log"
+
+bool set_mtime(const char *path, time_t sec)
+{
+    struct timespec times[2] = {{.tv_sec = sec}, {.tv_sec = sec}};
+    if (utimensat(AT_FDCWD, path, times, 0) < 0) {
+        stitch_log(ERROR, "Could not set mtime of %s: %s", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool expect_rebuild(const char *opt, int expected)
+{
+    Cmd cmd = {0};
+    cmd_append(&cmd, "cc", opt, "-c", "-o", OUTPUT_PATH, INPUT_PATH);
+    int actual = needs_rebuild_cmd(cmd, OUTPUT_PATH, (const char*[]) {INPUT_PATH}, 1);
+    cmd_free(cmd);
+    if (actual != expected) {
+        stitch_log(ERROR, "needs_rebuild_cmd() with %s: expected %d, got %d", opt, expected, actual);
+        return false;
+    }
+    return true;
+}
+
+bool record(const char *opt)
+{
+    Cmd cmd = {0};
+    cmd_append(&cmd, "cc", opt, "-c", "-o", OUTPUT_PATH, INPUT_PATH);
+    bool ok = build_log_record(OUTPUT_PATH, cmd, (const char*[]) {INPUT_PATH}, 1);
+    cmd_free(cmd);
+    return ok;
+}
+
+size_t count_lines(const char *path)
+{
+    String_Builder sb = {0};
+    if (!read_entire_file(path, &sb)) return 0;
+    size_t lines = 0;
+    for (size_t i = 0; i < sb.count; ++i) lines += sb.items[i] == '\n';
+    sb_free(sb);
+    return lines;
+}
+
+int main(void)
+{
+    Cmd a = {0}, b = {0};
+    cmd_append(&a, "ab", "c");
+    cmd_append(&b, "a", "bc");
+    if (cmd_hash(a) == cmd_hash(b)) {
+        stitch_log(ERROR, "the arguments are not separated in cmd_hash()");
+        return 1;
+    }
+    cmd_free(a);
+    cmd_free(b);
+
+    if (!write_entire_file(INPUT_PATH, "int x;\n", 7)) return 1;
+    if (!write_entire_file(OUTPUT_PATH, "", 0)) return 1;
+    if (!set_mtime(INPUT_PATH, 1000000000)) return 1;
+    if (!set_mtime(OUTPUT_PATH, 1000000001)) return 1;
+    // NOTE: the log may be left over from the previous runs
+    if (file_exists(LOG_PATH) == 1 && !delete_file(LOG_PATH)) return 1;
+
+    if (!build_log_open(LOG_PATH)) return 1;
+    // The output is not known yet, so the current command is adopted
+    if (!expect_rebuild("-O2", 0)) return 1;
+    if (!expect_rebuild("-O2", 0)) return 1;
+    // Changing the flags triggers the rebuild
+    if (!expect_rebuild("-O3", 1)) return 1;
+    if (!record("-O3")) return 1;
+    if (!expect_rebuild("-O3", 0)) return 1;
+    if (!expect_rebuild("-O2", 1)) return 1;
+    // Stale inputs still matter
+    if (!set_mtime(INPUT_PATH, 1000000002)) return 1;
+    if (!expect_rebuild("-O3", 1)) return 1;
+    if (!set_mtime(INPUT_PATH, 1000000000)) return 1;
+
+    // The log survives between the runs
+    build_log_close();
+    if (!build_log_open(LOG_PATH)) return 1;
+    if (!expect_rebuild("-O3", 0)) return 1;
+    if (!expect_rebuild("-O2", 1)) return 1;
+
+    // The log that is mostly made of the outdated records is compacted on open
+    for (size_t i = 0; i < 200; ++i) {
+        if (!record(i%2 == 0 ? "-O2" : "-O3")) return 1;
+    }
+    build_log_close();
+    if (count_lines(LOG_PATH) < 200) {
+        stitch_log(ERROR, "expected the log to contain all the records");
+        return 1;
+    }
+    if (!build_log_open(LOG_PATH)) return 1;
+    size_t lines = count_lines(LOG_PATH);
+    if (lines != 2) {
+        stitch_log(ERROR, "expected the compacted log to have 2 lines, got %zu", lines);
+        return 1;
+    }
+    if (!expect_rebuild("-O3", 0)) return 1;
+    if (!expect_rebuild("-O2", 1)) return 1;
+    build_log_close();
+
+    // The records appended after a torn line left by a killed run are not glued onto it
+    FILE *f = fopen(LOG_PATH, "ab");
+    if (f == NULL) {
+        stitch_log(ERROR, "Could not open %s: %s", LOG_PATH, strerror(errno));
+        return 1;
+    }
+    fputs("0123456789abcdef\t0123", f);
+    fclose(f);
+    if (!build_log_open(LOG_PATH)) return 1;
+    if (!record("-O2")) return 1;
+    build_log_close();
+    if (!build_log_open(LOG_PATH)) return 1;
+    if (!expect_rebuild("-O2", 0)) return 1;
+    if (!expect_rebuild("-O3", 1)) return 1;
+    build_log_close();
+
+    stitch_log(INFO, "OK");
+    return 0;
+}
@@ -0,0 +1,70 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define COPY_FOLDER BUILD_FOLDER "copy_file/"
+
+bool expect_contents(const char *path, String_Builder expected)
+{
+    String_Builder actual = {0};
+    bool ok = read_entire_file(path, &actual);
+    if (ok && (actual.count != expected.count || memcmp(actual.items, expected.items, actual.count) != 0)) {
+        stitch_log(ERROR, "%s: expected %zu bytes of the original contents, got %zu bytes of something else", path, expected.count, actual.count);
+        ok = false;
+    }
+    sb_free(actual);
+    return ok;
+}
+
+int main(void)
+{
+    int result = 0;
+    String_Builder big = {0};
+    String_Builder small = {0};
+    String_Builder empty = {0};
+
+    if (!mkdir_if_not_exists(COPY_FOLDER)) return_defer(1);
+
+    // Larger than any of the internal buffers and chunks
+    uint32_t x = 69;
+    for (size_t i = 0; i < 3*1024*1024 + 7; ++i) {
+        x = x*1103515245 + 12345;
+        da_append(&big, (char) (x >> 16));
+    }
+    sb_append_cstr(&small, "small\n");
+    if (!write_entire_file(COPY_FOLDER"big", big.items, big.count)) return_defer(1);
+    if (!write_entire_file(COPY_FOLDER"small", small.items, small.count)) return_defer(1);
+    if (!write_entire_file(COPY_FOLDER"empty", NULL, 0)) return_defer(1);
+
+    if (!copy_file(COPY_FOLDER"big", COPY_FOLDER"big.copy")) return_defer(1);
+    if (!expect_contents(COPY_FOLDER"big.copy", big)) return_defer(1);
+    if (!copy_file(COPY_FOLDER"empty", COPY_FOLDER"empty.copy")) return_defer(1);
+    if (!expect_contents(COPY_FOLDER"empty.copy", empty)) return_defer(1);
+
+    // The bigger destination is truncated
+    if (!copy_file(COPY_FOLDER"small", COPY_FOLDER"big.copy")) return_defer(1);
+    if (!expect_contents(COPY_FOLDER"big.copy", small)) return_defer(1);
+
+    // Copying over a hardlink must not modify the file it shares the inode with
+    if (!link_or_copy_file(COPY_FOLDER"big", COPY_FOLDER"big.link")) return_defer(1);
+    if (!expect_contents(COPY_FOLDER"big.link", big)) return_defer(1);
+    if (!copy_file(COPY_FOLDER"small", COPY_FOLDER"big.link")) return_defer(1);
+    if (!expect_contents(COPY_FOLDER"big.link", small)) return_defer(1);
+    if (!expect_contents(COPY_FOLDER"big", big)) return_defer(1);
+
+#ifdef __linux__
+    // The files in /proc report the size 0, but they are not empty
+    String_Builder version = {0};
+    if (!read_entire_file("/proc/version", &version) || version.count == 0) return_defer(1);
+    if (!copy_file("/proc/version", COPY_FOLDER"version")) return_defer(1);
+    if (!expect_contents(COPY_FOLDER"version", version)) return_defer(1);
+    sb_free(version);
+#endif // __linux__
+
+    stitch_log(INFO, "OK");
+defer:
+    sb_free(big);
+    sb_free(small);
+    return result;
+}
@@ -0,0 +1,88 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define CRITICAL_PATH_FOLDER BUILD_FOLDER "critical_path/"
+
+void add_step(Graph *graph, const char *seconds, const char *input, const char *output)
+{
+    Target target = {0};
+    cmd_append(&target.cmd, "sh", "-c", temp_sprintf("sleep %s && touch %s", seconds, output));
+    if (input) target_inputs(&target, input);
+    target_outputs(&target, output);
+    graph_add(graph, target);
+}
+
+int main(void)
+{
+    int result = 0;
+    Graph graph = {.report_critical_path = true};
+    Indices path = {0};
+
+    if (!mkdir_if_not_exists(CRITICAL_PATH_FOLDER)) return_defer(1);
+
+    // a -> b -> c is the longest chain, d runs alongside of it
+    add_step(&graph, "0.1", NULL, CRITICAL_PATH_FOLDER"a");
+    add_step(&graph, "0.2", NULL, CRITICAL_PATH_FOLDER"d");
+    add_step(&graph, "0.1", CRITICAL_PATH_FOLDER"a", CRITICAL_PATH_FOLDER"b");
+    add_step(&graph, "0.1", CRITICAL_PATH_FOLDER"b", CRITICAL_PATH_FOLDER"c");
+    for (size_t i = 0; i < graph.count; ++i) {
+        const char *output = graph.items[i].outputs.items[0];
+        if (file_exists(output) > 0 && !delete_file(output)) return_defer(1);
+    }
+
+    if (!graph_build(&graph, 2)) return_defer(1);
+
+    graph_critical_path(&graph, &path);
+    size_t expected[] = {0, 2, 3};
+    if (path.count != ARRAY_LEN(expected)) {
+        stitch_log(ERROR, "expected %zu steps on the critical path, got %zu", ARRAY_LEN(expected), path.count);
+        return_defer(1);
+    }
+    for (size_t i = 0; i < path.count; ++i) {
+        if (path.items[i] != expected[i]) {
+            stitch_log(ERROR, "expected step %zu of the critical path to be target %zu, got %zu", i, expected[i], path.items[i]);
+            return_defer(1);
+        }
+        const Target *target = &graph.items[path.items[i]];
+        if (target->end_ns - target->start_ns < 100*1000*1000) {
+            stitch_log(ERROR, "%s took less than it slept", target->outputs.items[0]);
+            return_defer(1);
+        }
+    }
+
+    // Nothing ran, so there is nothing to report
+    if (!graph_build(&graph, 2)) return_defer(1);
+    path.count = 0;
+    graph_critical_path(&graph, &path);
+    if (path.count != 0) {
+        stitch_log(ERROR, "expected an empty critical path of a no-op build, got %zu steps", path.count);
+        return_defer(1);
+    }
+    graph_free(&graph);
+
+    // With a single job slot y -> z finishes last only because it waited for x. The time spent waiting
+    // for a slot does not count, so the critical path is x alone.
+    graph = (Graph) {0};
+    add_step(&graph, "0.3", NULL, CRITICAL_PATH_FOLDER"x");
+    add_step(&graph, "0.05", NULL, CRITICAL_PATH_FOLDER"y");
+    add_step(&graph, "0.05", CRITICAL_PATH_FOLDER"y", CRITICAL_PATH_FOLDER"z");
+    for (size_t i = 0; i < graph.count; ++i) {
+        const char *output = graph.items[i].outputs.items[0];
+        if (file_exists(output) > 0 && !delete_file(output)) return_defer(1);
+    }
+    if (!graph_build(&graph, 1)) return_defer(1);
+    path.count = 0;
+    graph_critical_path(&graph, &path);
+    if (path.count != 1 || path.items[0] != 0) {
+        stitch_log(ERROR, "expected the critical path of a single job slot to be target 0 alone, got %zu steps", path.count);
+        return_defer(1);
+    }
+
+    stitch_log(INFO, "OK");
+defer:
+    da_free(path);
+    graph_free(&graph);
+    return result;
+}
@@ -0,0 +1,77 @@
+#include <stdlib.h>
+
+static size_t allocations_count = 0;
+
+void *counting_realloc(void *ptr, size_t size)
+{
+    allocations_count += 1;
+    return realloc(ptr, size);
+}
+
+#define STITCH_REALLOC counting_realloc
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+
+#define CMDS_COUNT 1000
+
+int main(void)
+{
+    Arena arena = {0};
+    Cmd cmds[CMDS_COUNT] = {0};
+
+    for (int round = 0; round < 2; ++round) {
+        size_t before = allocations_count;
+        for (size_t i = 0; i < CMDS_COUNT; ++i) {
+            Cmd cmd = {0};
+            cmd_append_arena(&arena, &cmd, "cc", "-c", "-o");
+            for (size_t j = 0; j < i%300; ++j) cmd_append_arena(&arena, &cmd, "-Wall");
+            cmds[i] = cmd;
+        }
+        for (size_t i = 0; i < CMDS_COUNT; ++i) {
+            if (cmds[i].count != 3 + i%300 || strcmp(cmds[i].items[0], "cc") != 0 || strcmp(stitch_da_last(&cmds[i]), i%300 ? "-Wall" : "-o") != 0) {
+                stitch_log(ERROR, "round %d: command %zu got corrupted", round, i);
+                return 1;
+            }
+        }
+        // The second round reuses the blocks of the first one
+        if (round == 1 && allocations_count != before) {
+            stitch_log(ERROR, "expected no allocations after the reset, got %zu", allocations_count - before);
+            return 1;
+        }
+        arena_reset(&arena);
+    }
+
+    // The last allocation of the arena grows in place
+    String_Builder sb = {0};
+    sb_append_cstr_arena(&arena, &sb, "hello");
+    char *items = sb.items;
+    for (size_t i = 0; i < 2*STITCH_DA_INIT_CAP; ++i) sb_append_buf_arena(&arena, &sb, ",", 1);
+    sb_append_null_arena(&arena, &sb);
+    if (sb.items != items) {
+        stitch_log(ERROR, "expected the string builder to grow in place");
+        return 1;
+    }
+    if (sb.count != 5 + 2*STITCH_DA_INIT_CAP + 1 || strncmp(sb.items, "hello,,", 7) != 0) {
+        stitch_log(ERROR, "unexpected content of the string builder");
+        return 1;
+    }
+
+    // The graph leaves the arrays of such targets to the arena
+    Graph graph = {.arena_targets = true};
+    for (size_t i = 0; i < 10; ++i) {
+        Target target = {0};
+        da_append_arena(&arena, &target.inputs, temp_sprintf("input%zu", i));
+        da_append_arena(&arena, &target.outputs, temp_sprintf("phony%zu", i));
+        graph_add(&graph, target);
+    }
+    if (graph.items[9].inputs.count != 1 || strcmp(graph.items[9].outputs.items[0], "phony9") != 0) {
+        stitch_log(ERROR, "unexpected target");
+        return 1;
+    }
+    graph_free(&graph);
+    arena_free(&arena);
+
+    stitch_log(INFO, "OK");
+    return 0;
+}
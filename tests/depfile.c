@@ -0,0 +1,79 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define DEPFILE_FOLDER BUILD_FOLDER "depfile/"
+
+bool expect_paths(const char *what, File_Paths actual, const char **expected, size_t expected_count)
+{
+    bool ok = actual.count == expected_count;
+    for (size_t i = 0; ok && i < actual.count; ++i) {
+        ok = strcmp(actual.items[i], expected[i]) == 0;
+    }
+    if (!ok) {
+        stitch_log(ERROR, "Unexpected %s", what);
+        for (size_t i = 0; i < expected_count; ++i) stitch_log(ERROR, "    Expected: `%s`", expected[i]);
+        for (size_t i = 0; i < actual.count; ++i)   stitch_log(ERROR, "    Actual:   `%s`", actual.items[i]);
+    }
+    return ok;
+}
+
+bool test_parse(void)
+{
+    Depfile depfile = {0};
+    const char *content =
+        "foo.o bar.o: foo.c include/foo\\ bar.h \\\n"
+        "  C:\\sdk\\win.h \\\r\n"
+        "  100$$.h \\#hash.h two\\\\ foo.c\n"
+        "\n"
+        "include/foo\\ bar.h:\n"
+        "C:\\sdk\\win.h:\n";
+    const char *targets[] = {"foo.o", "bar.o"};
+    const char *deps[] = {"foo.c", "include/foo bar.h", "C:\\sdk\\win.h", "100$.h", "#hash.h", "two\\"};
+
+    bool ok = parse_depfile(sv_from_cstr(content), &depfile)
+        && expect_paths("targets", depfile.targets, targets, ARRAY_LEN(targets))
+        && expect_paths("deps", depfile.deps, deps, ARRAY_LEN(deps));
+    depfile_free(&depfile);
+    return ok;
+}
+
+int main(void)
+{
+    int result = 0;
+    Cmd cmd = {0};
+    File_Paths deps = {0};
+
+    if (!test_parse()) return_defer(1);
+
+    if (!mkdir_if_not_exists(DEPFILE_FOLDER)) return_defer(1);
+    const char *foo_h = "#define FOO 69\n";
+    const char *foo_c = "#include \"foo.h\"\nint foo(void) { return FOO; }\n";
+    if (!write_entire_file(DEPFILE_FOLDER"foo.h", foo_h, strlen(foo_h))) return_defer(1);
+    if (!write_entire_file(DEPFILE_FOLDER"foo.c", foo_c, strlen(foo_c))) return_defer(1);
+
+    const char *inputs[] = {DEPFILE_FOLDER"foo.c"};
+    if (needs_rebuild_with_depfile(DEPFILE_FOLDER"foo.o", inputs, ARRAY_LEN(inputs), DEPFILE_FOLDER"foo.d") != 1) return_defer(1);
+    cmd_append(&cmd, "cc", "-MMD", "-MP", "-MF", DEPFILE_FOLDER"foo.d", "-c", "-o", DEPFILE_FOLDER"foo.o", DEPFILE_FOLDER"foo.c");
+    if (!cmd_run_sync_and_reset(&cmd)) return_defer(1);
+    if (needs_rebuild_with_depfile(DEPFILE_FOLDER"foo.o", inputs, ARRAY_LEN(inputs), DEPFILE_FOLDER"foo.d") != 0) return_defer(1);
+
+    // The cache survives the round trip through the disk
+    if (!deps_cache_save(DEPFILE_FOLDER"deps.cache")) return_defer(1);
+    if (!deps_cache_load(DEPFILE_FOLDER"deps.cache")) return_defer(1);
+    const char *expected_deps[] = {DEPFILE_FOLDER"foo.c", DEPFILE_FOLDER"foo.h"};
+    if (depfile_deps(DEPFILE_FOLDER"foo.d", &deps) != 1) return_defer(1);
+    if (!expect_paths("cached deps", deps, expected_deps, ARRAY_LEN(expected_deps))) return_defer(1);
+
+    // The header that the object file was built from is gone
+    if (!delete_file(DEPFILE_FOLDER"foo.h")) return_defer(1);
+    if (needs_rebuild_with_depfile(DEPFILE_FOLDER"foo.o", inputs, ARRAY_LEN(inputs), DEPFILE_FOLDER"foo.d") != 1) return_defer(1);
+
+    stitch_log(INFO, "OK");
+
+defer:
+    free(cmd.items);
+    free(deps.items);
+    return result;
+}
@@ -0,0 +1,85 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define GLOB_FOLDER BUILD_FOLDER "glob"
+
+bool expect_match(const char *pattern, const char *path, bool expected)
+{
+    if (glob_match(pattern, path) != expected) {
+        stitch_log(ERROR, "expected `%s` %s `%s`", pattern, expected ? "to match" : "not to match", path);
+        return false;
+    }
+    return true;
+}
+
+bool expect_glob(const char *pattern, const char **expected, size_t expected_count)
+{
+    Glob_Paths paths = {0};
+    bool ok = stitch_glob(pattern, &paths) && paths.count == expected_count;
+    for (size_t i = 0; ok && i < expected_count; ++i) ok = strcmp(paths.items[i], expected[i]) == 0;
+    if (!ok) {
+        stitch_log(ERROR, "Unexpected matches of %s:", pattern);
+        for (size_t i = 0; i < paths.count; ++i) stitch_log(ERROR, "    %s", paths.items[i]);
+    }
+    glob_paths_free(&paths);
+    return ok;
+}
+
+int main(void)
+{
+    if (!expect_match("*.c", "main.c", true)) return 1;
+    if (!expect_match("*.c", "src/main.c", false)) return 1;
+    if (!expect_match("src/**/*.c", "src/main.c", true)) return 1;
+    if (!expect_match("src/**/*.c", "src/a/b/c.c", true)) return 1;
+    if (!expect_match("src/**", "src/a/b", true)) return 1;
+    if (!expect_match("**/*.h", "include/x.h", true)) return 1;
+    if (!expect_match("*.{c,h}", "x.h", true)) return 1;
+    if (!expect_match("*.{c,h}", "x.o", false)) return 1;
+    if (!expect_match("{src/*.c,include/**/*.h}", "include/a/b.h", true)) return 1;
+    if (!expect_match("{a,b{c,d}}", "bd", true)) return 1;
+    if (!expect_match("file[0-9].txt", "file7.txt", true)) return 1;
+    if (!expect_match("file[!0-9].txt", "file7.txt", false)) return 1;
+    if (!expect_match("file[!0-9].txt", "filex.txt", true)) return 1;
+    if (!expect_match("?.c", "ab.c", false)) return 1;
+    if (!expect_match("a*b*c", "axxbyyc", true)) return 1;
+    if (!expect_match("a*b*c", "axxbyy", false)) return 1;
+    if (!expect_match("*", ".hidden", false)) return 1;
+    if (!expect_match(".*", ".hidden", true)) return 1;
+    if (!expect_match("**/*.c", ".git/x.c", false)) return 1;
+
+    const char *dirs[] = {GLOB_FOLDER, GLOB_FOLDER"/src", GLOB_FOLDER"/src/lib", GLOB_FOLDER"/src/.cache", GLOB_FOLDER"/other"};
+    for (size_t i = 0; i < ARRAY_LEN(dirs); ++i) {
+        if (!mkdir_if_not_exists(dirs[i])) return 1;
+    }
+    const char *files[] = {
+        GLOB_FOLDER"/src/main.c", GLOB_FOLDER"/src/main.o", GLOB_FOLDER"/src/lib/lib.c", GLOB_FOLDER"/src/lib/lib.h",
+        GLOB_FOLDER"/src/.cache/cached.c", GLOB_FOLDER"/other/other.c",
+    };
+    for (size_t i = 0; i < ARRAY_LEN(files); ++i) {
+        if (!write_entire_file(files[i], "", 0)) return 1;
+    }
+
+    const char *sources[] = {GLOB_FOLDER"/src/lib/lib.c", GLOB_FOLDER"/src/lib/lib.h", GLOB_FOLDER"/src/main.c"};
+    if (!expect_glob(GLOB_FOLDER"/src/**/*.{c,h}", sources, ARRAY_LEN(sources))) return 1;
+
+    // Overlapping alternatives are deduplicated
+    const char *c_files[] = {GLOB_FOLDER"/other/other.c", GLOB_FOLDER"/src/lib/lib.c", GLOB_FOLDER"/src/main.c"};
+    if (!expect_glob(GLOB_FOLDER"/{src/**,*}/*.c", c_files, ARRAY_LEN(c_files))) return 1;
+
+    const char *dirs_only[] = {GLOB_FOLDER"/other", GLOB_FOLDER"/src"};
+    if (!expect_glob(GLOB_FOLDER"/*", dirs_only, ARRAY_LEN(dirs_only))) return 1;
+
+    const char *literal[] = {GLOB_FOLDER"/src/main.o"};
+    if (!expect_glob(GLOB_FOLDER"/src/main.o", literal, ARRAY_LEN(literal))) return 1;
+    if (!expect_glob(GLOB_FOLDER"/does-not-exist/**", NULL, 0)) return 1;
+
+    // Relative patterns give relative paths
+    if (!set_current_dir(GLOB_FOLDER)) return 1;
+    const char *relative[] = {"src/lib/lib.h"};
+    if (!expect_glob("**/*.h", relative, ARRAY_LEN(relative))) return 1;
+
+    stitch_log(INFO, "OK");
+    return 0;
+}
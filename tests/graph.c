@@ -0,0 +1,89 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define GRAPH_FOLDER BUILD_FOLDER "graph/"
+
+// foo.c -> foo.o --+
+//                  +--> main
+// main.c -> main.o +
+void add_targets(Graph *graph)
+{
+    Target foo = {0};
+    cmd_append(&foo.cmd, "cc", "-c", "-o", GRAPH_FOLDER"foo.o", GRAPH_FOLDER"foo.c");
+    target_inputs(&foo, GRAPH_FOLDER"foo.c");
+    target_outputs(&foo, GRAPH_FOLDER"foo.o");
+    graph_add(graph, foo);
+
+    Target exe = {0};
+    cmd_append(&exe.cmd, "cc", "-o", GRAPH_FOLDER"main", GRAPH_FOLDER"main.o", GRAPH_FOLDER"foo.o");
+    target_inputs(&exe, GRAPH_FOLDER"main.o", GRAPH_FOLDER"foo.o");
+    target_outputs(&exe, GRAPH_FOLDER"main");
+    graph_add(graph, exe);
+
+    Target main = {0};
+    cmd_append(&main.cmd, "cc", "-c", "-o", GRAPH_FOLDER"main.o", GRAPH_FOLDER"main.c");
+    target_inputs(&main, GRAPH_FOLDER"main.c");
+    target_outputs(&main, GRAPH_FOLDER"main.o");
+    graph_add(graph, main);
+}
+
+bool expect_dirty(Graph *graph, bool foo, bool exe, bool main)
+{
+    bool expected[] = {foo, exe, main};
+    for (size_t i = 0; i < graph->count; ++i) {
+        if (graph->items[i].dirty != expected[i]) {
+            stitch_log(ERROR, "%s: expected dirty = %d, got %d", graph->items[i].outputs.items[0], expected[i], graph->items[i].dirty);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(void)
+{
+    int result = 0;
+    Graph graph = {0};
+
+    if (!mkdir_if_not_exists(GRAPH_FOLDER)) return_defer(1);
+    const char *foo_c = "int foo(void) { return 0; }\n";
+    const char *main_c = "int foo(void);\nint main(void) { return foo(); }\n";
+    if (!write_entire_file(GRAPH_FOLDER"foo.c", foo_c, strlen(foo_c))) return_defer(1);
+    if (!write_entire_file(GRAPH_FOLDER"main.c", main_c, strlen(main_c))) return_defer(1);
+    add_targets(&graph);
+
+    stitch_log(INFO, "--- clean build ---");
+    if (!graph_build(&graph, 2)) return_defer(1);
+    if (!expect_dirty(&graph, true, true, true)) return_defer(1);
+
+    stitch_log(INFO, "--- no-op build ---");
+    if (!graph_build(&graph, 2)) return_defer(1);
+    if (!expect_dirty(&graph, false, false, false)) return_defer(1);
+
+    stitch_log(INFO, "--- foo.o is gone ---");
+    if (!delete_file(GRAPH_FOLDER"foo.o")) return_defer(1);
+    if (!graph_build(&graph, 2)) return_defer(1);
+    if (!expect_dirty(&graph, true, true, false)) return_defer(1);
+
+    stitch_log(INFO, "--- main.o flags changed ---");
+    cmd_append(&graph.items[2].cmd, "-O2");
+    if (!graph_build(&graph, 2)) return_defer(1);
+    if (!expect_dirty(&graph, false, true, true)) return_defer(1);
+    if (!graph_build(&graph, 2)) return_defer(1);
+    if (!expect_dirty(&graph, false, false, false)) return_defer(1);
+
+    stitch_log(INFO, "--- cycle ---");
+    Target cycle = {0};
+    cmd_append(&cycle.cmd, "cc", "-c", "-o", GRAPH_FOLDER"foo.c", GRAPH_FOLDER"main");
+    target_inputs(&cycle, GRAPH_FOLDER"main");
+    target_outputs(&cycle, GRAPH_FOLDER"foo.c");
+    graph_add(&graph, cycle);
+    if (graph_build(&graph, 2)) return_defer(1);
+
+    stitch_log(INFO, "OK");
+
+defer:
+    graph_free(&graph);
+    return result;
+}
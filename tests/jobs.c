@@ -0,0 +1,61 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define JOBS_COUNT 8
+
+int main(void)
+{
+    int result = 0;
+
+    Cmd cmd = {0};
+    Jobs jobs = {.max_jobs = 3};
+    bool seen[JOBS_COUNT] = {0};
+
+    if (!build_tool(&cmd, "echo")) return_defer(1);
+
+    // The pool must leave the processes it did not start to their owner
+    cmd_append(&cmd, BUILD_FOLDER TOOLS_FOLDER "echo", "not a job");
+    Proc foreign = cmd_run_async_and_reset(&cmd);
+    if (foreign == INVALID_PROC) return_defer(1);
+
+    for (size_t i = 0; i < JOBS_COUNT; ++i) {
+        // Reap the jobs ourselves to check the result of every one of them
+        while (jobs_full(&jobs)) {
+            Job finished;
+            if (!jobs_wait_any(&jobs, &finished)) return_defer(1);
+            if (!finished.ok) return_defer(1);
+            seen[finished.tag] = true;
+        }
+        cmd_append(&cmd, BUILD_FOLDER TOOLS_FOLDER "echo", temp_sprintf("job %zu", i));
+        if (!jobs_start_and_reset(&jobs, &cmd, i)) return_defer(1);
+        if (jobs.running > jobs.max_jobs) {
+            stitch_log(ERROR, "%zu jobs are running with max_jobs = %zu", jobs.running, jobs.max_jobs);
+            return_defer(1);
+        }
+    }
+
+    Job finished;
+    while (jobs_wait_any(&jobs, &finished)) {
+        if (!finished.ok) return_defer(1);
+        seen[finished.tag] = true;
+    }
+
+    for (size_t i = 0; i < JOBS_COUNT; ++i) {
+        if (!seen[i]) {
+            stitch_log(ERROR, "job %zu was never reaped", i);
+            return_defer(1);
+        }
+    }
+
+    if (!jobs_wait_all(&jobs)) return_defer(1);
+    if (!proc_wait(foreign)) return_defer(1);
+
+    stitch_log(INFO, "OK");
+
+defer:
+    free(cmd.items);
+    jobs_free(jobs);
+    return result;
+}
@@ -0,0 +1,98 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+
+#define JOBS_COUNT 4
+#define LINES_COUNT 5
+
+// Runs the jobs that print their lines slowly enough to interleave if they are not buffered
+int child(Output_Policy policy)
+{
+    Jobs jobs = {.max_jobs = JOBS_COUNT, .output = policy};
+    Cmd cmd = {0};
+    minimal_log_level = WARNING;
+    for (size_t i = 0; i < JOBS_COUNT; ++i) {
+        const char *script = temp_sprintf("for i in 1 2 3 4 5; do echo job%zu line$i; sleep 0.01; done; exit %d", i, i == 1);
+        cmd_append(&cmd, "sh", "-c", script);
+        jobs_start_and_reset(&jobs, &cmd, i);
+    }
+    // Way more than the pipe can hold
+    cmd_append(&cmd, "sh", "-c", "head -c 200000 /dev/zero | tr '\\0' x");
+    jobs_start_and_reset(&jobs, &cmd, JOBS_COUNT);
+    jobs_wait_all(&jobs);
+    jobs_free(jobs);
+    cmd_free(cmd);
+    return 0;
+}
+
+size_t count_lines(String_View output, const char *needle)
+{
+    size_t count = 0;
+    while (output.count > 0) {
+        String_View line = sv_chop_by_delim(&output, '\n');
+        if (line.count >= strlen(needle) && memcmp(line.data, needle, strlen(needle)) == 0) count += 1;
+    }
+    return count;
+}
+
+bool run_child(const char *program, const char *policy, String_Builder *output)
+{
+    Cmd cmd = {0};
+    cmd_append(&cmd, program, policy);
+    output->count = 0;
+    bool ok = cmd_run_capture(cmd, (Cmd_Capture) {.err = output});
+    sb_append_null(output);
+    output->count -= 1;
+    cmd_free(cmd);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    const char *program = shift(argv, argc);
+    if (argc > 0) {
+        const char *policy = shift(argv, argc);
+        if (strcmp(policy, "buffer") == 0) return child(OUTPUT_BUFFER);
+        if (strcmp(policy, "failed") == 0) return child(OUTPUT_FAILED_ONLY);
+        return 1;
+    }
+
+    String_Builder output = {0};
+
+    stitch_log(INFO, "--- buffer ---");
+    if (!run_child(program, "buffer", &output)) return 1;
+    // The lines of every job must be contiguous
+    String_View sv = sb_to_sv(output);
+    for (size_t i = 0; i < JOBS_COUNT; ++i) {
+        const char *first = temp_sprintf("job%zu line1\n", i);
+        const char *start = strstr(output.items, first);
+        if (start == NULL) {
+            stitch_log(ERROR, "output of job%zu is missing", i);
+            return 1;
+        }
+        for (size_t j = 1; j <= LINES_COUNT; ++j) {
+            const char *expected = temp_sprintf("job%zu line%zu\n", i, j);
+            if (strncmp(start, expected, strlen(expected)) != 0) {
+                stitch_log(ERROR, "output of job%zu is interleaved:\n"SV_Fmt, i, SV_Arg(sv));
+                return 1;
+            }
+            start += strlen(expected);
+        }
+    }
+    if (output.count < 200000) {
+        stitch_log(ERROR, "the big output is missing");
+        return 1;
+    }
+
+    stitch_log(INFO, "--- failed only ---");
+    if (!run_child(program, "failed", &output)) return 1;
+    sv = sb_to_sv(output);
+    if (count_lines(sv, "job1 ") != LINES_COUNT || count_lines(sv, "job0 ") != 0 || output.count > 1024) {
+        stitch_log(ERROR, "expected only the output of the failed job:\n"SV_Fmt, SV_Arg(sv));
+        return 1;
+    }
+
+    sb_free(output);
+    stitch_log(INFO, "OK");
+    return 0;
+}
@@ -0,0 +1,55 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define MAP_FOLDER BUILD_FOLDER "map_file/"
+
+int main(void)
+{
+    Mapped_File file;
+    String_Builder sb = {0};
+
+    if (!mkdir_if_not_exists(MAP_FOLDER)) return 1;
+    const char *text = "Hello, World\n";
+    if (!write_entire_file(MAP_FOLDER"hello.txt", text, strlen(text))) return 1;
+    if (!write_entire_file(MAP_FOLDER"empty.txt", NULL, 0)) return 1;
+
+    if (!map_file(MAP_FOLDER"hello.txt", &file)) return 1;
+    if (!file.mapped || !sv_eq(file.content, sv_from_cstr(text))) {
+        stitch_log(ERROR, "expected a mapped `%s`, got "SV_Fmt" (mapped = %d)", text, SV_Arg(file.content), file.mapped);
+        return 1;
+    }
+    unmap_file(&file);
+
+    if (!map_file(MAP_FOLDER"empty.txt", &file)) return 1;
+    if (file.content.count != 0) {
+        stitch_log(ERROR, "expected an empty file, got %zu bytes", file.content.count);
+        return 1;
+    }
+    unmap_file(&file);
+
+    // The files in /proc report the size 0, but they are not empty
+    if (!map_file("/proc/self/status", &file)) return 1;
+    if (file.mapped || !sv_starts_with(file.content, sv_from_cstr("Name:"))) {
+        stitch_log(ERROR, "expected /proc/self/status to be read, got "SV_Fmt, SV_Arg(file.content));
+        return 1;
+    }
+    unmap_file(&file);
+    if (!read_entire_file("/proc/self/status", &sb)) return 1;
+    if (!sv_starts_with(sb_to_sv(sb), sv_from_cstr("Name:"))) {
+        stitch_log(ERROR, "read_entire_file() read "SV_Fmt" from /proc/self/status", (int) sb.count, sb.items);
+        return 1;
+    }
+
+    // read_entire_file() appends to what is already in the sb
+    size_t before = sb.count;
+    if (!read_entire_file(MAP_FOLDER"hello.txt", &sb)) return 1;
+    if (!sv_eq(sv_from_parts(sb.items + before, sb.count - before), sv_from_cstr(text))) return 1;
+
+    if (map_file(MAP_FOLDER"does-not-exist", &file)) return 1;
+
+    sb_free(sb);
+    stitch_log(INFO, "OK");
+    return 0;
+}
@@ -0,0 +1,61 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define INPUT_PATH BUILD_FOLDER "needs_rebuild_input.txt"
+#define OUTPUT_PATH BUILD_FOLDER "needs_rebuild_output.txt"
+
+bool set_mtime(const char *path, time_t sec, long nsec)
+{
+    struct timespec times[2] = {
+        {.tv_sec = sec, .tv_nsec = nsec},
+        {.tv_sec = sec, .tv_nsec = nsec},
+    };
+    if (utimensat(AT_FDCWD, path, times, 0) < 0) {
+        stitch_log(ERROR, "Could not set mtime of %s: %s", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool expect_rebuild(int expected)
+{
+    int actual = needs_rebuild1(OUTPUT_PATH, INPUT_PATH);
+    if (actual != expected) {
+        stitch_log(ERROR, "needs_rebuild1(): expected %d, got %d", expected, actual);
+        return false;
+    }
+    return true;
+}
+
+int main(void)
+{
+    if (!write_entire_file(INPUT_PATH, "input", 5)) return 1;
+    if (!write_entire_file(OUTPUT_PATH, "output", 6)) return 1;
+
+    // The input is newer by just a single nanosecond within the same second
+    if (!set_mtime(OUTPUT_PATH, 1000000000, 500)) return 1;
+    if (!set_mtime(INPUT_PATH, 1000000000, 501)) return 1;
+    if (!expect_rebuild(1)) return 1;
+    if (!set_mtime(INPUT_PATH, 1000000000, 499)) return 1;
+    if (!expect_rebuild(0)) return 1;
+
+    // Past Y2038
+    if (sizeof(time_t) > 4) {
+        if (!set_mtime(INPUT_PATH, 4102444800, 0)) return 1;
+        if (!expect_rebuild(1)) return 1;
+        if (!set_mtime(INPUT_PATH, 1000000000, 499)) return 1;
+    }
+
+    stat_cache_enabled = true;
+    if (!expect_rebuild(0)) return 1;
+    // The cache does not know the output was modified until it's told so
+    if (!set_mtime(OUTPUT_PATH, 999999999, 0)) return 1;
+    if (!expect_rebuild(0)) return 1;
+    stat_cache_invalidate(OUTPUT_PATH);
+    if (!expect_rebuild(1)) return 1;
+
+    stitch_log(INFO, "OK");
+    return 0;
+}
@@ -0,0 +1,91 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+
+bool run(Cmd *cmd, Proc_Result *result)
+{
+    Proc proc = cmd_run_async(*cmd);
+    cmd->count = 0;
+    return proc_wait_result(proc, result);
+}
+
+int main(void)
+{
+    Cmd cmd = {0};
+    Proc_Result result;
+
+    proc_stats_enabled = true;
+
+    cmd_append(&cmd, "sh", "-c", "exit 3");
+    if (run(&cmd, &result)) return 1;
+    if (result.ok || result.exit_code != 3 || result.signal != 0) {
+        stitch_log(ERROR, "expected exit code 3, got ok=%d exit_code=%d signal=%d", result.ok, result.exit_code, result.signal);
+        return 1;
+    }
+
+    cmd_append(&cmd, "sh", "-c", "kill -9 $$");
+    if (run(&cmd, &result)) return 1;
+    if (result.ok || result.exit_code != -1 || result.signal != 9) {
+        stitch_log(ERROR, "expected signal 9, got ok=%d exit_code=%d signal=%d", result.ok, result.exit_code, result.signal);
+        return 1;
+    }
+
+    cmd_append(&cmd, "sleep", "0.1");
+    if (!run(&cmd, &result)) return 1;
+    if (result.wall_ns < 100*1000*1000) {
+        stitch_log(ERROR, "expected at least 100ms of wall time, got %llu ns", (unsigned long long) result.wall_ns);
+        return 1;
+    }
+    if (result.max_rss == 0) {
+        stitch_log(ERROR, "expected the peak RSS to be reported");
+        return 1;
+    }
+
+    // A busy loop of the shell burns CPU time
+    cmd_append(&cmd, "sh", "-c", "i=0; while [ $i -lt 200000 ]; do i=$((i+1)); done");
+    Jobs jobs = {.max_jobs = 1};
+    if (!jobs_start_and_reset(&jobs, &cmd, 0)) return 1;
+    Job job;
+    if (!jobs_wait_any(&jobs, &job) || !job.ok) return 1;
+    if (job.result.user_ns + job.result.sys_ns == 0 || job.result.wall_ns == 0) {
+        stitch_log(ERROR, "expected the CPU time of the job to be reported");
+        return 1;
+    }
+    jobs_free(jobs);
+
+    proc_stats_report(3);
+    proc_stats_reset();
+
+    // The graph collects the stats only for the duration of the build
+    proc_stats_enabled = false;
+    Graph graph = {.report_top = 1};
+    Target target = {0};
+    cmd_append(&target.cmd, "true");
+    graph_add(&graph, target);
+    if (!graph_build(&graph, 0)) return 1;
+    if (proc_stats_enabled) {
+        stitch_log(ERROR, "the graph did not restore proc_stats_enabled");
+        return 1;
+    }
+    graph_free(&graph);
+
+    // The wall time does not depend on the stats or the trace
+    cmd_append(&cmd, "sleep", "0.1");
+    if (!run(&cmd, &result)) return 1;
+    if (result.wall_ns < 100*1000*1000) {
+        stitch_log(ERROR, "expected at least 100ms of wall time without the stats, got %llu ns", (unsigned long long) result.wall_ns);
+        return 1;
+    }
+    cmd_append(&cmd, "sleep", "0.1");
+    jobs = (Jobs) {.max_jobs = 1};
+    if (!jobs_start_and_reset(&jobs, &cmd, 0)) return 1;
+    if (!jobs_wait_any(&jobs, &job) || !job.ok) return 1;
+    if (job.result.wall_ns < 100*1000*1000) {
+        stitch_log(ERROR, "expected at least 100ms of wall time of the job without the stats, got %llu ns", (unsigned long long) job.result.wall_ns);
+        return 1;
+    }
+    jobs_free(jobs);
+
+    stitch_log(INFO, "OK");
+    return 0;
+}
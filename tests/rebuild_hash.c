@@ -0,0 +1,91 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define INPUT_PATH BUILD_FOLDER "rebuild_hash_input.txt"
+#define OUTPUT_PATH BUILD_FOLDER "rebuild_hash_output.txt"
+#define LOG_PATH BUILD_FOLDER "rebuild_hash.log"
+#define HASH_CACHE_PATH BUILD_FOLDER "rebuild_hash.cache"
+
+bool set_mtime(const char *path, time_t sec)
+{
+    struct timespec times[2] = {{.tv_sec = sec}, {.tv_sec = sec}};
+    if (utimensat(AT_FDCWD, path, times, 0) < 0) {
+        stitch_log(ERROR, "Could not set mtime of %s: %s", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool expect_rebuild(int expected)
+{
+    int actual = needs_rebuild1(OUTPUT_PATH, INPUT_PATH);
+    if (actual != expected) {
+        stitch_log(ERROR, "needs_rebuild1(): expected %d, got %d", expected, actual);
+        return false;
+    }
+    return true;
+}
+
+bool test_hash_vectors(void)
+{
+    struct {
+        const char *input;
+        uint64_t expected;
+    } vectors[] = {
+        {"", 0xEF46DB3751D8E999ULL},
+        {"a", 0xD24EC4F1A98C6E5BULL},
+        {"abc", 0x44BC2CF5AD770999ULL},
+        {"Nobody inspects the spammish repetition", 0xFBCEA83C8A378BF1ULL},
+    };
+    for (size_t i = 0; i < ARRAY_LEN(vectors); ++i) {
+        uint64_t actual = stitch_hash(vectors[i].input, strlen(vectors[i].input), 0);
+        if (actual != vectors[i].expected) {
+            stitch_log(ERROR, "stitch_hash(\"%s\"): expected %016llx, got %016llx", vectors[i].input,
+                       (unsigned long long) vectors[i].expected, (unsigned long long) actual);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(void)
+{
+    if (!test_hash_vectors()) return 1;
+
+    if (!write_entire_file(INPUT_PATH, "input", 5)) return 1;
+    if (!write_entire_file(OUTPUT_PATH, "output", 6)) return 1;
+    if (!set_mtime(INPUT_PATH, 1000000000)) return 1;
+    if (!set_mtime(OUTPUT_PATH, 1000000001)) return 1;
+    // NOTE: the log may be left over from the previous runs
+    if (file_exists(LOG_PATH) == 1 && !delete_file(LOG_PATH)) return 1;
+
+    rebuild_mode = REBUILD_HASH;
+    if (!build_log_open(LOG_PATH)) return 1;
+    // The output is adopted because it's newer than the input
+    if (!expect_rebuild(0)) return 1;
+
+    // Touching the input without changing it does not matter
+    if (!set_mtime(INPUT_PATH, 1000000002)) return 1;
+    if (!expect_rebuild(0)) return 1;
+
+    // Changing it does
+    if (!write_entire_file(INPUT_PATH, "changed input", 13)) return 1;
+    if (!expect_rebuild(1)) return 1;
+    if (!build_log_record(OUTPUT_PATH, (Cmd) {0}, (const char*[]) {INPUT_PATH}, 1)) return 1;
+    if (!expect_rebuild(0)) return 1;
+
+    // The log and the hash cache survive between the runs
+    build_log_close();
+    if (!hash_cache_save(HASH_CACHE_PATH)) return 1;
+    if (!hash_cache_load(HASH_CACHE_PATH)) return 1;
+    if (!build_log_open(LOG_PATH)) return 1;
+    if (!expect_rebuild(0)) return 1;
+    if (!write_entire_file(INPUT_PATH, "input", 5)) return 1;
+    if (!expect_rebuild(1)) return 1;
+    build_log_close();
+
+    stitch_log(INFO, "OK");
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <stdlib.h>
+
+static size_t allocations_count = 0;
+
+void *counting_realloc(void *ptr, size_t size)
+{
+    allocations_count += 1;
+    return realloc(ptr, size);
+}
+
+#define STITCH_REALLOC counting_realloc
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+
+Small_Cmd make_cmd(size_t flags_count)
+{
+    Small_Cmd cmd = {0};
+    small_cmd_append(&cmd, "cc", "-o", "main");
+    for (size_t i = 0; i < flags_count; ++i) small_cmd_append(&cmd, "-Wall");
+    small_cmd_append(&cmd, "main.c");
+    return cmd;
+}
+
+bool expect_render(Small_Cmd *cmd, size_t flags_count)
+{
+    String_Builder expected = {0};
+    String_Builder actual = {0};
+    sb_append_cstr(&expected, "cc -o main");
+    for (size_t i = 0; i < flags_count; ++i) sb_append_cstr(&expected, " -Wall");
+    sb_append_cstr(&expected, " main.c");
+    cmd_render(small_cmd_view(cmd), &actual);
+    bool ok = expected.count == actual.count && memcmp(expected.items, actual.items, actual.count) == 0;
+    if (!ok) stitch_log(ERROR, "with %zu flags got: %.*s", flags_count, (int) actual.count, actual.items);
+    sb_free(expected);
+    sb_free(actual);
+    return ok;
+}
+
+int main(void)
+{
+    // The short commands stay inline even after being returned by value
+    size_t before = allocations_count;
+    Small_Cmd cmd = make_cmd(STITCH_SMALL_CMD_CAP - 4);
+    if (allocations_count != before || cmd.heap != NULL) {
+        stitch_log(ERROR, "expected a command of %zu arguments to stay inline", cmd.count);
+        return 1;
+    }
+    if (!expect_render(&cmd, STITCH_SMALL_CMD_CAP - 4)) return 1;
+    small_cmd_free(&cmd);
+
+    // The long ones spill to the heap
+    for (size_t flags_count = STITCH_SMALL_CMD_CAP - 3; flags_count < 3*STITCH_SMALL_CMD_CAP; ++flags_count) {
+        cmd = make_cmd(flags_count);
+        if (cmd.heap == NULL) {
+            stitch_log(ERROR, "expected a command of %zu arguments to spill to the heap", cmd.count);
+            return 1;
+        }
+        if (!expect_render(&cmd, flags_count)) return 1;
+        small_cmd_free(&cmd);
+    }
+
+    // The regular commands start with their own capacity
+    Cmd regular = {0};
+    cmd_append(&regular, "cc");
+    if (regular.capacity != STITCH_CMD_INIT_CAP) {
+        stitch_log(ERROR, "expected the capacity of a new command to be %d, got %zu", STITCH_CMD_INIT_CAP, regular.capacity);
+        return 1;
+    }
+    cmd_free(regular);
+
+    // So do the arrays of the graph targets, including the edges filled in by the build
+    Graph graph = {0};
+    Target target = {0};
+    target_outputs(&target, "build/small_cmd_phony_a");
+    graph_add(&graph, target);
+    target = (Target) {0};
+    target_inputs(&target, "build/small_cmd_phony_a");
+    target_outputs(&target, "build/small_cmd_phony_b");
+    graph_add(&graph, target);
+    graph_build(&graph, 1);
+    if (graph.items[1].inputs.capacity != STITCH_TARGET_INIT_CAP ||
+        graph.items[0].outputs.capacity != STITCH_TARGET_INIT_CAP ||
+        graph.items[1].deps.capacity != STITCH_TARGET_INIT_CAP ||
+        graph.items[0].dependents.capacity != STITCH_TARGET_INIT_CAP) {
+        stitch_log(ERROR, "expected the arrays of a new target to start with the capacity %d", STITCH_TARGET_INIT_CAP);
+        return 1;
+    }
+    graph_free(&graph);
+
+    stitch_log(INFO, "OK");
+    return 0;
+}
@@ -22,8 +22,8 @@ void assert_false(const char *test_case, bool result)
 
 int main(void)
 {
-    Stich_String_View sv1 = stitch_sv_from_cstr("./example.exe");
-    Stich_String_View sv2 = stitch_sv_from_cstr("");
+    Stitch_String_View sv1 = stitch_sv_from_cstr("./example.exe");
+    Stitch_String_View sv2 = stitch_sv_from_cstr("");
 
     assert_true("stitch_sv_end_with(sv1, \"./example.exe\")", stitch_sv_end_with(sv1, "./example.exe"));
     assert_true("stitch_sv_end_with(sv1, \".exe\")", stitch_sv_end_with(sv1, ".exe"));
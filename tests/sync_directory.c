@@ -0,0 +1,91 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_USE_THREADS
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define SRC BUILD_FOLDER "sync_directory/src/"
+#define DST BUILD_FOLDER "sync_directory/dst/"
+
+bool write_cstr(const char *path, const char *content)
+{
+    return write_entire_file(path, content, strlen(content));
+}
+
+bool expect_contents(const char *path, const char *expected)
+{
+    String_Builder actual = {0};
+    bool ok = read_entire_file(path, &actual);
+    if (ok && (actual.count != strlen(expected) || memcmp(actual.items, expected, actual.count) != 0)) {
+        stitch_log(ERROR, "%s: expected `%s`, got `%.*s`", path, expected, (int) actual.count, actual.items);
+        ok = false;
+    }
+    sb_free(actual);
+    return ok;
+}
+
+bool is_symlink(const char *path)
+{
+    struct stat st;
+    return lstat(path, &st) == 0 && S_ISLNK(st.st_mode);
+}
+
+bool expect_same_mtime(const char *a, const char *b)
+{
+    struct stat sa, sb;
+    if (stat(a, &sa) < 0 || stat(b, &sb) < 0) return false;
+    if (sa.st_mtim.tv_sec != sb.st_mtim.tv_sec || sa.st_mtim.tv_nsec != sb.st_mtim.tv_nsec) {
+        stitch_log(ERROR, "%s and %s have different mtimes", a, b);
+        return false;
+    }
+    return true;
+}
+
+int main(void)
+{
+    Sync_Opt opt = {.threads = 4};
+
+    if (!mkdir_if_not_exists(BUILD_FOLDER "sync_directory")) return 1;
+    if (!mkdir_if_not_exists(SRC)) return 1;
+    if (!mkdir_if_not_exists(SRC "sub")) return 1;
+    for (size_t i = 0; i < 32; ++i) {
+        if (!write_cstr(temp_sprintf(SRC "sub/%zu", i), temp_sprintf("file %zu\n", i))) return 1;
+    }
+    if (!write_cstr(SRC "a", "aaa\n")) return 1;
+    unlink(SRC "link");
+    if (symlink("a", SRC "link") < 0) return 1;
+
+    stitch_log(INFO, "--- first sync ---");
+    if (!sync_directory(SRC, DST, opt)) return 1;
+    if (!expect_contents(DST "a", "aaa\n")) return 1;
+    if (!expect_contents(DST "sub/31", "file 31\n")) return 1;
+    if (!expect_same_mtime(SRC "sub/31", DST "sub/31")) return 1;
+    if (!is_symlink(DST "link") || !expect_contents(DST "link", "aaa\n")) return 1;
+
+    stitch_log(INFO, "--- changed files ---");
+    // Same size, but a different mtime
+    if (!write_cstr(DST "sub/0", "xxxx xx\n")) return 1;
+    if (!write_cstr(SRC "a", "a changed\n")) return 1;
+    if (!sync_directory(SRC, DST, opt)) return 1;
+    if (!expect_contents(DST "sub/0", "file 0\n")) return 1;
+    if (!expect_contents(DST "a", "a changed\n")) return 1;
+
+    stitch_log(INFO, "--- touched file ---");
+    // Same contents, but a different mtime. Hashing finds out it's up to date and fixes the mtime
+    if (!write_cstr(SRC "a", "a changed\n")) return 1;
+    opt.compare_contents = true;
+    if (!sync_directory(SRC, DST, opt)) return 1;
+    if (!expect_same_mtime(SRC "a", DST "a")) return 1;
+
+    stitch_log(INFO, "--- symlink at the destination ---");
+    // The copy must replace the symlink instead of writing to the file outside of the destination
+    if (!write_cstr(BUILD_FOLDER "sync_directory/outside", "outside\n")) return 1;
+    unlink(DST "a");
+    if (symlink("../outside", DST "a") < 0) return 1;
+    if (!sync_directory(SRC, DST, opt)) return 1;
+    if (is_symlink(DST "a") || !expect_contents(DST "a", "a changed\n")) return 1;
+    if (!expect_contents(BUILD_FOLDER "sync_directory/outside", "outside\n")) return 1;
+
+    stitch_log(INFO, "OK");
+    return 0;
+}
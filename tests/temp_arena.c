@@ -0,0 +1,57 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#define STITCH_ARENA_BLOCK_CAPACITY 1024
+#include "stitch.h"
+
+int main(void)
+{
+    // Way more than a single block, the old fixed buffer used to run out like that
+    size_t checkpoint = temp_save();
+    const char *first = temp_sprintf("path/number/%d", 0);
+    const char *last = NULL;
+    for (int i = 1; i < 100*1000; ++i) last = temp_sprintf("path/number/%d", i);
+    if (strcmp(first, "path/number/0") != 0 || strcmp(last, "path/number/99999") != 0) {
+        stitch_log(ERROR, "the earlier allocations got overwritten: %s, %s", first, last);
+        return 1;
+    }
+    char *big = temp_alloc(10*1024);
+    memset(big, 'x', 10*1024);
+
+    // Rewinding across the blocks keeps them for the future allocations
+    temp_rewind(checkpoint);
+    if (temp_save() != checkpoint) {
+        stitch_log(ERROR, "expected to rewind to %zu, got %zu", checkpoint, temp_save());
+        return 1;
+    }
+    const char *again = temp_strdup("path/number/0");
+    if (again != first) {
+        stitch_log(ERROR, "expected the rewound space to be reused");
+        return 1;
+    }
+
+    // Checkpoints at the very end of a block
+    Arena arena = {0};
+    for (int round = 0; round < 3; ++round) {
+        size_t inner = arena_save(&arena);
+        for (int i = 0; i < 1000; ++i) {
+            size_t mark = arena_save(&arena);
+            char *s = arena_sprintf(&arena, "%d", i);
+            arena_rewind(&arena, mark);
+            char *t = arena_sprintf(&arena, "%d", i);
+            if (s != t) {
+                stitch_log(ERROR, "round %d: expected %d to be allocated at the same place twice", round, i);
+                return 1;
+            }
+            void *aligned = arena_alloc(&arena, i%37);
+            if ((uintptr_t) aligned%16 != 0) {
+                stitch_log(ERROR, "arena_alloc() is not aligned");
+                return 1;
+            }
+        }
+        arena_rewind(&arena, inner);
+    }
+    arena_free(&arena);
+
+    stitch_log(INFO, "OK");
+    return 0;
+}
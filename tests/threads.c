@@ -0,0 +1,100 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define THREADS_FOLDER BUILD_FOLDER "threads/"
+#define THREADS_COUNT 8
+#define FILES_COUNT 16
+
+typedef struct {
+    size_t id;
+    uint64_t hashes[FILES_COUNT];
+    size_t deps_count;
+    bool ok;
+} Worker;
+
+const char *file_path(size_t i)
+{
+    return temp_sprintf(THREADS_FOLDER "file%zu.txt", i);
+}
+
+void *work(void *arg)
+{
+    Worker *worker = arg;
+    worker->ok = true;
+    for (size_t round = 0; round < 100 && worker->ok; ++round) {
+        // The temporary allocator of every thread is its own
+        size_t checkpoint = temp_save();
+        const char *mine = temp_sprintf("worker %zu round %zu", worker->id, round);
+        for (size_t i = 0; i < 100; ++i) temp_sprintf("%zu-%zu", worker->id, i);
+        if (strcmp(mine, temp_sprintf("worker %zu round %zu", worker->id, round)) != 0) {
+            stitch_log(ERROR, "worker %zu: the temporary string got overwritten: %s", worker->id, mine);
+            worker->ok = false;
+        }
+
+        for (size_t i = 0; i < FILES_COUNT && worker->ok; ++i) {
+            size_t j = (i + worker->id)%FILES_COUNT;
+            if (file_hash(file_path(j), &worker->hashes[j]) != 1) worker->ok = false;
+        }
+
+        // The writers of the same file must not trip over each other's temporary files
+        const char *shared = "written by every worker";
+        if (!write_entire_file_atomic(THREADS_FOLDER "shared.txt", shared, strlen(shared))) worker->ok = false;
+
+        File_Paths deps = {0};
+        if (depfile_deps(THREADS_FOLDER "main.d", &deps) != 1) worker->ok = false;
+        worker->deps_count = deps.count;
+        da_free(deps);
+        temp_rewind(checkpoint);
+    }
+    temp_free();
+    return NULL;
+}
+
+int main(void)
+{
+    if (!mkdir_if_not_exists(THREADS_FOLDER)) return 1;
+    for (size_t i = 0; i < FILES_COUNT; ++i) {
+        const char *content = temp_sprintf("file number %zu", i);
+        if (!write_entire_file(file_path(i), content, strlen(content))) return 1;
+    }
+    const char *depfile = THREADS_FOLDER "main.o: main.c a.h b.h \\\n c.h\n";
+    if (!write_entire_file(THREADS_FOLDER "main.d", depfile, strlen(depfile))) return 1;
+
+    stat_cache_enabled = true;
+    Worker workers[THREADS_COUNT] = {0};
+    pthread_t threads[THREADS_COUNT];
+    for (size_t i = 0; i < THREADS_COUNT; ++i) {
+        workers[i].id = i;
+        if (pthread_create(&threads[i], NULL, work, &workers[i]) != 0) {
+            stitch_log(ERROR, "Could not create thread %zu", i);
+            return 1;
+        }
+    }
+    // Logging and changing the log level in the meantime is fine too
+    for (size_t i = 0; i < 100; ++i) {
+        set_minimal_log_level(i%2 ? NO_LOGS : ERROR);
+        stitch_log(INFO, "YOU SHOULD NEVER SEE THIS");
+    }
+    set_minimal_log_level(INFO);
+    for (size_t i = 0; i < THREADS_COUNT; ++i) pthread_join(threads[i], NULL);
+
+    for (size_t i = 0; i < THREADS_COUNT; ++i) {
+        if (!workers[i].ok) return 1;
+        if (workers[i].deps_count != 4) {
+            stitch_log(ERROR, "worker %zu: expected 4 deps, got %zu", i, workers[i].deps_count);
+            return 1;
+        }
+        for (size_t j = 0; j < FILES_COUNT; ++j) {
+            const char *content = temp_sprintf("file number %zu", j);
+            if (workers[i].hashes[j] != stitch_hash(content, strlen(content), 0)) {
+                stitch_log(ERROR, "worker %zu: wrong hash of %s", i, file_path(j));
+                return 1;
+            }
+        }
+    }
+
+    stitch_log(INFO, "OK");
+    return 0;
+}
@@ -0,0 +1,66 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define TRACE_PATH BUILD_FOLDER "trace.json"
+
+size_t count_occurrences(const char *haystack, const char *needle)
+{
+    size_t count = 0;
+    for (const char *p = strstr(haystack, needle); p != NULL; p = strstr(p + 1, needle)) count += 1;
+    return count;
+}
+
+bool expect_contains(const char *trace, const char *needle, size_t expected)
+{
+    size_t actual = count_occurrences(trace, needle);
+    if (actual != expected) {
+        stitch_log(ERROR, "expected %zu occurrences of `%s` in the trace, got %zu", expected, needle, actual);
+        return false;
+    }
+    return true;
+}
+
+int main(void)
+{
+    Cmd cmd = {0};
+    String_Builder trace = {0};
+
+    if (!trace_begin(TRACE_PATH)) return 1;
+
+    cmd_append(&cmd, "sh", "-c", "echo \"quoted\"");
+    if (!cmd_run_sync_and_reset(&cmd)) return 1;
+
+    // Three commands running at the same time occupy three lanes
+    Jobs jobs = {.max_jobs = 3};
+    for (size_t i = 0; i < 3; ++i) {
+        cmd_append(&cmd, "sleep", "0.05");
+        if (!jobs_start_and_reset(&jobs, &cmd, i)) return 1;
+    }
+    if (!jobs_wait_all(&jobs)) return 1;
+    jobs_free(jobs);
+
+    cmd_append(&cmd, "sh", "-c", "exit 3");
+    if (cmd_run_sync_and_reset(&cmd)) return 1;
+
+    trace_end();
+
+    if (!read_entire_file(TRACE_PATH, &trace)) return 1;
+    bool is_array = trace.count > 0 && trace.items[0] == '[' && sv_end_with(sb_to_sv(trace), "]\n");
+    sb_append_null(&trace);
+    if (!is_array) {
+        stitch_log(ERROR, "the trace is not a JSON array:\n%s", trace.items);
+        return 1;
+    }
+    if (!expect_contains(trace.items, "\"ph\":\"X\"", 5)) return 1;
+    if (!expect_contains(trace.items, "\"name\":\"sleep\"", 3)) return 1;
+    if (!expect_contains(trace.items, "\"tid\":2,", 1)) return 1;
+    if (!expect_contains(trace.items, "\"status\":3,", 1)) return 1;
+    if (!expect_contains(trace.items, "echo \\\"quoted\\\"", 1)) return 1;
+
+    sb_free(trace);
+    cmd_free(cmd);
+    stitch_log(INFO, "OK");
+    return 0;
+}
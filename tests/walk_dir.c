@@ -0,0 +1,89 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define WALK_FOLDER BUILD_FOLDER "walk_dir"
+
+int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const Walk_Entry*) a)->path, ((const Walk_Entry*) b)->path);
+}
+
+bool expect_paths(Walk_Entries *entries, const char **expected, size_t expected_count)
+{
+    qsort(entries->items, entries->count, sizeof(*entries->items), compare_entries);
+    bool ok = entries->count == expected_count;
+    for (size_t i = 0; ok && i < expected_count; ++i) {
+        ok = strcmp(entries->items[i].path, expected[i]) == 0;
+    }
+    if (!ok) {
+        stitch_log(ERROR, "Unexpected entries:");
+        for (size_t i = 0; i < entries->count; ++i) stitch_log(ERROR, "    %s", entries->items[i].path);
+    }
+    entries->count = 0;
+    return ok;
+}
+
+bool not_main(const Walk_Entry *entry, void *data)
+{
+    UNUSED(data);
+    return strcmp(entry->name, "main.c") != 0;
+}
+
+int main(void)
+{
+    Walk_Entries entries = {0};
+
+    const char *dirs[] = {WALK_FOLDER, WALK_FOLDER"/src", WALK_FOLDER"/src/lib", WALK_FOLDER"/build", WALK_FOLDER"/.git"};
+    for (size_t i = 0; i < ARRAY_LEN(dirs); ++i) {
+        if (!mkdir_if_not_exists(dirs[i])) return 1;
+    }
+    const char *files[] = {
+        WALK_FOLDER"/src/main.c", WALK_FOLDER"/src/main.o", WALK_FOLDER"/src/lib/lib.c", WALK_FOLDER"/src/lib/lib.h",
+        WALK_FOLDER"/build/out.c", WALK_FOLDER"/.git/HEAD", WALK_FOLDER"/README.md",
+    };
+    for (size_t i = 0; i < ARRAY_LEN(files); ++i) {
+        if (!write_entire_file(files[i], "", 0)) return 1;
+    }
+    unlink(WALK_FOLDER"/src/link.c");
+    if (symlink("main.c", WALK_FOLDER"/src/link.c") < 0) return 1;
+
+    if (!walk_dir(WALK_FOLDER, (Walk_Opt) {0}, &entries)) return 1;
+    const char *all[] = {
+        WALK_FOLDER"/README.md", WALK_FOLDER"/build/out.c", WALK_FOLDER"/src/lib/lib.c", WALK_FOLDER"/src/lib/lib.h",
+        WALK_FOLDER"/src/link.c", WALK_FOLDER"/src/main.c", WALK_FOLDER"/src/main.o",
+    };
+    if (!expect_paths(&entries, all, ARRAY_LEN(all))) return 1;
+
+    const char *prune[] = {"build"};
+    const char *include[] = {".c", ".h"};
+    const char *exclude[] = {".h"};
+    Walk_Opt opt = {
+        .prune = prune, .prune_count = ARRAY_LEN(prune),
+        .include = include, .include_count = ARRAY_LEN(include),
+        .exclude = exclude, .exclude_count = ARRAY_LEN(exclude),
+    };
+    if (!walk_dir(WALK_FOLDER, opt, &entries)) return 1;
+    const char *sources[] = {WALK_FOLDER"/src/lib/lib.c", WALK_FOLDER"/src/link.c", WALK_FOLDER"/src/main.c"};
+    if (!expect_paths(&entries, sources, ARRAY_LEN(sources))) return 1;
+
+    opt.filter = not_main;
+    if (!walk_dir(WALK_FOLDER, opt, &entries)) return 1;
+    for (size_t i = 0; i < entries.count; ++i) {
+        if (strcmp(entries.items[i].path, WALK_FOLDER"/src/link.c") == 0 && entries.items[i].type != FILE_SYMLINK) {
+            stitch_log(ERROR, "the symlink was reported as %d", entries.items[i].type);
+            return 1;
+        }
+    }
+    const char *filtered[] = {WALK_FOLDER"/src/lib/lib.c", WALK_FOLDER"/src/link.c"};
+    if (!expect_paths(&entries, filtered, ARRAY_LEN(filtered))) return 1;
+
+    if (!walk_dir(WALK_FOLDER, (Walk_Opt) {.dirs = true, .hidden = true, .max_depth = 1}, &entries)) return 1;
+    const char *top[] = {WALK_FOLDER"/.git", WALK_FOLDER"/README.md", WALK_FOLDER"/build", WALK_FOLDER"/src"};
+    if (!expect_paths(&entries, top, ARRAY_LEN(top))) return 1;
+
+    walk_entries_free(&entries);
+    stitch_log(INFO, "OK");
+    return 0;
+}
@@ -0,0 +1,134 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define WATCH_FOLDER BUILD_FOLDER "watch/"
+#define IN_A WATCH_FOLDER "in_a"
+#define IN_B WATCH_FOLDER "in_b"
+#define HEADER WATCH_FOLDER "header"
+#define OUT_A WATCH_FOLDER "out_a"
+#define OUT_B WATCH_FOLDER "out_b"
+
+#ifdef __linux__
+bool set_mtime(const char *path, time_t sec)
+{
+    struct timespec times[2] = {{.tv_sec = sec}, {.tv_sec = sec}};
+    if (utimensat(AT_FDCWD, path, times, 0) < 0) {
+        stitch_log(ERROR, "Could not set mtime of %s: %s", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// The outputs are made older than any change of the inputs the test does, but newer than the initial inputs
+void add_copy(Graph *graph, const char *input, const char *output, const char *depfile)
+{
+    Target target = {0};
+    const char *script = temp_sprintf("cp %s %s && touch -t 200001010000 %s", input, output, output);
+    if (depfile) script = temp_sprintf("%s && printf '%%s: %%s\\n' %s %s > %s", script, output, HEADER, depfile);
+    cmd_append(&target.cmd, "sh", "-c", script);
+    target_inputs(&target, input);
+    target_outputs(&target, output);
+    target.depfile = depfile;
+    graph_add(graph, target);
+}
+
+bool expect_rebuilt(const Graph *graph, size_t index, bool expected, size_t build)
+{
+    bool rebuilt = graph->items[index].end_ns != 0;
+    if (rebuilt != expected) {
+        stitch_log(ERROR, "build %zu: expected %s to be %s", build, graph->items[index].outputs.items[0], expected ? "rebuilt" : "up to date");
+        return false;
+    }
+    return true;
+}
+
+typedef struct {
+    size_t builds;
+    bool failed;    // Returning false from after_build() only stops watching, so the failures are recorded here
+} Watch_State;
+
+// Checks the build that has just finished and makes the next change
+bool check_build(Graph *graph, bool ok, size_t build)
+{
+    if (!ok) return false;
+    // Every change has to rebuild the first target and only it
+    if (!expect_rebuilt(graph, 0, true, build)) return false;
+    if (!expect_rebuilt(graph, 1, build == 1, build)) return false;
+    switch (build) {
+    case 1:
+        // The unrelated file must not trigger anything on its own
+        if (!write_entire_file(WATCH_FOLDER "unrelated", "x", 1)) return false;
+        return write_entire_file(IN_A, "new a", 5);
+    case 2: {
+        String_Builder sb = {0};
+        if (!read_entire_file(OUT_A, &sb)) return false;
+        bool same = sb.count == 5 && memcmp(sb.items, "new a", 5) == 0;
+        sb_free(sb);
+        if (!same) {
+            stitch_log(ERROR, "%s was not updated", OUT_A);
+            return false;
+        }
+        // Comes from the depfile
+        return write_entire_file(HEADER, "new header", 10);
+    }
+    case 3:
+        return true;
+    default:
+        stitch_log(ERROR, "unexpected build %zu", build);
+        return false;
+    }
+}
+
+bool after_build(Graph *graph, bool ok, void *data)
+{
+    Watch_State *state = data;
+    state->builds += 1;
+    if (!check_build(graph, ok, state->builds)) {
+        state->failed = true;
+        return false;
+    }
+    return state->builds < 3;
+}
+#endif // __linux__
+
+int main(void)
+{
+#ifdef __linux__
+    int result = 0;
+    Graph graph = {0};
+    Watch_State state = {0};
+
+    // Do not hang forever if the changes are never noticed
+    alarm(10);
+
+    if (!mkdir_if_not_exists(WATCH_FOLDER)) return_defer(1);
+    const char *paths[] = {OUT_A, OUT_B, WATCH_FOLDER "a.d"};
+    for (size_t i = 0; i < ARRAY_LEN(paths); ++i) {
+        if (file_exists(paths[i]) > 0 && !delete_file(paths[i])) return_defer(1);
+    }
+    if (!write_entire_file(IN_A, "a", 1)) return_defer(1);
+    if (!write_entire_file(IN_B, "b", 1)) return_defer(1);
+    if (!write_entire_file(HEADER, "header", 6)) return_defer(1);
+    if (!set_mtime(IN_A, 500) || !set_mtime(IN_B, 500) || !set_mtime(HEADER, 500)) return_defer(1);
+
+    add_copy(&graph, IN_A, OUT_A, WATCH_FOLDER "a.d");
+    add_copy(&graph, IN_B, OUT_B, NULL);
+
+    if (!graph_watch(&graph, (Watch_Opt) {.after_build = after_build, .data = &state})) return_defer(1);
+    if (state.failed) return_defer(1);
+    if (state.builds != 3) {
+        stitch_log(ERROR, "expected 3 builds, got %zu", state.builds);
+        return_defer(1);
+    }
+    stitch_log(INFO, "OK");
+
+defer:
+    graph_free(&graph);
+    return result;
+#else
+    stitch_log(INFO, "OK");
+    return 0;
+#endif // __linux__
+}
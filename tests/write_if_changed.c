@@ -0,0 +1,92 @@
+#define STITCH_IMPLEMENTATION
+#define STITCH_STRIP_PREFIX
+#include "stitch.h"
+#include "shared.h"
+
+#define WRITE_FOLDER BUILD_FOLDER "write_if_changed/"
+#define CONFIG_PATH WRITE_FOLDER "config.h"
+
+long long mtime_of(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) < 0) return -1;
+    return (long long) st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+}
+
+bool expect_written(const char *content, int expected)
+{
+    int actual = write_entire_file_if_changed(CONFIG_PATH, content, strlen(content));
+    if (actual != expected) {
+        stitch_log(ERROR, "writing `%s`: expected %d, got %d", content, expected, actual);
+        return false;
+    }
+    return true;
+}
+
+int main(void)
+{
+    File_Paths children = {0};
+    String_Builder sb = {0};
+
+    if (!mkdir_if_not_exists(WRITE_FOLDER)) return 1;
+    if (file_exists(CONFIG_PATH) > 0 && !delete_file(CONFIG_PATH)) return 1;
+
+    if (!expect_written("#define FOO\n", 1)) return 1;
+    long long mtime = mtime_of(CONFIG_PATH);
+    if (mtime < 0) return 1;
+
+    // The same content does not touch the file
+    if (!expect_written("#define FOO\n", 0)) return 1;
+    if (mtime_of(CONFIG_PATH) != mtime) {
+        stitch_log(ERROR, "the mtime of the unchanged file was updated");
+        return 1;
+    }
+
+    // Same size, different content
+    if (!expect_written("#define BAR\n", 1)) return 1;
+    if (!read_entire_file(CONFIG_PATH, &sb)) return 1;
+    if (!sv_eq(sb_to_sv(sb), sv_from_cstr("#define BAR\n"))) return 1;
+
+    if (!expect_written("", 1)) return 1;
+    if (!expect_written("", 0)) return 1;
+
+    // The mode of the replaced file is kept
+    if (chmod(CONFIG_PATH, 0755) < 0) return 1;
+    if (!expect_written("#!/bin/sh\n", 1)) return 1;
+    struct stat st;
+    if (stat(CONFIG_PATH, &st) < 0 || (st.st_mode & 07777) != 0755) {
+        stitch_log(ERROR, "the mode of the replaced file was not kept");
+        return 1;
+    }
+
+    // The file a symlink points to is replaced instead of the symlink
+    const char *link_path = WRITE_FOLDER "link.h";
+    if (file_exists(link_path) > 0 && !delete_file(link_path)) return 1;
+    if (symlink("config.h", link_path) < 0) {
+        stitch_log(ERROR, "Could not create symlink %s: %s", link_path, strerror(errno));
+        return 1;
+    }
+    if (write_entire_file_if_changed(link_path, "#define LINK\n", 13) != 1) return 1;
+    if (get_file_type(link_path) != FILE_REGULAR || lstat(link_path, &st) < 0 || !S_ISLNK(st.st_mode)) {
+        stitch_log(ERROR, "the symlink was replaced by a regular file");
+        return 1;
+    }
+    sb.count = 0;
+    if (!read_entire_file(CONFIG_PATH, &sb)) return 1;
+    if (!sv_eq(sb_to_sv(sb), sv_from_cstr("#define LINK\n"))) {
+        stitch_log(ERROR, "the target of the symlink was not written");
+        return 1;
+    }
+
+    // Nothing is left behind by the atomic writes
+    if (!read_entire_dir(WRITE_FOLDER, &children)) return 1;
+    for (size_t i = 0; i < children.count; ++i) {
+        if (strstr(children.items[i], "stitch-tmp")) {
+            stitch_log(ERROR, "temporary file %s was left behind", children.items[i]);
+            return 1;
+        }
+    }
+
+    stitch_log(INFO, "OK");
+    return 0;
+}